@@ -0,0 +1,528 @@
+// Microbenchmarks of the emulator and the drivers.
+//
+// usage: vst2413-bench [--quick] [--filter text] [--counters] [--json file]
+//                      [--compare file] [--threshold percent] [--trace file]
+//
+// The render cases report ns/sample, the realtime factor (seconds of audio
+// rendered per second of CPU) and the voices per core. The other cases
+// report ns per call. --json saves the results, and --compare checks them
+// against a saved file; the exit code is 1 when a case got slower than
+// the threshold (10% by default).
+//
+// --counters adds the hardware performance counters (cycles, instructions,
+// L1 and LLC misses, branch misses) of an extra trial of each case, per
+// sample and per voice (Linux only; see PerfCounters.h).
+//
+// --trace writes the timeline as a Chrome trace (with VST2413_TRACE; see
+// Trace.h). Use it with --filter, as the buffers fill up quickly.
+//
+// Built as vst2413-bench by CMakeLists.txt.
+
+#include "CpuDispatch.h"
+#include "PerfCounters.h"
+#include "QualityGovernor.h"
+#include "RhythmDriver.h"
+#include "SynthDriver.h"
+#include "Trace.h"
+#include "emu2413/emu2413.h"
+#include <cmath>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace {
+    const unsigned int kMasterClock = 3579545;
+    const unsigned int kSampleRates[] = { 44100, 48000, 96000 };
+    const int kBlockSizes[] = { 1, 16, 64, 256, 1024, 4096 };
+    const int kMaxBlockSize = 4096;
+    
+    // Measuring time of each trial (sec).
+    double trialTime = 0.1;
+    const int kTrials = 3;
+    
+    struct Result {
+        std::string name_;
+        double ns_;             // per sample or per call
+        unsigned int sampleRate_;   // 0 for the non-render cases
+        int voices_;
+        bool counted_;
+        double counters_[PerfCounters::kCounters];  // per sample or call
+    };
+    
+    std::vector<Result> results;
+    const char* filter = 0;
+    PerfCounters* counters = 0;
+
+#pragma mark Measurement
+
+    class Case {
+    public:
+        virtual ~Case() {}
+        // Runs the case for the count of units (samples or calls).
+        virtual void Run(int count) = 0;
+    };
+    
+    // Best time of the trials in ns per unit, and the counters of one more.
+    void Measure(Case& c, Result& result) {
+        // Find the count which takes about the trial time.
+        int count = 1;
+        for (;;) {
+            double start = QualityGovernor::GetTime();
+            c.Run(count);
+            double elapsed = QualityGovernor::GetTime() - start;
+            if (elapsed >= trialTime * 0.1 || count >= (1 << 28)) {
+                double scale = elapsed > 0 ? trialTime / elapsed : 16;
+                count = static_cast<int>(count * (scale < 16 ? scale : 16)) + 1;
+                break;
+            }
+            count *= 2;
+        }
+        double best = 0;
+        for (int i = 0; i < kTrials; i++) {
+            double start = QualityGovernor::GetTime();
+            c.Run(count);
+            double ns = (QualityGovernor::GetTime() - start) * 1e9 / count;
+            if (i == 0 || ns < best) best = ns;
+        }
+        result.ns_ = best;
+        
+        result.counted_ = counters != 0;
+        if (counters) {
+            counters->Start();
+            c.Run(count);
+            counters->Stop();
+            for (int i = 0; i < PerfCounters::kCounters; i++) {
+                result.counters_[i] = counters->GetValue(static_cast<PerfCounters::CounterID>(i)) / count;
+            }
+        }
+    }
+    
+    bool Selected(const std::string& name) {
+        return !filter || name.find(filter) != std::string::npos;
+    }
+    
+    void PrintCounters(const char* label, const Result& result, int divisor) {
+        std::printf("    %-11s", label);
+        for (int i = 0; i < PerfCounters::kCounters; i++) {
+            PerfCounters::CounterID id = static_cast<PerfCounters::CounterID>(i);
+            if (counters->IsCounting(id)) std::printf(" %s %.3g", PerfCounters::GetName(id), result.counters_[i] / divisor);
+        }
+        if (divisor == 1 && counters->IsCounting(PerfCounters::kCycles) && counters->IsCounting(PerfCounters::kInstructions)
+            && result.counters_[PerfCounters::kCycles] > 0) {
+            std::printf(" (ipc %.2f)", result.counters_[PerfCounters::kInstructions] / result.counters_[PerfCounters::kCycles]);
+        }
+        std::printf("\n");
+    }
+    
+    void Report(const std::string& name, Case& c, unsigned int sampleRate = 0, int voices = 0) {
+        Result result;
+        result.name_ = name;
+        result.sampleRate_ = sampleRate;
+        result.voices_ = voices;
+        Measure(c, result);
+        results.push_back(result);
+        if (sampleRate > 0) {
+            double factor = 1e9 / sampleRate / result.ns_;
+            std::printf("%-36s %10.2f ns/sample %10.1fx realtime %8.0f voices/core\n",
+                        name.c_str(), result.ns_, factor, factor * voices);
+        } else {
+            std::printf("%-36s %10.2f ns/call\n", name.c_str(), result.ns_);
+        }
+        if (result.counted_) {
+            PrintCounters(sampleRate > 0 ? "per sample" : "per call", result, 1);
+            if (sampleRate > 0 && voices > 0) PrintCounters("per voice", result, voices);
+        }
+        std::fflush(stdout);
+    }
+    
+    std::string Name(const char* format, ...) {
+        char buffer[128];
+        va_list args;
+        va_start(args, format);
+        std::vsnprintf(buffer, sizeof buffer, format, args);
+        va_end(args);
+        return buffer;
+    }
+
+#pragma mark
+#pragma mark Emulator cases
+
+    // A chip playing all the channels with the different presets.
+    OPLL* NewPlayingChip(unsigned int sampleRate, int quality, bool rhythm) {
+        OPLL* opll = OPLL_new(kMasterClock, sampleRate);
+        OPLL_set_quality(opll, quality);
+        for (int ch = 0; ch < 9; ch++) {
+            OPLL_writeReg(opll, 0x10 + ch, 0x40 + ch * 17);
+            OPLL_writeReg(opll, 0x30 + ch, ((ch + 1) << 4) + ch);
+            OPLL_writeReg(opll, 0x20 + ch, 0x10 + 0x08 + (ch & 3) * 2);
+        }
+        if (rhythm) OPLL_writeReg(opll, 0x0e, 0x3f);
+        return opll;
+    }
+    
+    class EmuCalc : public Case {
+    public:
+        EmuCalc(unsigned int sampleRate, int quality, bool stereo) : opll_(NewPlayingChip(sampleRate, quality, false)), stereo_(stereo) {}
+        ~EmuCalc() { OPLL_delete(opll_); }
+        void Run(int count) {
+            if (stereo_) {
+                e_int32 out[2];
+                for (int i = 0; i < count; i++) OPLL_calc_stereo(opll_, out);
+            } else {
+                for (int i = 0; i < count; i++) OPLL_calc(opll_);
+            }
+        }
+    private:
+        OPLL* opll_;
+        bool stereo_;
+    };
+    
+    class EmuBlock : public Case {
+    public:
+        EmuBlock(unsigned int sampleRate, int quality, bool rhythm, int blockSize)
+        :   opll_(NewPlayingChip(sampleRate, quality, rhythm)), blockSize_(blockSize) {}
+        ~EmuBlock() { OPLL_delete(opll_); }
+        void Run(int count) {
+            for (int i = 0; i < count; i += blockSize_) {
+                int length = count - i < blockSize_ ? count - i : blockSize_;
+                OPLL_calc_block(opll_, buffer_, length);
+            }
+        }
+    private:
+        OPLL* opll_;
+        int blockSize_;
+        e_int32 buffer_[kMaxBlockSize];
+    };
+    
+    // Writes to a class of registers (first register, count, value mask).
+    class EmuWriteReg : public Case {
+    public:
+        EmuWriteReg(int first, int registers, int mask)
+        :   opll_(NewPlayingChip(44100, 0, false)), first_(first), registers_(registers), mask_(mask) {}
+        ~EmuWriteReg() { OPLL_delete(opll_); }
+        void Run(int count) {
+            for (int i = 0; i < count; i++) {
+                OPLL_writeReg(opll_, first_ + i % registers_, (i * 37) & mask_);
+            }
+        }
+    private:
+        OPLL* opll_;
+        int first_;
+        int registers_;
+        int mask_;
+    };
+    
+    class EmuNew : public Case {
+    public:
+        void Run(int count) {
+            for (int i = 0; i < count; i++) OPLL_delete(OPLL_new(kMasterClock, 44100));
+        }
+    };
+    
+    class EmuReset : public Case {
+    public:
+        EmuReset() : opll_(NewPlayingChip(44100, 0, false)) {}
+        ~EmuReset() { OPLL_delete(opll_); }
+        void Run(int count) {
+            for (int i = 0; i < count; i++) OPLL_reset(opll_);
+        }
+    private:
+        OPLL* opll_;
+    };
+
+#pragma mark
+#pragma mark Driver cases
+
+    // A driver holding a note on each of its channels.
+    class SynthCase : public Case {
+    public:
+        SynthCase(unsigned int sampleRate, int chips) : driver_(sampleRate) {
+            driver_.Prepare();
+            driver_.SetChipCount(chips);
+            driver_.SetQualityTier(QualityGovernor::kTierDirect);
+            for (int i = 0; i < chips * SynthDriver::kChannels; i++) driver_.KeyOn(i % SynthDriver::kParts, 36 + i, 0.8f);
+        }
+    protected:
+        SynthDriver driver_;
+    };
+    
+    class SynthKey : public SynthCase {
+    public:
+        SynthKey() : SynthCase(44100, 1) {}
+        // Calls are paired; the time is per call.
+        void Run(int count) {
+            for (int i = 0; i < count; i += 2) {
+                driver_.KeyOn(15, 60 + (i & 15), 0.5f);
+                driver_.KeyOff(15, 60 + (i & 15));
+            }
+        }
+    };
+    
+    class SynthPitchWheel : public SynthCase {
+    public:
+        SynthPitchWheel() : SynthCase(44100, 1) {}
+        void Run(int count) {
+            for (int i = 0; i < count; i++) driver_.SetPitchWheel(i & 15, (i & 1) ? 0.5f : -0.5f);
+        }
+    };
+    
+    class SynthParameter : public SynthCase {
+    public:
+        SynthParameter() : SynthCase(44100, 1) {}
+        void Run(int count) {
+            for (int i = 0; i < count; i++) {
+                driver_.SetParameter(SynthDriver::kParameterAR0, (i & 15) * (1.0f / 15));
+            }
+        }
+    };
+    
+    class SynthRender : public SynthCase {
+    public:
+        SynthRender(unsigned int sampleRate, int chips, int blockSize) : SynthCase(sampleRate, chips), blockSize_(blockSize) {}
+        void Run(int count) {
+            for (int i = 0; i < count; i += blockSize_) {
+                int length = count - i < blockSize_ ? count - i : blockSize_;
+                driver_.Render(buffer_, length);
+            }
+        }
+    private:
+        int blockSize_;
+        float buffer_[kMaxBlockSize];
+    };
+    
+    class RhythmRender : public Case {
+    public:
+        RhythmRender(unsigned int sampleRate, bool cached, int blockSize) : driver_(sampleRate), blockSize_(blockSize), position_(0) {
+            driver_.SetCachedMode(cached);
+            driver_.Prepare();
+            driver_.SetQualityTier(QualityGovernor::kTierDirect);
+        }
+        void Run(int count) {
+            for (int i = 0; i < count; i += blockSize_) {
+                // A hit on each drum every 4096 samples.
+                if (position_ == 0) {
+                    for (int note = 35; note < 52; note++) driver_.KeyOn(note, 0.8f);
+                }
+                int length = count - i < blockSize_ ? count - i : blockSize_;
+                driver_.Render(buffer_, length);
+                position_ = (position_ + length) & (kMaxBlockSize - 1);
+            }
+        }
+    private:
+        RhythmDriver driver_;
+        int blockSize_;
+        int position_;
+        float buffer_[kMaxBlockSize];
+    };
+
+#pragma mark
+#pragma mark Case list
+
+    void RunEmulatorCases() {
+        for (int r = 0; r < 3; r++) {
+            unsigned int rate = kSampleRates[r];
+            for (int quality = 0; quality < 2; quality++) {
+                std::string name = Name("emu/calc/%u/q%d", rate, quality);
+                if (Selected(name)) { EmuCalc c(rate, quality, false); Report(name, c, rate, 9); }
+                name = Name("emu/calc_stereo/%u/q%d", rate, quality);
+                if (Selected(name)) { EmuCalc c(rate, quality, true); Report(name, c, rate, 9); }
+            }
+        }
+        for (int quality = 0; quality < 2; quality++) {
+            for (int rhythm = 0; rhythm < 2; rhythm++) {
+                for (int b = 0; b < 6; b++) {
+                    std::string name = Name("emu/calc_block/%s/q%d/b%d", rhythm ? "rhythm" : "melodic", quality, kBlockSizes[b]);
+                    if (Selected(name)) { EmuBlock c(48000, quality, rhythm != 0, kBlockSizes[b]); Report(name, c, 48000, rhythm ? 11 : 9); }
+                }
+            }
+        }
+        
+        static const struct { const char* name; int first, count, mask; } registers[] = {
+            { "patch", 0x00, 8, 0xff },
+            { "rhythm", 0x0e, 1, 0x3f },
+            { "fnum", 0x10, 9, 0xff },
+            { "block_key", 0x20, 9, 0x3f },
+            { "inst_volume", 0x30, 9, 0xff }
+        };
+        for (int i = 0; i < 5; i++) {
+            std::string name = Name("emu/writeReg/%s", registers[i].name);
+            if (Selected(name)) { EmuWriteReg c(registers[i].first, registers[i].count, registers[i].mask); Report(name, c); }
+        }
+        
+        if (Selected("emu/new")) { EmuNew c; Report("emu/new", c); }
+        if (Selected("emu/reset")) { EmuReset c; Report("emu/reset", c); }
+    }
+    
+    void RunDriverCases() {
+        if (Selected("synth/key_on_off")) { SynthKey c; Report("synth/key_on_off", c); }
+        if (Selected("synth/pitch_wheel")) { SynthPitchWheel c; Report("synth/pitch_wheel", c); }
+        if (Selected("synth/parameter")) { SynthParameter c; Report("synth/parameter", c); }
+        
+        for (int r = 0; r < 3; r++) {
+            unsigned int rate = kSampleRates[r];
+            for (int b = 0; b < 6; b++) {
+                std::string name = Name("synth/render/%u/b%d", rate, kBlockSizes[b]);
+                if (Selected(name)) { SynthRender c(rate, 1, kBlockSizes[b]); Report(name, c, rate, SynthDriver::kChannels); }
+            }
+        }
+        std::string name = Name("synth/render_4chips/48000/b256");
+        if (Selected(name)) { SynthRender c(48000, 4, 256); Report(name, c, 48000, 4 * SynthDriver::kChannels); }
+        
+        for (int r = 0; r < 3; r++) {
+            unsigned int rate = kSampleRates[r];
+            for (int cached = 0; cached < 2; cached++) {
+                for (int b = 0; b < 6; b++) {
+                    std::string name = Name("rhythm/render%s/%u/b%d", cached ? "_cached" : "", rate, kBlockSizes[b]);
+                    if (Selected(name)) { RhythmRender c(rate, cached != 0, kBlockSizes[b]); Report(name, c, rate, 5); }
+                }
+            }
+        }
+    }
+
+#pragma mark
+#pragma mark JSON
+
+    bool WriteJson(const char* path) {
+        FILE* file = std::fopen(path, "w");
+        if (!file) return false;
+        std::fprintf(file, "{\n  \"isa\": \"%s\",\n  \"results\": [\n", CpuDispatch::GetIsaName(CpuDispatch::GetIsa()));
+        for (size_t i = 0; i < results.size(); i++) {
+            const Result& r = results[i];
+            std::fprintf(file, "    { \"name\": \"%s\", \"ns\": %.3f", r.name_.c_str(), r.ns_);
+            if (r.sampleRate_ > 0) {
+                double factor = 1e9 / r.sampleRate_ / r.ns_;
+                std::fprintf(file, ", \"sample_rate\": %u, \"realtime_factor\": %.2f, \"voices_per_core\": %.1f",
+                             r.sampleRate_, factor, factor * r.voices_);
+            }
+            if (r.counted_) {
+                // Per sample or call; the voices give the per voice figures.
+                std::fprintf(file, ", \"voices\": %d, \"counters\": {", r.voices_);
+                const char* separator = " ";
+                for (int c = 0; c < PerfCounters::kCounters; c++) {
+                    PerfCounters::CounterID id = static_cast<PerfCounters::CounterID>(c);
+                    if (!counters->IsCounting(id)) continue;
+                    std::fprintf(file, "%s\"%s\": %.4f", separator, PerfCounters::GetName(id), r.counters_[c]);
+                    separator = ", ";
+                }
+                std::fprintf(file, " }");
+            }
+            std::fprintf(file, " }%s\n", i + 1 < results.size() ? "," : "");
+        }
+        std::fprintf(file, "  ]\n}\n");
+        std::fclose(file);
+        return true;
+    }
+    
+    // Reads the name and ns pairs of a file written by WriteJson.
+    bool ReadJson(const char* path, std::vector<Result>& entries) {
+        FILE* file = std::fopen(path, "r");
+        if (!file) return false;
+        char line[512];
+        while (std::fgets(line, sizeof line, file)) {
+            const char* name = std::strstr(line, "\"name\": \"");
+            const char* ns = std::strstr(line, "\"ns\": ");
+            if (!name || !ns) continue;
+            name += 9;
+            const char* end = std::strchr(name, '"');
+            if (!end) continue;
+            Result entry;
+            entry.name_.assign(name, end);
+            entry.ns_ = std::atof(ns + 6);
+            entry.sampleRate_ = 0;
+            entry.voices_ = 0;
+            entry.counted_ = false;
+            entries.push_back(entry);
+        }
+        std::fclose(file);
+        return true;
+    }
+    
+    // Returns the number of the cases slower than the threshold.
+    int Compare(const std::vector<Result>& baseline, double threshold) {
+        int regressions = 0;
+        int matches = 0;
+        double logSum = 0;
+        std::printf("\n%-36s %10s %10s %8s\n", "case", "baseline", "current", "change");
+        for (size_t i = 0; i < results.size(); i++) {
+            const Result& r = results[i];
+            for (size_t j = 0; j < baseline.size(); j++) {
+                if (baseline[j].name_ != r.name_ || baseline[j].ns_ <= 0) continue;
+                double change = (r.ns_ / baseline[j].ns_ - 1) * 100;
+                bool regressed = change > threshold;
+                std::printf("%-36s %10.2f %10.2f %+7.1f%%%s\n", r.name_.c_str(), baseline[j].ns_, r.ns_, change, regressed ? "  SLOWER" : "");
+                if (regressed) regressions++;
+                logSum += std::log(baseline[j].ns_ / r.ns_);
+                matches++;
+                break;
+            }
+        }
+        if (matches > 0) std::printf("%-36s %10s %10s %7.3fx\n", "speedup (geometric mean)", "", "", std::exp(logSum / matches));
+        return regressions;
+    }
+}
+
+int main(int argc, char** argv) {
+    const char* jsonPath = 0;
+    const char* comparePath = 0;
+    const char* tracePath = 0;
+    double threshold = 10;
+    bool useCounters = false;
+    for (int i = 1; i < argc; i++) {
+        if (std::strcmp(argv[i], "--quick") == 0) {
+            trialTime = 0.01;
+        } else if (std::strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+            filter = argv[++i];
+        } else if (std::strcmp(argv[i], "--counters") == 0) {
+            useCounters = true;
+        } else if (std::strcmp(argv[i], "--json") == 0 && i + 1 < argc) {
+            jsonPath = argv[++i];
+        } else if (std::strcmp(argv[i], "--compare") == 0 && i + 1 < argc) {
+            comparePath = argv[++i];
+        } else if (std::strcmp(argv[i], "--threshold") == 0 && i + 1 < argc) {
+            threshold = std::atof(argv[++i]);
+        } else if (std::strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+#ifndef VST2413_TRACE
+            std::fprintf(stderr, "--trace needs a build with VST2413_TRACE\n");
+            return 2;
+#endif
+            tracePath = argv[++i];
+        } else {
+            std::fprintf(stderr, "usage: %s [--quick] [--filter text] [--counters] [--json file] [--compare file] [--threshold percent] [--trace file]\n", argv[0]);
+            return 2;
+        }
+    }
+    
+    std::vector<Result> baseline;
+    if (comparePath && !ReadJson(comparePath, baseline)) {
+        std::fprintf(stderr, "cannot read %s\n", comparePath);
+        return 2;
+    }
+    
+    PerfCounters perfCounters;
+    if (useCounters) {
+        if (perfCounters.IsAvailable()) {
+            counters = &perfCounters;
+        } else {
+            std::fprintf(stderr, "no hardware performance counters; running without them\n");
+        }
+    }
+    
+    OPLL_set_isa(CpuDispatch::GetIsa());
+    std::printf("isa: %s\n", CpuDispatch::GetIsaName(CpuDispatch::GetIsa()));
+    RunEmulatorCases();
+    RunDriverCases();
+    
+    if (jsonPath && !WriteJson(jsonPath)) {
+        std::fprintf(stderr, "cannot write %s\n", jsonPath);
+        return 2;
+    }
+    if (tracePath && !Trace_write(tracePath)) {
+        std::fprintf(stderr, "cannot write %s\n", tracePath);
+        return 2;
+    }
+    if (comparePath && Compare(baseline, threshold) > 0) return 1;
+    return 0;
+}
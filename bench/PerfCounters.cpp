@@ -0,0 +1,93 @@
+#include "PerfCounters.h"
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cstring>
+#endif
+
+namespace {
+    const char* kNames[] = { "cycles", "instructions", "l1_misses", "llc_misses", "branch_misses" };
+
+#if defined(__linux__)
+    const struct { unsigned int type; unsigned long long config; } kEvents[] = {
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+        { PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+        { PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES }
+    };
+    
+    int OpenEvent(unsigned int type, unsigned long long config) {
+        perf_event_attr attr;
+        std::memset(&attr, 0, sizeof attr);
+        attr.size = sizeof attr;
+        attr.type = type;
+        attr.config = config;
+        attr.disabled = 1;
+        // User space only; works with perf_event_paranoid up to 2.
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        return static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+    }
+#endif
+}
+
+PerfCounters::PerfCounters() {
+    for (int i = 0; i < kCounters; i++) {
+#if defined(__linux__)
+        fd_[i] = OpenEvent(kEvents[i].type, kEvents[i].config);
+#else
+        fd_[i] = -1;
+#endif
+        value_[i] = 0;
+    }
+}
+
+PerfCounters::~PerfCounters() {
+#if defined(__linux__)
+    for (int i = 0; i < kCounters; i++) {
+        if (fd_[i] >= 0) close(fd_[i]);
+    }
+#endif
+}
+
+bool PerfCounters::IsAvailable() const {
+    for (int i = 0; i < kCounters; i++) {
+        if (fd_[i] >= 0) return true;
+    }
+    return false;
+}
+
+void PerfCounters::Start() {
+#if defined(__linux__)
+    for (int i = 0; i < kCounters; i++) {
+        if (fd_[i] < 0) continue;
+        ioctl(fd_[i], PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd_[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+#endif
+}
+
+void PerfCounters::Stop() {
+#if defined(__linux__)
+    for (int i = 0; i < kCounters; i++) {
+        if (fd_[i] >= 0) ioctl(fd_[i], PERF_EVENT_IOC_DISABLE, 0);
+    }
+    for (int i = 0; i < kCounters; i++) {
+        value_[i] = 0;
+        // value, time enabled, time running
+        unsigned long long data[3];
+        if (fd_[i] < 0 || read(fd_[i], data, sizeof data) != static_cast<ssize_t>(sizeof data)) continue;
+        // Scale up when the counter was multiplexed with the others.
+        value_[i] = data[2] > 0 ? static_cast<double>(data[0]) * data[1] / data[2] : 0;
+    }
+#endif
+}
+
+const char* PerfCounters::GetName(CounterID id) {
+    return kNames[id];
+}
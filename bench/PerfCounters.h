@@ -0,0 +1,42 @@
+#ifndef __PerfCounters__
+#define __PerfCounters__
+
+// Hardware performance counters of the calling thread (Linux perf_event).
+//
+// The counters are opened separately, so that each one counts on its own
+// when the PMU cannot hold all of them; the values are scaled by the time
+// they were scheduled. Counters which cannot be opened (other systems, no
+// PMU in a VM, perf_event_paranoid) are left out.
+class PerfCounters {
+public:
+    enum CounterID {
+        kCycles,
+        kInstructions,
+        kL1Misses,      // L1 data cache read misses
+        kLLCMisses,     // last level cache read misses
+        kBranchMisses,
+        kCounters
+    };
+    
+    PerfCounters();
+    ~PerfCounters();
+    
+    bool IsAvailable() const;
+    bool IsCounting(CounterID id) const { return fd_[id] >= 0; }
+    
+    void Start();
+    void Stop();
+    // Count between the last Start and Stop.
+    double GetValue(CounterID id) const { return value_[id]; }
+    
+    static const char* GetName(CounterID id);
+
+private:
+    int fd_[kCounters];
+    double value_[kCounters];
+    
+    PerfCounters(const PerfCounters&);
+    PerfCounters& operator=(const PerfCounters&);
+};
+
+#endif
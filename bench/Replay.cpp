@@ -0,0 +1,515 @@
+// Replay benchmark of the captured sessions.
+//
+// usage: vst2413-replay [--repeat n] [--tier reduced|direct|high] session...
+//
+// Re-runs sessions captured from the plug-ins (see SessionCapture.h; the
+// corpus is in bench/sessions) through the drivers as fast as possible.
+// The calls are handled the way the plug-ins handle them: the MIDI events
+// at their frames, the parameters, the chunks, the sample rate and the
+// resume. The render-ahead switch is ignored and the governor is off, so
+// every block renders on this thread in the given tier (direct by
+// default).
+//
+// For each session it reports the length of the audio, the realtime
+// factor (seconds of audio rendered per second of CPU), the mean and the
+// worst block time and the worst block load (render time over the real
+// time of the block; over 1 would be a dropout in a host). --repeat runs
+// each session n times and keeps the fastest run.
+//
+// Built as vst2413-replay by CMakeLists.txt.
+
+#include "QualityGovernor.h"
+#include "RhythmDriver.h"
+#include "StateChunk.h"
+#include "SynthDriver.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace {
+    QualityGovernor::Tier tier = QualityGovernor::kTierDirect;
+    
+    // The plug-ins start at the default rate of the SDK.
+    const float kDefaultSampleRate = 44100;
+    // Longest line of a session file.
+    const int kMaxLine = 8192;
+
+#pragma mark Sessions
+
+    struct Call {
+        enum Type { kRate, kParameter, kChunk, kResume, kSuspend, kMidi, kProcess };
+        Type type_;
+        int value_;         // index, frame, length or chunk number
+        float number_;      // sample rate or value
+        unsigned char data_[3];
+    };
+    
+    struct Session {
+        std::string name_;
+        char plugin_;
+        std::vector<Call> calls_;
+        std::vector<std::vector<unsigned char> > chunks_;
+        int maxLength_;
+        unsigned int dropped_;
+    };
+    
+    bool ParseChunk(const char* text, std::vector<unsigned char>& chunk) {
+        while (text[0] && text[1] && text[0] != '\n') {
+            unsigned int byte;
+            if (std::sscanf(text, "%2x", &byte) != 1) return false;
+            chunk.push_back(static_cast<unsigned char>(byte));
+            text += 2;
+        }
+        return !chunk.empty();
+    }
+    
+    bool ParseLine(const char* line, Session& session) {
+        Call call;
+        std::memset(&call, 0, sizeof call);
+        char word[16];
+        if (std::sscanf(line, "%15s", word) != 1) return true;
+        if (word[0] == '#') return true;
+        unsigned int bytes[3];
+        
+        if (std::strcmp(word, "rate") == 0) {
+            call.type_ = Call::kRate;
+            if (std::sscanf(line, "rate %f", &call.number_) != 1 || call.number_ <= 0) return false;
+        } else if (std::strcmp(word, "param") == 0) {
+            call.type_ = Call::kParameter;
+            if (std::sscanf(line, "param %d %f", &call.value_, &call.number_) != 2) return false;
+        } else if (std::strcmp(word, "chunk") == 0) {
+            call.type_ = Call::kChunk;
+            call.value_ = static_cast<int>(session.chunks_.size());
+            session.chunks_.push_back(std::vector<unsigned char>());
+            if (!ParseChunk(line + 6, session.chunks_.back())) return false;
+        } else if (std::strcmp(word, "resume") == 0) {
+            call.type_ = Call::kResume;
+        } else if (std::strcmp(word, "suspend") == 0) {
+            call.type_ = Call::kSuspend;
+        } else if (std::strcmp(word, "midi") == 0) {
+            call.type_ = Call::kMidi;
+            if (std::sscanf(line, "midi %d %x %x %x", &call.value_, &bytes[0], &bytes[1], &bytes[2]) != 4) return false;
+            for (int i = 0; i < 3; i++) call.data_[i] = static_cast<unsigned char>(bytes[i]);
+        } else if (std::strcmp(word, "process") == 0) {
+            call.type_ = Call::kProcess;
+            if (std::sscanf(line, "process %d", &call.value_) != 1 || call.value_ < 0) return false;
+            if (call.value_ > session.maxLength_) session.maxLength_ = call.value_;
+        } else if (std::strcmp(word, "dropped") == 0) {
+            unsigned int count;
+            if (std::sscanf(line, "dropped %u", &count) != 1) return false;
+            session.dropped_ += count;
+            return true;
+        } else {
+            return false;
+        }
+        session.calls_.push_back(call);
+        return true;
+    }
+    
+    bool LoadSession(const char* path, Session& session) {
+        std::FILE* file = std::fopen(path, "r");
+        if (!file) {
+            std::fprintf(stderr, "cannot read %s\n", path);
+            return false;
+        }
+        // Name without the directory.
+        const char* name = path;
+        for (const char* p = path; *p; p++) {
+            if (*p == '/' || *p == '\\') name = p + 1;
+        }
+        session.name_ = name;
+        session.maxLength_ = 0;
+        session.dropped_ = 0;
+        
+        static char line[kMaxLine];
+        int number = 1;
+        bool ok = std::fgets(line, sizeof line, file) && std::sscanf(line, "session 1 %c", &session.plugin_) == 1 &&
+                  std::strchr("prs", session.plugin_);
+        while (ok && std::fgets(line, sizeof line, file)) {
+            number++;
+            ok = std::strchr(line, '\n') && ParseLine(line, session);
+        }
+        std::fclose(file);
+        if (!ok) std::fprintf(stderr, "%s:%d: bad session line\n", path, number);
+        return ok;
+    }
+
+#pragma mark Players
+
+    // A driver with the event and parameter handling of a plug-in.
+    class Player {
+    public:
+        virtual ~Player() {}
+        virtual void SetSampleRate(float sampleRate) = 0;
+        virtual void SetParameter(int index, float value) = 0;
+        virtual void SetChunk(const std::vector<unsigned char>& chunk) {}
+        virtual void Resume() = 0;
+        virtual void ProcessMidi(const unsigned char* data) = 0;
+        virtual void Render(float* output, int length) = 0;
+    };
+    
+    // Vst2413s.
+    class LeadPlayer : public Player {
+    public:
+        LeadPlayer() : driver_(static_cast<unsigned int>(kDefaultSampleRate)) {
+            driver_.SetQualityTier(tier);
+            driver_.SetMaxChipCount(1);
+        }
+        virtual void SetSampleRate(float sampleRate) { driver_.SetSampleRate(static_cast<unsigned int>(sampleRate)); }
+        virtual void SetParameter(int index, float value) {
+            if (index < SynthDriver::kParameters) driver_.SetParameter(static_cast<SynthDriver::ParameterID>(index), value);
+        }
+        virtual void SetChunk(const std::vector<unsigned char>& chunk) {
+            driver_.LoadState(&chunk[0], static_cast<int>(chunk.size()));
+        }
+        virtual void Resume() { driver_.Prepare(); }
+        virtual void ProcessMidi(const unsigned char* data) {
+            switch (data[0] & 0xf0) {
+                case 0x80:
+                    driver_.KeyOff(data[1] & 0x7f);
+                    break;
+                case 0x90:
+                    driver_.KeyOn(data[1] & 0x7f, 1.0f / 128 * (data[2] & 0x7f));
+                    break;
+                case 0xb0:
+                    if (data[1] == 0x78) driver_.Panic();
+                    if (data[1] == 0x7e || data[1] == 0x7b) driver_.KeyOffAll();
+                    break;
+                case 0xe0: {
+                    int position = ((data[2] & 0x7f) << 7) + (data[1] & 0x7f);
+                    driver_.SetPitchWheel((1.0f / 0x2000) * (position - 0x2000));
+                    break;
+                }
+                default:
+                    break;
+            }
+        }
+        virtual void Render(float* output, int length) { driver_.Render(output, length); }
+    private:
+        SynthDriver driver_;
+    };
+    
+    // Vst2413p.
+    class PolyPlayer : public Player {
+    public:
+        // The plug-in parameters.
+        enum ParameterIndex {
+            kParameterInstrument,
+            kParameterWheelRange,
+            kParameterFineTune,
+            kParameterMultitimbral,
+            kParameterChips,
+            kParameterDrums
+        };
+        
+        PolyPlayer()
+        :   driver_(static_cast<unsigned int>(kDefaultSampleRate)),
+            instrument_(0),
+            multitimbral_(0),
+            drums_(0)
+        {
+            driver_.SetQualityTier(tier);
+            driver_.SetProgram(ValueToProgramID(0));
+        }
+        virtual void SetSampleRate(float sampleRate) { driver_.SetSampleRate(static_cast<unsigned int>(sampleRate)); }
+        virtual void SetParameter(int index, float value) {
+            switch (index) {
+                case kParameterInstrument:
+                    instrument_ = value;
+                    driver_.SetProgram(ValueToProgramID(value));
+                    break;
+                case kParameterWheelRange:
+                    driver_.SetParameter(SynthDriver::kParameterWheelRange, value);
+                    break;
+                case kParameterFineTune:
+                    driver_.SetParameter(SynthDriver::kParameterFineTune, value);
+                    break;
+                case kParameterMultitimbral:
+                    multitimbral_ = value;
+                    driver_.KeyOffAll();
+                    driver_.SetProgram(ValueToProgramID(instrument_));
+                    break;
+                case kParameterChips:
+                    driver_.SetChipCount(static_cast<int>(value * (SynthDriver::kMaxChips - 1) + 0.5f) + 1);
+                    break;
+                case kParameterDrums:
+                    drums_ = value;
+                    ApplyDrumMode();
+                    break;
+                default:
+                    break;
+            }
+        }
+        virtual void SetChunk(const std::vector<unsigned char>& chunk) {
+            int byteSize = static_cast<int>(chunk.size());
+            int size = SynthDriver::GetStateSize(&chunk[0], byteSize);
+            if (size == 0 || byteSize < size + 12) return;
+            driver_.LoadState(&chunk[0], byteSize);
+            const unsigned char* p = &chunk[size];
+            float chips;
+            p = StateChunk::ReadFloat(p, instrument_);
+            p = StateChunk::ReadFloat(p, multitimbral_);
+            p = StateChunk::ReadFloat(p, chips);
+            drums_ = 0;
+            if (byteSize >= size + 16) p = StateChunk::ReadFloat(p, drums_);
+            ApplyDrumMode();
+        }
+        virtual void Resume() { driver_.Prepare(); }
+        virtual void ProcessMidi(const unsigned char* data) {
+            int channel = data[0] & 0x0f;
+            bool drums = driver_.GetRhythmMode() && channel == SynthDriver::kDrumPart;
+            bool multitimbral = multitimbral_ >= 0.5f;
+            int part = (multitimbral || drums) ? channel : 0;
+            switch (data[0] & 0xf0) {
+                case 0x80:
+                    driver_.KeyOff(part, data[1] & 0x7f);
+                    break;
+                case 0x90:
+                    driver_.KeyOn(part, data[1] & 0x7f, 1.0f / 128 * (data[2] & 0x7f));
+                    break;
+                case 0xb0:
+                    if (data[1] == 0x78) driver_.Panic();
+                    if (data[1] == 0x7e || data[1] == 0x7b) driver_.KeyOffPart(part);
+                    break;
+                case 0xc0:
+                    if (multitimbral) {
+                        int range = SynthDriver::kPrograms - SynthDriver::kProgramFirstPreset;
+                        driver_.SetPartProgram(part, static_cast<SynthDriver::ProgramID>((data[1] & 0x7f) % range + SynthDriver::kProgramFirstPreset));
+                    }
+                    break;
+                case 0xe0: {
+                    int position = ((data[2] & 0x7f) << 7) + (data[1] & 0x7f);
+                    driver_.SetPitchWheel(part, (1.0f / 0x2000) * (position - 0x2000));
+                    break;
+                }
+                default:
+                    break;
+            }
+        }
+        virtual void Render(float* output, int length) { driver_.Render(output, length); }
+    private:
+        SynthDriver driver_;
+        float instrument_;
+        float multitimbral_;
+        float drums_;
+        
+        static SynthDriver::ProgramID ValueToProgramID(float value) {
+            int range = SynthDriver::kPrograms - SynthDriver::kProgramFirstPreset - 1;
+            return static_cast<SynthDriver::ProgramID>(static_cast<int>(value * range + SynthDriver::kProgramFirstPreset));
+        }
+        // Off, channel 10, or channel 10 plus the drum keys 36-51.
+        void ApplyDrumMode() {
+            int mode = static_cast<int>(drums_ * 2 + 0.5f);
+            driver_.SetRhythmMode(mode != 0);
+            if (mode == 2) {
+                driver_.SetDrumKeyRange(36, 51);
+            } else {
+                driver_.SetDrumKeyRange(1, 0);
+            }
+        }
+    };
+    
+    // Vst2413r.
+    class DrumPlayer : public Player {
+    public:
+        DrumPlayer() : driver_(static_cast<unsigned int>(kDefaultSampleRate)), cached_(0) {
+            driver_.SetQualityTier(tier);
+        }
+        virtual void SetSampleRate(float sampleRate) { driver_.SetSampleRate(static_cast<unsigned int>(sampleRate)); }
+        virtual void SetParameter(int index, float value) {
+            if (index != 0) return;
+            cached_ = value;
+            // The plug-in switches the cache on at the next resume.
+            if (value >= 0.5f && driver_.IsPrepared() && !driver_.IsCacheReady()) return;
+            driver_.SetCachedMode(value >= 0.5f);
+        }
+        virtual void Resume() {
+            driver_.Prepare();
+            driver_.SetCachedMode(cached_ >= 0.5f);
+        }
+        virtual void ProcessMidi(const unsigned char* data) {
+            switch (data[0] & 0xf0) {
+                case 0x80:
+                    driver_.KeyOff(data[1] & 0x7f);
+                    break;
+                case 0x90:
+                    driver_.KeyOn(data[1] & 0x7f, 1.0f / 128 * (data[2] & 0x7f));
+                    break;
+                case 0xb0:
+                    if (data[1] == 0x7e || data[1] == 0x7b) driver_.KeyOffAll();
+                    break;
+                default:
+                    break;
+            }
+        }
+        virtual void Render(float* output, int length) { driver_.Render(output, length); }
+    private:
+        RhythmDriver driver_;
+        float cached_;
+    };
+    
+    Player* CreatePlayer(char plugin) {
+        if (plugin == 'p') return new PolyPlayer;
+        if (plugin == 'r') return new DrumPlayer;
+        return new LeadPlayer;
+    }
+
+#pragma mark Replay
+
+    struct Result {
+        double audio_;          // sec
+        double time_;           // sec of CPU
+        double worstTime_;      // of a block
+        double worstLoad_;
+        int blocks_;
+        int events_;
+    };
+    
+    // Event queued until its frame, as in the plug-ins.
+    struct Event {
+        int frame_;
+        const unsigned char* data_;
+    };
+    
+    const int kMaxEvents = 256;
+    
+    void Replay(const Session& session, Result& result) {
+        std::memset(&result, 0, sizeof result);
+        Player* player = CreatePlayer(session.plugin_);
+        std::vector<float> output(session.maxLength_ + 1);
+        Event events[kMaxEvents];
+        int eventCount = 0;
+        float sampleRate = kDefaultSampleRate;
+        
+        for (size_t i = 0; i < session.calls_.size(); i++) {
+            const Call& call = session.calls_[i];
+            switch (call.type_) {
+                case Call::kRate:
+                    sampleRate = call.number_;
+                    player->SetSampleRate(sampleRate);
+                    break;
+                case Call::kParameter:
+                    player->SetParameter(call.value_, call.number_);
+                    break;
+                case Call::kChunk:
+                    player->SetChunk(session.chunks_[call.value_]);
+                    break;
+                case Call::kResume:
+                    player->Resume();
+                    break;
+                case Call::kSuspend:
+                    break;
+                case Call::kMidi: {
+                    result.events_++;
+                    if (eventCount == kMaxEvents) {
+                        player->ProcessMidi(call.data_);
+                        break;
+                    }
+                    // Sorted by the frame; the events at the same frame stay in order.
+                    int position = eventCount++;
+                    while (position > 0 && events[position - 1].frame_ > call.value_) {
+                        events[position] = events[position - 1];
+                        position--;
+                    }
+                    events[position].frame_ = call.value_;
+                    events[position].data_ = call.data_;
+                    break;
+                }
+                case Call::kProcess: {
+                    int length = call.value_;
+                    double start = QualityGovernor::GetTime();
+                    int frame = 0;
+                    for (int e = 0; e < eventCount; e++) {
+                        int until = events[e].frame_ < length ? events[e].frame_ : length;
+                        if (until > frame) {
+                            player->Render(&output[frame], until - frame);
+                            frame = until;
+                        }
+                        player->ProcessMidi(events[e].data_);
+                    }
+                    if (frame < length) player->Render(&output[frame], length - frame);
+                    eventCount = 0;
+                    double elapsed = QualityGovernor::GetTime() - start;
+                    
+                    double audio = length / sampleRate;
+                    result.audio_ += audio;
+                    result.time_ += elapsed;
+                    result.blocks_++;
+                    if (elapsed > result.worstTime_) result.worstTime_ = elapsed;
+                    if (audio > 0 && elapsed / audio > result.worstLoad_) result.worstLoad_ = elapsed / audio;
+                    break;
+                }
+            }
+        }
+        delete player;
+    }
+    
+    void Print(const char* name, const Result& result) {
+        std::printf("%-32s %8.1f %7d %7d %9.1fx %8.2f %8.1f %8.4f\n",
+                    name, result.audio_, result.blocks_, result.events_,
+                    result.time_ > 0 ? result.audio_ / result.time_ : 0,
+                    result.blocks_ > 0 ? 1e6 * result.time_ / result.blocks_ : 0,
+                    1e6 * result.worstTime_, result.worstLoad_);
+    }
+}
+
+int main(int argc, char** argv) {
+    int repeat = 1;
+    std::vector<const char*> paths;
+    for (int i = 1; i < argc; i++) {
+        if (std::strcmp(argv[i], "--repeat") == 0 && i + 1 < argc) {
+            repeat = std::atoi(argv[++i]);
+        } else if (std::strcmp(argv[i], "--tier") == 0 && i + 1 < argc) {
+            const char* name = argv[++i];
+            if (std::strcmp(name, "reduced") == 0) {
+                tier = QualityGovernor::kTierReduced;
+            } else if (std::strcmp(name, "high") == 0) {
+                tier = QualityGovernor::kTierHigh;
+            } else if (std::strcmp(name, "direct") != 0) {
+                paths.clear();
+                break;
+            }
+        } else if (argv[i][0] == '-') {
+            paths.clear();
+            break;
+        } else {
+            paths.push_back(argv[i]);
+        }
+    }
+    if (paths.empty() || repeat < 1) {
+        std::fprintf(stderr, "usage: %s [--repeat n] [--tier reduced|direct|high] session...\n", argv[0]);
+        return 2;
+    }
+    
+    std::printf("%-32s %8s %7s %7s %10s %8s %8s %8s\n",
+                "session", "audio s", "blocks", "events", "realtime", "mean us", "worst us", "load");
+    Result total;
+    std::memset(&total, 0, sizeof total);
+    int failures = 0;
+    for (size_t i = 0; i < paths.size(); i++) {
+        Session session;
+        if (!LoadSession(paths[i], session)) {
+            failures++;
+            continue;
+        }
+        Result best;
+        for (int r = 0; r < repeat; r++) {
+            Result result;
+            Replay(session, result);
+            if (r == 0 || result.time_ < best.time_) best = result;
+        }
+        Print(session.name_.c_str(), best);
+        if (session.dropped_ > 0) std::printf("    (%u calls dropped in the capture)\n", session.dropped_);
+        
+        total.audio_ += best.audio_;
+        total.time_ += best.time_;
+        total.blocks_ += best.blocks_;
+        total.events_ += best.events_;
+        if (best.worstTime_ > total.worstTime_) total.worstTime_ = best.worstTime_;
+        if (best.worstLoad_ > total.worstLoad_) total.worstLoad_ = best.worstLoad_;
+    }
+    if (paths.size() > 1) Print("total", total);
+    return failures > 0 ? 1 : 0;
+}
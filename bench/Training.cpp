@@ -0,0 +1,190 @@
+// Training workload of the profile-guided build.
+//
+// usage: vst2413-train [--seconds n] [--trace file]
+//
+// Renders a pseudo-random but fixed corpus through the drivers the way
+// the plug-ins use them: a multitimbral song with drums (Vst2413p), a
+// lead line with parameter automation (Vst2413s) and a drum pattern in
+// both modes (Vst2413r), at the common rates and block sizes, plus raw
+// register streams into the emulator. The time of each part is printed,
+// but the point is the profile the instrumented build writes on exit.
+// --trace writes the timeline as a Chrome trace (with VST2413_TRACE).
+
+#include "QualityGovernor.h"
+#include "RhythmDriver.h"
+#include "SynthDriver.h"
+#include "Trace.h"
+#include "emu2413/emu2413.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+namespace {
+    const unsigned int kMasterClock = 3579545;
+    const int kMaxBlockSize = 1024;
+
+    // Length of each part in seconds of audio.
+    double partLength = 10;
+
+    struct Setting {
+        unsigned int sampleRate_;
+        int blockSize_;
+        QualityGovernor::Tier tier_;
+    };
+
+    // Host settings the parts cycle through.
+    const Setting kSettings[] = {
+        { 44100, 512, QualityGovernor::kTierDirect },
+        { 48000, 128, QualityGovernor::kTierDirect },
+        { 48000, 64, QualityGovernor::kTierHigh },
+        { 96000, 256, QualityGovernor::kTierDirect },
+        { 44100, 1024, QualityGovernor::kTierReduced }
+    };
+    const int kSettingCount = sizeof kSettings / sizeof kSettings[0];
+
+    // Fixed-seed generator, so that every run plays the same corpus.
+    class Random {
+    public:
+        Random(unsigned int seed) : state_(seed) {}
+        int Next(int range) {
+            state_ = state_ * 1664525u + 1013904223u;
+            return static_cast<int>((state_ >> 8) % static_cast<unsigned int>(range));
+        }
+    private:
+        unsigned int state_;
+    };
+
+    float buffer[kMaxBlockSize];
+
+    int BlockCount(const Setting& setting) {
+        return static_cast<int>(partLength * setting.sampleRate_ / setting.blockSize_ / kSettingCount) + 1;
+    }
+
+#pragma mark Parts
+
+    void PlaySong(const Setting& setting, Random& random) {
+        SynthDriver driver(setting.sampleRate_);
+        driver.Prepare();
+        driver.SetQualityTier(setting.tier_);
+        driver.SetChipCount(2);
+        driver.SetRhythmMode(true);
+        driver.SetDrumKeyRange(35, 81);
+        for (int part = 0; part < 8; part++) {
+            driver.SetPartProgram(part, static_cast<SynthDriver::ProgramID>(1 + random.Next(SynthDriver::kPrograms - 1)));
+        }
+        int held[8] = { -1, -1, -1, -1, -1, -1, -1, -1 };
+        int blocks = BlockCount(setting);
+        for (int b = 0; b < blocks; b++) {
+            // A few events per block, as a sequencer would send.
+            for (int e = random.Next(4); e > 0; e--) {
+                int part = random.Next(8);
+                if (held[part] >= 0) driver.KeyOff(part, held[part]);
+                held[part] = 36 + random.Next(48);
+                driver.KeyOn(part, held[part], 0.3f + random.Next(70) * 0.01f);
+            }
+            if (random.Next(3) == 0) driver.KeyOn(SynthDriver::kDrumPart, 35 + random.Next(47), 0.5f + random.Next(50) * 0.01f);
+            if (random.Next(8) == 0) driver.SetPitchWheel(random.Next(8), (random.Next(201) - 100) * 0.01f);
+            driver.Render(buffer, setting.blockSize_);
+        }
+    }
+
+    void PlayLead(const Setting& setting, Random& random) {
+        SynthDriver driver(setting.sampleRate_);
+        driver.Prepare();
+        driver.SetQualityTier(setting.tier_);
+        driver.SetParameter(SynthDriver::kParameterGlide, 0.2f);
+        driver.SetParameter(SynthDriver::kParameterVibratoDepth, 0.4f);
+        int note = -1;
+        int blocks = BlockCount(setting);
+        for (int b = 0; b < blocks; b++) {
+            if (random.Next(6) == 0) {
+                if (note >= 0) driver.KeyOff(note);
+                note = 48 + random.Next(24);
+                driver.KeyOn(note, 0.8f);
+            }
+            // Automation of a patch parameter.
+            if (random.Next(4) == 0) {
+                driver.SetParameter(static_cast<SynthDriver::ParameterID>(random.Next(SynthDriver::kParameterVIB1 + 1)), random.Next(101) * 0.01f);
+            }
+            driver.SetPitchWheel((random.Next(41) - 20) * 0.01f);
+            driver.Render(buffer, setting.blockSize_);
+        }
+    }
+
+    void PlayDrums(const Setting& setting, Random& random, bool cached) {
+        RhythmDriver driver(setting.sampleRate_);
+        driver.SetCachedMode(cached);
+        driver.Prepare();
+        driver.SetQualityTier(setting.tier_);
+        int blocks = BlockCount(setting);
+        for (int b = 0; b < blocks; b++) {
+            if (random.Next(2) == 0) driver.KeyOn(35 + random.Next(47), 0.3f + random.Next(70) * 0.01f);
+            if (random.Next(16) == 0) driver.KeyOffAll();
+            driver.Render(buffer, setting.blockSize_);
+        }
+    }
+
+    // Register stream in the style of a VGM player: writes between short blocks.
+    void PlayRegisters(const Setting& setting, Random& random) {
+        OPLL* opll = OPLL_new(kMasterClock, setting.sampleRate_);
+        OPLL_set_quality(opll, setting.tier_ == QualityGovernor::kTierHigh);
+        e_int32 samples[kMaxBlockSize];
+        int blocks = BlockCount(setting) * setting.blockSize_ / 64;
+        for (int b = 0; b < blocks; b++) {
+            for (int w = random.Next(6); w > 0; w--) {
+                int ch = random.Next(9);
+                switch (random.Next(5)) {
+                    case 0: OPLL_writeReg(opll, random.Next(8), random.Next(256)); break;
+                    case 1: OPLL_writeReg(opll, 0x10 + ch, random.Next(256)); break;
+                    case 2: OPLL_writeReg(opll, 0x20 + ch, random.Next(64)); break;
+                    case 3: OPLL_writeReg(opll, 0x30 + ch, random.Next(256)); break;
+                    default: OPLL_writeReg(opll, 0x0e, random.Next(64)); break;
+                }
+            }
+            OPLL_calc_block(opll, samples, 64);
+        }
+        OPLL_delete(opll);
+    }
+}
+
+int main(int argc, char** argv) {
+    const char* tracePath = 0;
+    for (int i = 1; i < argc; i++) {
+        if (std::strcmp(argv[i], "--seconds") == 0 && i + 1 < argc) {
+            partLength = std::atof(argv[++i]);
+        } else if (std::strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+#ifndef VST2413_TRACE
+            std::fprintf(stderr, "--trace needs a build with VST2413_TRACE\n");
+            return 2;
+#endif
+            tracePath = argv[++i];
+        } else {
+            std::fprintf(stderr, "usage: %s [--seconds n] [--trace file]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    static const char* kParts[] = { "song", "lead", "drums", "drums (cached)", "registers" };
+    for (int part = 0; part < 5; part++) {
+        Random random(part + 1);
+        TRACE_BEGIN(kParts[part], 0);
+        double start = QualityGovernor::GetTime();
+        for (int s = 0; s < kSettingCount; s++) {
+            const Setting& setting = kSettings[s];
+            switch (part) {
+                case 0: PlaySong(setting, random); break;
+                case 1: PlayLead(setting, random); break;
+                case 2: PlayDrums(setting, random, false); break;
+                case 3: PlayDrums(setting, random, true); break;
+                default: PlayRegisters(setting, random); break;
+            }
+        }
+        TRACE_END(kParts[part]);
+        std::printf("%-16s %8.3f sec\n", kParts[part], QualityGovernor::GetTime() - start);
+    }
+    if (tracePath && !Trace_write(tracePath)) {
+        std::fprintf(stderr, "cannot write %s\n", tracePath);
+        return 2;
+    }
+    return 0;
+}
@@ -0,0 +1,41 @@
+#!/bin/sh
+# Builds the plain, LTO and PGO+LTO variants of the engine, checks that
+# their output matches the golden file and reports the speedups of the
+# benchmark over the plain build.
+#
+# usage: bench/optimize.sh [build directory] [benchmark options]
+
+set -e
+
+SOURCE=$(cd "$(dirname "$0")/.." && pwd)
+BUILD=${1:-build-optimize}
+[ $# -gt 0 ] && shift
+JOBS=$(nproc 2>/dev/null || sysctl -n hw.ncpu 2>/dev/null || echo 4)
+
+build() {
+    dir=$1
+    shift
+    cmake -S "$SOURCE" -B "$BUILD/$dir" -DCMAKE_BUILD_TYPE=Release "$@" > /dev/null
+    cmake --build "$BUILD/$dir" -j"$JOBS" > /dev/null
+    "$BUILD/$dir/vst2413-golden" --golden "$SOURCE/test/golden.txt"
+}
+
+echo "== plain"
+build plain -DVST2413_LTO=OFF -DVST2413_PGO=OFF
+echo "== lto"
+build lto -DVST2413_LTO=ON -DVST2413_PGO=OFF
+
+echo "== pgo: training"
+rm -rf "$BUILD/pgo/profile"
+build pgo -DVST2413_LTO=ON -DVST2413_PGO=GENERATE
+"$BUILD/pgo/vst2413-train"
+echo "== pgo"
+build pgo -DVST2413_PGO=USE
+
+echo "== benchmark"
+"$BUILD/plain/vst2413-bench" --json "$BUILD/plain.json" "$@" > /dev/null
+for variant in lto pgo; do
+    echo "== $variant vs plain"
+    # The report is wanted even when some cases got slower.
+    "$BUILD/$variant/vst2413-bench" --json "$BUILD/$variant.json" --compare "$BUILD/plain.json" "$@" | sed -n '/^case/,$p' || true
+done
@@ -0,0 +1,64 @@
+#include "CpuDispatch.h"
+#include "emu2413/emu2413.h"
+#include <cstdlib>
+#include <cstring>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CPU_DISPATCH_X86
+#endif
+
+namespace {
+    // Selected variant, kIsas until the first use. The worker and the audio
+    // threads read it while another thread may set it; nothing else is
+    // published with it, so the accesses are only atomic (relaxed).
+    volatile int selectedIsa = CpuDispatch::kIsas;
+    
+#ifdef _WIN32
+    // Aligned 32-bit accesses are atomic on Windows.
+    inline int LoadIsa() { return selectedIsa; }
+    inline void StoreIsa(int isa) { selectedIsa = isa; }
+#else
+    inline int LoadIsa() { return __atomic_load_n(&selectedIsa, __ATOMIC_RELAXED); }
+    inline void StoreIsa(int isa) { __atomic_store_n(&selectedIsa, isa, __ATOMIC_RELAXED); }
+#endif
+    
+    const char* const kIsaNames[CpuDispatch::kIsas] = { "generic", "avx2", "avx512" };
+}
+
+CpuDispatch::Isa CpuDispatch::GetIsa() {
+    // Racing first calls end up with the same value.
+    int selected = LoadIsa();
+    if (selected == kIsas) {
+        Isa isa = DetectIsa();
+        const char* name = std::getenv("VST2413_ISA");
+        if (name) {
+            for (int i = 0; i < kIsas; i++) {
+                if (std::strcmp(name, kIsaNames[i]) == 0 && i < isa) isa = static_cast<Isa>(i);
+            }
+        }
+        StoreIsa(isa);
+        selected = isa;
+    }
+    return static_cast<Isa>(selected);
+}
+
+void CpuDispatch::SetIsa(Isa isa) {
+    Isa supported = DetectIsa();
+    StoreIsa(isa < supported ? isa : supported);
+    // The chips share their variant; switch it too.
+    OPLL_set_isa(GetIsa());
+}
+
+CpuDispatch::Isa CpuDispatch::DetectIsa() {
+#ifdef CPU_DISPATCH_X86
+    // CPUID, and whether the OS saves the wide registers.
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512vl")) return kIsaAVX512;
+    if (__builtin_cpu_supports("avx2")) return kIsaAVX2;
+#endif
+    return kIsaGeneric;
+}
+
+const char* CpuDispatch::GetIsaName(Isa isa) {
+    return isa < kIsas ? kIsaNames[isa] : "";
+}
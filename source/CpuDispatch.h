@@ -0,0 +1,32 @@
+#ifndef __CpuDispatch__
+#define __CpuDispatch__
+
+// Instruction set variant of the DSP kernels, chosen at run time.
+//
+// The variants are compiled with the target attributes of GCC and Clang
+// on x86; the other compilers and targets only have the generic code.
+// The CPU is checked on the first use. The VST2413_ISA environment
+// variable (generic, avx2 or avx512) forces a variant for testing, as
+// far as the CPU supports it.
+namespace CpuDispatch {
+    enum Isa {
+        kIsaGeneric,
+        kIsaAVX2,
+        kIsaAVX512,
+        kIsas
+    };
+    
+    // Variant used by the kernels.
+    Isa GetIsa();
+    // Overrides the variant (clamped to the supported one), for the
+    // emulator too (OPLL_set_isa). Any thread; the kernels running switch
+    // at their next call.
+    void SetIsa(Isa isa);
+    
+    // Best variant the CPU supports.
+    Isa DetectIsa();
+    
+    const char* GetIsaName(Isa isa);
+}
+
+#endif
@@ -0,0 +1,165 @@
+#include "DrumMap.h"
+#include "emu2413/emu2413.h"
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+namespace {
+    // Maximum size of a drum map file.
+    const long kMaxFileSize = 64 * 1024;
+    
+    // Names in the drum map files.
+    const char* kDrumNames[] = { "none", "hihat", "cymbal", "tom", "snare", "kick" };
+    const char* kCurveNames[] = { "linear", "soft", "hard", "fixed" };
+    
+    // Returns the index of the name, or -1.
+    int FindName(const char* const* names, int count, const char* name) {
+        for (int i = 0; i < count; i++) {
+            if (std::strcmp(names[i], name) == 0) return i;
+        }
+        return -1;
+    }
+}
+
+#pragma mark Creation
+
+DrumMap::DrumMap() {
+    Reset();
+}
+
+#pragma mark
+#pragma mark Map setting
+
+void DrumMap::Reset() {
+    for (int note = 0; note < kNotes; note++) SetEntry(note, 0, kCurveLinear);
+    
+    static const int kicks[] = { 35, 36 };
+    static const int snares[] = { 37, 38, 39, 40 };
+    static const int toms[] = { 41, 43, 45, 47, 48, 50 };
+    static const int hihats[] = { 42, 44, 46 };
+    static const int cymbals[] = { 49, 51, 52, 53, 55, 57, 59 };
+    
+    for (int i = 0; i < 2; i++) SetEntry(kicks[i], kKeyBitKick, kCurveLinear);
+    for (int i = 0; i < 4; i++) SetEntry(snares[i], kKeyBitSnare, kCurveLinear);
+    for (int i = 0; i < 6; i++) SetEntry(toms[i], kKeyBitTom, kCurveLinear);
+    for (int i = 0; i < 3; i++) SetEntry(hihats[i], kKeyBitHiHat, kCurveLinear);
+    for (int i = 0; i < 7; i++) SetEntry(cymbals[i], kKeyBitCymbal, kCurveLinear);
+}
+
+bool DrumMap::Load(const char* path) {
+    std::FILE* file = std::fopen(path, "rb");
+    if (!file) return false;
+    std::string text;
+    char buffer[1024];
+    size_t size;
+    while ((size = std::fread(buffer, 1, sizeof buffer, file)) > 0 && text.size() < static_cast<size_t>(kMaxFileSize)) {
+        text.append(buffer, size);
+    }
+    std::fclose(file);
+    return text.size() < static_cast<size_t>(kMaxFileSize) && Parse(text.c_str());
+}
+
+bool DrumMap::Parse(const char* text) {
+    // Parse into a copy so that an error leaves the current map as is.
+    DrumMap map;
+    for (int note = 0; note < kNotes; note++) map.SetEntry(note, 0, kCurveLinear);
+    
+    while (*text) {
+        // Cut out a line without the comment.
+        const char* end = text + std::strcspn(text, "\n");
+        std::string line(text, end);
+        line = line.substr(0, line.find('#'));
+        text = *end ? end + 1 : end;
+        
+        int note;
+        char drum[16], curve[16] = "linear";
+        int fields = std::sscanf(line.c_str(), "%d %15s %15s", &note, drum, curve);
+        if (fields <= 0) {
+            // Skip blank lines.
+            if (line.find_first_not_of(" \t\r") == std::string::npos) continue;
+            return false;
+        }
+        if (fields < 2 || note < 0 || note >= kNotes) return false;
+        
+        int drumIndex = FindName(kDrumNames, 6, drum);
+        int curveIndex = FindName(kCurveNames, kCurves, curve);
+        if (drumIndex < 0 || curveIndex < 0) return false;
+        map.SetEntry(note, drumIndex == 0 ? 0 : 1 << (drumIndex - 1), static_cast<Curve>(curveIndex));
+    }
+    
+    std::memcpy(entries_, map.entries_, sizeof entries_);
+    return true;
+}
+
+void DrumMap::SetEntry(int note, int keyBit, Curve curve) {
+    Entry& entry = entries_[note];
+    entry.keyBit_ = keyBit;
+    entry.volumePosition_ = KeyBitToVolumeRegisterPosition(keyBit);
+    entry.curve_ = curve;
+}
+
+#pragma mark
+#pragma mark Note mapping
+
+float DrumMap::ApplyCurve(int note, float velocity) const {
+    switch (entries_[note & 0x7f].curve_) {
+        case kCurveSoft:
+            return sqrtf(velocity);
+        case kCurveHard:
+            return velocity * velocity;
+        case kCurveFixed:
+            return 1.0f;
+        default:
+            return velocity;
+    }
+}
+
+int DrumMap::KeyBitToVolumeRegisterPosition(int keyBit) {
+    switch (keyBit) {
+        case kKeyBitKick:
+            return 0;
+        case kKeyBitSnare:
+            return 2;
+        case kKeyBitHiHat:
+            return 3;
+        case kKeyBitCymbal:
+            return 4;
+        case kKeyBitTom:
+            return 5;
+    }
+    return 1; // null
+}
+
+#pragma mark
+#pragma mark OPLL controller functions
+
+void DrumMap::ResetRhythmMode(OPLL* opll) {
+    OPLL_writeReg(opll, 0x0e, 0x20);
+    OPLL_writeReg(opll, 0x16, 0x20);
+    OPLL_writeReg(opll, 0x17, 0x50);
+    OPLL_writeReg(opll, 0x18, 0xC0);
+    OPLL_writeReg(opll, 0x26, 0x05);
+    OPLL_writeReg(opll, 0x27, 0x05);
+    OPLL_writeReg(opll, 0x28, 0x01);
+}
+
+void DrumMap::SendKeyState(OPLL* opll, int state) {
+    OPLL_writeReg(opll, 0xe, 0x20 + (state & 0x1f));
+}
+
+int DrumMap::SendKeyOn(OPLL* opll, int state, float* volumes, int keyBit, float velocity) {
+    int position = KeyBitToVolumeRegisterPosition(keyBit);
+    volumes[position] = velocity;
+    SendVolume(opll, volumes, position);
+    if (state & keyBit) SendKeyState(opll, state & ~keyBit);
+    state |= keyBit;
+    SendKeyState(opll, state);
+    return state;
+}
+
+void DrumMap::SendVolume(OPLL* opll, const float* volumes, int position) {
+    int data1 = (1.0f - volumes[position & 6]) * 15;
+    int data2 = (1.0f - volumes[position | 1]) * 15;
+    OPLL_writeReg(opll, 0x36 + position / 2, data1 + (data2 << 4));
+}
@@ -0,0 +1,81 @@
+#ifndef __DrumMap__
+#define __DrumMap__
+
+extern "C" {
+    struct __OPLL;
+}
+
+// Mapping from MIDI notes to the OPLL rhythm section, shared by the
+// drivers which run a chip in the rhythm mode.
+//
+// The map is a 128-entry table which defaults to the GM drum layout and
+// can be replaced with a text file. Each line of the file has the form
+//
+//   <note> <drum> [<curve>]
+//
+// where drum is one of kick, snare, tom, cymbal, hihat or none, and curve
+// is one of linear (default), soft, hard or fixed. '#' starts a comment.
+class DrumMap {
+public:
+    // Key bits in the register 0x0e.
+    enum KeyBit {
+        kKeyBitHiHat = 1,
+        kKeyBitCymbal = 2,
+        kKeyBitTom = 4,
+        kKeyBitSnare = 8,
+        kKeyBitKick = 16
+    };
+    
+    // Velocity curves.
+    enum Curve {
+        kCurveLinear,
+        kCurveSoft,
+        kCurveHard,
+        kCurveFixed,
+        kCurves
+    };
+    
+    static const int kNotes = 128;
+    
+    // Number of the volume fields (0x36-0x38, two fields per register).
+    static const int kVolumes = 6;
+    
+    DrumMap();
+    
+    // Restores the GM drum layout.
+    void Reset();
+    // Returns false (and keeps the current map) when the file is invalid.
+    bool Load(const char* path);
+    bool Parse(const char* text);
+    
+    // Returns zero for the notes without drums.
+    int NoteToKeyBit(int note) const { return entries_[note & 0x7f].keyBit_; }
+    int NoteToVolumeRegisterPosition(int note) const { return entries_[note & 0x7f].volumePosition_; }
+    // Applies the velocity curve of the note.
+    float ApplyCurve(int note, float velocity) const;
+    
+    // Volume field of the drum; the unused field for zero.
+    static int KeyBitToVolumeRegisterPosition(int keyBit);
+    
+    // Enables the rhythm mode and sets up the pitches of the drums.
+    static void ResetRhythmMode(struct __OPLL* opll);
+    static void SendKeyState(struct __OPLL* opll, int state);
+    // Keys on the drum and returns the new key state. A held drum is
+    // retriggered by clearing its key bit before setting it again.
+    static int SendKeyOn(struct __OPLL* opll, int state, float* volumes, int keyBit, float velocity);
+    // Volumes are given in the range of 0-1 (velocity).
+    static void SendVolume(struct __OPLL* opll, const float* volumes, int position);
+    
+private:
+    struct Entry {
+        unsigned char keyBit_;
+        unsigned char volumePosition_;
+        unsigned char curve_;
+    };
+    
+    Entry entries_[kNotes];
+    
+    void SetEntry(int note, int keyBit, Curve curve);
+};
+
+#endif
@@ -0,0 +1,29 @@
+#include "EventQueue.h"
+
+EventQueue::EventQueue(RenderAhead::Source& source, RenderAhead& renderAhead)
+:   source_(source),
+    renderAhead_(renderAhead),
+    count_(0)
+{
+}
+
+void EventQueue::Queue(int frame, const char* data) {
+    // The worker applies the events in the render-ahead mode.
+    if (renderAhead_.IsRunning()) {
+        renderAhead_.QueueMidi(frame, data);
+        return;
+    }
+    if (count_ == kMaxEvents) {
+        source_.ProcessMidi(data);
+        return;
+    }
+    // Keep the queue sorted by the frame (events at the same frame stay in order).
+    int position = count_++;
+    while (position > 0 && events_[position - 1].frame_ > frame) {
+        events_[position] = events_[position - 1];
+        position--;
+    }
+    Event& event = events_[position];
+    event.frame_ = frame;
+    for (int i = 0; i < 3; i++) event.data_[i] = data[i];
+}
@@ -0,0 +1,65 @@
+#ifndef __EventQueue__
+#define __EventQueue__
+
+#include "RenderAhead.h"
+
+// MIDI events of the next host block, applied at their frames.
+//
+// The plug-ins queue the events from processEvents and render the block
+// with it: the driver renders up to each event, then the source applies
+// it (ProcessMidi). While the render-ahead worker is running the events
+// go to the worker instead, which does the same on its side.
+class EventQueue {
+public:
+    static const int kMaxEvents = 256;
+    
+    EventQueue(RenderAhead::Source& source, RenderAhead& renderAhead);
+    
+    // Audio thread: queues an event at the frame in the next block. The
+    // event is applied right away when the queue is full.
+    void Queue(int frame, const char* data);
+    
+    // Audio thread: renders a block with the driver and applies the events.
+    // With offline, the render-ahead worker catches up on this thread.
+    template <typename Driver, typename T> void Render(Driver& driver, T* output, int length, bool offline);
+
+private:
+    struct Event {
+        int frame_;
+        char data_[3];
+    };
+    
+    RenderAhead::Source& source_;
+    RenderAhead& renderAhead_;
+    Event events_[kMaxEvents];
+    int count_;
+    
+    // Not copyable.
+    EventQueue(const EventQueue&);
+    EventQueue& operator = (const EventQueue&);
+};
+
+template <typename Driver, typename T> void EventQueue::Render(Driver& driver, T* output, int length, bool offline) {
+    if (renderAhead_.IsRunning()) {
+        renderAhead_.Process(output, length, offline);
+        return;
+    }
+    
+    // Render up to each event, then apply it. The driver measures the
+    // whole block.
+    driver.BeginBlock();
+    int frame = 0;
+    for (int i = 0; i < count_; i++) {
+        int until = events_[i].frame_ < length ? events_[i].frame_ : length;
+        if (until > frame) {
+            driver.RenderSegment(output + frame, until - frame);
+            frame = until;
+        }
+        source_.ProcessMidi(events_[i].data_);
+    }
+    if (frame < length) driver.RenderSegment(output + frame, length - frame);
+    driver.EndBlock();
+    count_ = 0;
+}
+
+#endif
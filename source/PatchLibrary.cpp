@@ -0,0 +1,286 @@
+#include "PatchLibrary.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace {
+    const char kMagic[8] = { 'O', 'P', 'L', 'L', 'B', 'A', 'N', 'K' };
+    const unsigned long kHeaderSize = 16;
+    const unsigned long kEntrySize = sizeof(PatchLibrary::Entry);
+    const unsigned long kTagRecordSize = PatchLibrary::kTagSize + 4;
+    
+#pragma mark Utility functions
+    
+    unsigned int ReadUInt32(const unsigned char* p) {
+        return p[0] + (p[1] << 8) + (p[2] << 16) + (static_cast<unsigned int>(p[3]) << 24);
+    }
+    
+    void WriteUInt32(std::FILE* file, unsigned int value) {
+        unsigned char bytes[4] = {
+            static_cast<unsigned char>(value),
+            static_cast<unsigned char>(value >> 8),
+            static_cast<unsigned char>(value >> 16),
+            static_cast<unsigned char>(value >> 24)
+        };
+        std::fwrite(bytes, 1, 4, file);
+    }
+    
+    // Writes a string into a fixed-size field padded with zeros.
+    void WriteField(std::FILE* file, const std::string& text, int size) {
+        char field[64];
+        std::memset(field, 0, sizeof field);
+        std::strncpy(field, text.c_str(), size);
+        std::fwrite(field, 1, size, file);
+    }
+    
+    // Compares a fixed-size (not always terminated) field with a string.
+    int CompareField(const char* field, int size, const char* key) {
+        int result = std::strncmp(field, key, size);
+        if (result != 0) return result;
+        return std::strlen(key) > static_cast<size_t>(size) ? -1 : 0;
+    }
+    
+    std::string Trim(const std::string& text) {
+        size_t begin = text.find_first_not_of(" \t");
+        if (begin == std::string::npos) return "";
+        size_t end = text.find_last_not_of(" \t");
+        return text.substr(begin, end - begin + 1);
+    }
+    
+    struct TagRecord {
+        std::string tag;
+        unsigned int entry;
+        bool operator < (const TagRecord& other) const {
+            return tag != other.tag ? tag < other.tag : entry < other.entry;
+        }
+    };
+    
+    struct NameOrder {
+        const std::vector<PatchLibrary::Patch>* patches;
+        bool operator () (unsigned int a, unsigned int b) const {
+            return (*patches)[a].name.substr(0, PatchLibrary::kNameSize) < (*patches)[b].name.substr(0, PatchLibrary::kNameSize);
+        }
+    };
+}
+
+#pragma mark
+#pragma mark Creation and destruction
+
+PatchLibrary::PatchLibrary()
+:   base_(0),
+    size_(0),
+    mapping_(0),
+    count_(0),
+    entries_(0),
+    nameIndex_(0),
+    tagCount_(0),
+    tagIndex_(0)
+{
+}
+
+PatchLibrary::~PatchLibrary() {
+    Close();
+}
+
+#pragma mark
+#pragma mark File mapping
+
+bool PatchLibrary::Open(const char* path) {
+    Close();
+    
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) return false;
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart < static_cast<LONGLONG>(kHeaderSize)) {
+        CloseHandle(file);
+        return false;
+    }
+    HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(file);
+    if (mapping == NULL) return false;
+    void* view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    if (view == NULL) {
+        CloseHandle(mapping);
+        return false;
+    }
+    mapping_ = mapping;
+    base_ = static_cast<const unsigned char*>(view);
+    size_ = static_cast<unsigned long>(fileSize.QuadPart);
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return false;
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size < static_cast<off_t>(kHeaderSize)) {
+        close(fd);
+        return false;
+    }
+    void* view = mmap(0, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (view == MAP_FAILED) return false;
+    base_ = static_cast<const unsigned char*>(view);
+    size_ = static_cast<unsigned long>(info.st_size);
+#endif
+    
+    // Validate the header and the section sizes.
+    unsigned long count = ReadUInt32(base_ + 12);
+    unsigned long tagOffset = kHeaderSize + count * (kEntrySize + 4);
+    if (std::memcmp(base_, kMagic, 8) != 0 ||
+        base_[8] + (base_[9] << 8) > kVersion ||
+        count > (size_ - kHeaderSize) / (kEntrySize + 4) ||
+        size_ < tagOffset + 4) {
+        Close();
+        return false;
+    }
+    unsigned long tagCount = ReadUInt32(base_ + tagOffset);
+    if (tagCount > (size_ - tagOffset - 4) / kTagRecordSize) {
+        Close();
+        return false;
+    }
+    
+    count_ = static_cast<int>(count);
+    entries_ = reinterpret_cast<const Entry*>(base_ + kHeaderSize);
+    nameIndex_ = base_ + kHeaderSize + count * kEntrySize;
+    tagCount_ = static_cast<int>(tagCount);
+    tagIndex_ = base_ + tagOffset + 4;
+    
+    // Entry numbers in the indices must be in range.
+    for (int i = 0; i < count_; i++) {
+        if (ReadUInt32(nameIndex_ + i * 4) >= count) {
+            Close();
+            return false;
+        }
+    }
+    for (int i = 0; i < tagCount_; i++) {
+        if (GetTaggedEntry(i) >= count_) {
+            Close();
+            return false;
+        }
+    }
+    
+    return true;
+}
+
+void PatchLibrary::Close() {
+    if (base_) {
+#ifdef _WIN32
+        UnmapViewOfFile(base_);
+        CloseHandle(static_cast<HANDLE>(mapping_));
+#else
+        munmap(const_cast<unsigned char*>(base_), size_);
+#endif
+    }
+    base_ = 0;
+    size_ = 0;
+    mapping_ = 0;
+    count_ = 0;
+    entries_ = 0;
+    nameIndex_ = 0;
+    tagCount_ = 0;
+    tagIndex_ = 0;
+}
+
+#pragma mark
+#pragma mark Lookup
+
+int PatchLibrary::FindByName(const char* name) const {
+    // Binary search on the name index.
+    int low = 0, high = count_;
+    while (low < high) {
+        int middle = (low + high) / 2;
+        int entry = ReadUInt32(nameIndex_ + middle * 4);
+        int result = CompareField(entries_[entry].name, kNameSize, name);
+        if (result == 0) return entry;
+        if (result < 0) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return -1;
+}
+
+int PatchLibrary::FindByTag(const char* tag, int* first) const {
+    // Lower bound of the tag.
+    int low = 0, high = tagCount_;
+    while (low < high) {
+        int middle = (low + high) / 2;
+        if (CompareField(GetTag(middle), kTagSize, tag) < 0) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    *first = low;
+    int last = low;
+    while (last < tagCount_ && CompareField(GetTag(last), kTagSize, tag) == 0) last++;
+    return last - low;
+}
+
+int PatchLibrary::GetTaggedEntry(int position) const {
+    return ReadUInt32(tagIndex_ + position * kTagRecordSize + kTagSize);
+}
+
+const char* PatchLibrary::GetTag(int position) const {
+    return reinterpret_cast<const char*>(tagIndex_ + position * kTagRecordSize);
+}
+
+#pragma mark
+#pragma mark Building
+
+bool PatchLibrary::Build(const char* path, const std::vector<Patch>& patches) {
+    std::FILE* file = std::fopen(path, "wb");
+    if (!file) return false;
+    
+    // Header
+    std::fwrite(kMagic, 1, 8, file);
+    unsigned char version[4] = { kVersion, 0, 0, 0 };
+    std::fwrite(version, 1, 4, file);
+    WriteUInt32(file, static_cast<unsigned int>(patches.size()));
+    
+    // Entries
+    std::vector<TagRecord> tags;
+    for (size_t i = 0; i < patches.size(); i++) {
+        const Patch& patch = patches[i];
+        std::fwrite(patch.dump, 1, kDumpSize, file);
+        WriteField(file, patch.name, kNameSize);
+        WriteField(file, patch.tags, kTagsSize);
+        // Collect the tags (in the stored, possibly truncated form).
+        std::string stored = patch.tags.substr(0, kTagsSize);
+        for (size_t begin = 0; begin <= stored.size(); ) {
+            size_t end = stored.find(',', begin);
+            if (end == std::string::npos) end = stored.size();
+            TagRecord record;
+            record.tag = Trim(stored.substr(begin, end - begin)).substr(0, kTagSize);
+            record.entry = static_cast<unsigned int>(i);
+            if (!record.tag.empty()) tags.push_back(record);
+            begin = end + 1;
+        }
+    }
+    
+    // Name index
+    std::vector<unsigned int> order(patches.size());
+    for (size_t i = 0; i < order.size(); i++) order[i] = static_cast<unsigned int>(i);
+    NameOrder compare = { &patches };
+    std::stable_sort(order.begin(), order.end(), compare);
+    for (size_t i = 0; i < order.size(); i++) WriteUInt32(file, order[i]);
+    
+    // Tag index
+    std::sort(tags.begin(), tags.end());
+    WriteUInt32(file, static_cast<unsigned int>(tags.size()));
+    for (size_t i = 0; i < tags.size(); i++) {
+        WriteField(file, tags[i].tag, kTagSize);
+        WriteUInt32(file, tags[i].entry);
+    }
+    
+    return std::fclose(file) == 0;
+}
@@ -0,0 +1,80 @@
+#ifndef __PatchLibrary__
+#define __PatchLibrary__
+
+#include <string>
+#include <vector>
+
+// Read-only OPLL patch library mapped into memory.
+//
+// File layout (all integers are little-endian):
+//   header      "OPLLBANK", uint16 version, uint16 reserved, uint32 count
+//   entries     count x { uint8 dump[8], char name[32], char tags[24] }
+//   name index  count x uint32 (entry numbers sorted by name)
+//   tag index   uint32 tagCount, tagCount x { char tag[28], uint32 entry }
+//               (sorted by tag, then by entry number)
+//
+// The dump is the 8-byte register image (0x00-0x07) of the user patch.
+// Tags are separated by commas.
+class PatchLibrary {
+public:
+    typedef std::string String;
+    
+    static const int kVersion = 1;
+    static const int kDumpSize = 8;
+    static const int kNameSize = 32;
+    static const int kTagsSize = 24;
+    static const int kTagSize = 28;
+    
+    struct Entry {
+        unsigned char dump[kDumpSize];
+        char name[kNameSize];
+        char tags[kTagsSize];
+    };
+    
+    // Patch description used to build a library file.
+    struct Patch {
+        unsigned char dump[kDumpSize];
+        String name;
+        String tags;
+    };
+    
+    PatchLibrary();
+    ~PatchLibrary();
+    
+    bool Open(const char* path);
+    void Close();
+    bool IsOpen() const { return base_ != 0; }
+    
+    int GetCount() const { return count_; }
+    const Entry& GetEntry(int index) const { return entries_[index]; }
+    
+    // Returns the entry number with the exact name, or -1.
+    int FindByName(const char* name) const;
+    
+    // Returns the number of entries with the tag. The entry numbers are
+    // retrieved with GetTaggedEntry(first + i).
+    int FindByTag(const char* tag, int* first) const;
+    int GetTaggedEntry(int position) const;
+    
+    // Writes a library file.
+    static bool Build(const char* path, const std::vector<Patch>& patches);
+    
+private:
+    const unsigned char* base_;
+    unsigned long size_;
+    void* mapping_;
+    
+    int count_;
+    const Entry* entries_;
+    const unsigned char* nameIndex_;
+    int tagCount_;
+    const unsigned char* tagIndex_;
+    
+    const char* GetTag(int position) const;
+    
+    // Not copyable.
+    PatchLibrary(const PatchLibrary&);
+    PatchLibrary& operator = (const PatchLibrary&);
+};
+
+#endif
@@ -0,0 +1,104 @@
+#include "QualityGovernor.h"
+
+#if defined(_WIN32)
+#include <windows.h>
+#elif defined(__APPLE__)
+#include <mach/mach_time.h>
+#else
+#include <time.h>
+#endif
+
+namespace {
+    // Time constant of the load average (sec).
+    const float kAverageTime = 0.1f;
+    // Minimum time between the tier changes (sec).
+    const float kDownHoldTime = 0.25f;
+    const float kUpHoldTime = 2.0f;
+    // The tier steps up below this fraction of the budget; the next tier
+    // costs up to twice as much.
+    const float kUpThreshold = 0.4f;
+}
+
+#pragma mark
+#pragma mark QualityGovernor
+
+QualityGovernor::QualityGovernor()
+:   enabled_(false),
+    offline_(false),
+    tier_(kTierDirect),
+    budget_(0.25f),
+    load_(0),
+    holdTime_(0),
+    blockStart_(0)
+{
+}
+
+void QualityGovernor::SetEnabled(bool enable) {
+    if (enable && !enabled_) {
+        // Start from the top and let the load bring it down.
+        tier_ = kTierHigh;
+        load_ = 0;
+        holdTime_ = 0;
+    }
+    enabled_ = enable;
+}
+
+void QualityGovernor::BeginBlock() {
+    if (enabled_ && !offline_) blockStart_ = GetTime();
+}
+
+void QualityGovernor::EndBlock(int samples, unsigned int sampleRate) {
+    if (!enabled_) return;
+    if (offline_) {
+        tier_ = kTierHigh;
+        return;
+    }
+    if (samples <= 0 || sampleRate == 0) return;
+    
+    float blockTime = static_cast<float>(samples) / sampleRate;
+    float load = static_cast<float>(GetTime() - blockStart_) / blockTime;
+    float k = blockTime / kAverageTime;
+    load_ += (load - load_) * (k < 1.0f ? k : 1.0f);
+    holdTime_ += blockTime;
+    
+    if (tier_ > kTierReduced && (load > 1.0f || (load_ > budget_ && holdTime_ >= kDownHoldTime))) {
+        tier_ = static_cast<Tier>(tier_ - 1);
+        holdTime_ = 0;
+    } else if (tier_ < kTierHigh && load_ < budget_ * kUpThreshold && holdTime_ >= kUpHoldTime) {
+        tier_ = static_cast<Tier>(tier_ + 1);
+        holdTime_ = 0;
+    }
+}
+
+double QualityGovernor::GetTime() {
+#if defined(_WIN32)
+    LARGE_INTEGER frequency, counter;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return static_cast<double>(counter.QuadPart) / frequency.QuadPart;
+#elif defined(__APPLE__)
+    static mach_timebase_info_data_t timebase;
+    if (timebase.denom == 0) mach_timebase_info(&timebase);
+    return 1e-9 * mach_absolute_time() * timebase.numer / timebase.denom;
+#else
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1e-9 * ts.tv_nsec;
+#endif
+}
+
+#pragma mark
+#pragma mark Declicker
+
+void Declicker::Process(int* buffer, int length) {
+    if (length <= 0) return;
+    if (pending_) {
+        offset_ = last_ - buffer[0];
+        position_ = 0;
+        pending_ = false;
+    }
+    for (int i = 0; i < length && position_ < kLength; i++, position_++) {
+        buffer[i] += offset_ * (kLength - position_) / kLength;
+    }
+    last_ = buffer[length - 1];
+}
@@ -0,0 +1,72 @@
+#ifndef __QualityGovernor__
+#define __QualityGovernor__
+
+// Chooses the quality tier of the emulation from the measured render time.
+//
+// The render time of each block is compared with the real time the block
+// represents. The tier steps down when the smoothed load exceeds the budget
+// (or right away when a block misses the real time), and steps up again
+// after the load has stayed low for a while. Offline processing always
+// gets the highest tier.
+class QualityGovernor {
+public:
+    enum Tier {
+        kTierReduced,   // half the host rate, upsampled by 2
+        kTierDirect,    // directly at the host rate
+        kTierHigh,      // native chip rate (clk/72) resampled to the host rate
+        kTiers
+    };
+    
+    QualityGovernor();
+    
+    // The tier is fixed while the governor is disabled.
+    void SetEnabled(bool enable);
+    bool IsEnabled() const { return enabled_; }
+    void SetTier(Tier tier) { tier_ = tier; }
+    Tier GetTier() const { return tier_; }
+    
+    void SetOffline(bool offline) { offline_ = offline; }
+    bool IsOffline() const { return offline_; }
+    
+    // Fraction of the real time which the rendering may take.
+    void SetBudget(float budget) { budget_ = budget; }
+    float GetBudget() const { return budget_; }
+    // Smoothed render time over real time.
+    float GetLoad() const { return load_; }
+    
+    // Measures a block and updates the tier.
+    void BeginBlock();
+    void EndBlock(int samples, unsigned int sampleRate);
+    
+    // Monotonic time in seconds.
+    static double GetTime();
+
+private:
+    bool enabled_;
+    bool offline_;
+    Tier tier_;
+    float budget_;
+    float load_;
+    float holdTime_;
+    double blockStart_;
+};
+
+// Fades out the step in the output after the tier has changed.
+class Declicker {
+public:
+    static const int kLength = 128;
+    
+    Declicker() : last_(0), offset_(0), position_(kLength), pending_(false) {}
+    
+    // Starts a fade at the next sample.
+    void Trigger() { pending_ = true; }
+    void Process(int* buffer, int length);
+
+private:
+    int last_;
+    int offset_;
+    int position_;
+    bool pending_;
+};
+
+#endif
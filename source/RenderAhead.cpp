@@ -0,0 +1,413 @@
+#include "RenderAhead.h"
+#include "Trace.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+namespace {
+    // Upper limit of a single render call on the worker.
+    const int kMaxRenderLength = 1024;
+    
+    // The ring indices are published with release/acquire ordering.
+#ifdef _WIN32
+    inline unsigned int LoadAcquire(const volatile unsigned int& value) {
+        unsigned int result = value;
+        MemoryBarrier();
+        return result;
+    }
+    
+    inline void StoreRelease(volatile unsigned int& target, unsigned int value) {
+        MemoryBarrier();
+        target = value;
+    }
+    
+    inline bool CompareExchange(volatile unsigned int& target, unsigned int expected, unsigned int desired) {
+        LONG previous = InterlockedCompareExchange(reinterpret_cast<volatile LONG*>(&target), desired, expected);
+        return static_cast<unsigned int>(previous) == expected;
+    }
+    
+    inline void Increment(volatile unsigned int& target) {
+        InterlockedIncrement(reinterpret_cast<volatile LONG*>(&target));
+    }
+    
+    inline void Sleep1ms() { Sleep(1); }
+#else
+    inline unsigned int LoadAcquire(const volatile unsigned int& value) {
+        return __atomic_load_n(&value, __ATOMIC_ACQUIRE);
+    }
+    
+    inline void StoreRelease(volatile unsigned int& target, unsigned int value) {
+        __atomic_store_n(&target, value, __ATOMIC_RELEASE);
+    }
+    
+    inline bool CompareExchange(volatile unsigned int& target, unsigned int expected, unsigned int desired) {
+        return __atomic_compare_exchange_n(&target, &expected, desired, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+    }
+    
+    inline void Increment(volatile unsigned int& target) {
+        __atomic_fetch_add(&target, 1, __ATOMIC_RELAXED);
+    }
+    
+    inline void Sleep1ms() { usleep(1000); }
+#endif
+    
+    // States of the chunk transfer.
+    enum {
+        kChunkIdle,
+        kChunkQueued,
+        kChunkDone
+    };
+}
+
+const float RenderAhead::kAheadTime = 0.02f;
+
+#pragma mark
+#pragma mark Creation and destruction
+
+RenderAhead::RenderAhead(Source& source)
+:   source_(source),
+    running_(false),
+    latency_(0),
+    underruns_(0),
+    thread_(0),
+    quit_(0),
+    busy_(0),
+    eventCount_(0),
+    droppedEvents_(0),
+    pendingLength_(0),
+    commandWrite_(0),
+    commandRead_(0),
+    controlWrite_(0),
+    controlRead_(0),
+    droppedParameters_(0),
+    chunkState_(kChunkIdle),
+    chunkInput_(0),
+    chunkOutput_(0),
+    chunkSize_(0),
+    chunkResult_(0),
+    sampleMask_(0),
+    sampleWrite_(0),
+    sampleRead_(0),
+    blockPosition_(0),
+    inBlock_(false)
+{
+    for (int i = 0; i < kControls; i++) controls_[i].sequence_ = i;
+}
+
+RenderAhead::~RenderAhead() {
+    Stop();
+}
+
+#pragma mark
+#pragma mark Worker control
+
+int RenderAhead::CalculateLatency(float sampleRate, int blockSize) {
+    return blockSize + static_cast<int>(sampleRate * kAheadTime);
+}
+
+void RenderAhead::Start(float sampleRate, int blockSize) {
+    Stop();
+    
+    latency_ = CalculateLatency(sampleRate, blockSize);
+    
+    // The ring holds the latency and the block in flight.
+    unsigned int capacity = 1;
+    while (capacity < static_cast<unsigned int>(latency_ + blockSize * 2)) capacity <<= 1;
+    samples_.assign(capacity, 0.0f);
+    sampleMask_ = capacity - 1;
+    
+    // The first block comes out after the latency (primed with silence).
+    sampleRead_ = 0;
+    sampleWrite_ = latency_;
+    commandRead_ = commandWrite_ = 0;
+    eventCount_ = 0;
+    droppedEvents_ = 0;
+    pendingLength_ = 0;
+    blockPosition_ = 0;
+    inBlock_ = false;
+    underruns_ = 0;
+    quit_ = 0;
+    
+    // Set before the worker starts, so that the controls are queued.
+    running_ = true;
+#ifdef _WIN32
+    HANDLE thread = CreateThread(NULL, 0, ThreadEntry, this, 0, NULL);
+    if (thread == NULL) {
+        running_ = false;
+        return;
+    }
+    thread_ = thread;
+#else
+    pthread_t* thread = new pthread_t;
+    if (pthread_create(thread, NULL, ThreadEntry, this) != 0) {
+        delete thread;
+        running_ = false;
+        return;
+    }
+    thread_ = thread;
+#endif
+}
+
+void RenderAhead::Stop() {
+    if (!running_) return;
+    StoreRelease(quit_, 1);
+#ifdef _WIN32
+    HANDLE thread = static_cast<HANDLE>(thread_);
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+#else
+    pthread_t* thread = static_cast<pthread_t*>(thread_);
+    pthread_join(*thread, NULL);
+    delete thread;
+#endif
+    thread_ = 0;
+    running_ = false;
+    latency_ = 0;
+    // Apply the controls the worker left behind.
+    ApplyControls();
+}
+
+#pragma mark
+#pragma mark Controls
+
+void RenderAhead::SetParameter(int index, float value) {
+    if (!running_) {
+        source_.ApplyParameter(index, value);
+        return;
+    }
+    if (!PushControl(index, value)) {
+        TRACE_INSTANT("render ahead parameter dropped", index);
+        Increment(droppedParameters_);
+    }
+}
+
+int RenderAhead::LoadState(const unsigned char* data, int size) {
+    if (!running_) return source_.LoadState(data, size);
+    return TransferState(kControlLoadState, data, 0, size);
+}
+
+int RenderAhead::SaveState(unsigned char* data) {
+    if (!running_) return source_.SaveState(data);
+    return TransferState(kControlSaveState, 0, data, 0);
+}
+
+int RenderAhead::TransferState(int control, const unsigned char* input, unsigned char* output, int size) {
+    // Wait for the chunk before, then for the worker to take this one.
+    while (!CompareExchange(chunkState_, kChunkIdle, kChunkQueued)) Sleep1ms();
+    chunkInput_ = input;
+    chunkOutput_ = output;
+    chunkSize_ = size;
+    while (!PushControl(control, 0)) Sleep1ms();
+    while (LoadAcquire(chunkState_) != kChunkDone) Sleep1ms();
+    int result = chunkResult_;
+    StoreRelease(chunkState_, kChunkIdle);
+    return result;
+}
+
+bool RenderAhead::PushControl(int index, float value) {
+    // Claim a cell, then publish it with its sequence number.
+    unsigned int write = LoadAcquire(controlWrite_);
+    Control* control;
+    for (;;) {
+        control = &controls_[write % kControls];
+        int lag = static_cast<int>(LoadAcquire(control->sequence_) - write);
+        if (lag < 0) return false;
+        if (lag == 0 && CompareExchange(controlWrite_, write, write + 1)) break;
+        write = LoadAcquire(controlWrite_);
+    }
+    control->index_ = index;
+    control->value_ = value;
+    StoreRelease(control->sequence_, write + 1);
+    return true;
+}
+
+void RenderAhead::ApplyControls() {
+    for (;;) {
+        Control& control = controls_[controlRead_ % kControls];
+        if (LoadAcquire(control.sequence_) != controlRead_ + 1) return;
+        if (control.index_ >= 0) {
+            source_.ApplyParameter(control.index_, control.value_);
+        } else {
+            if (control.index_ == kControlLoadState) {
+                chunkResult_ = source_.LoadState(chunkInput_, chunkSize_);
+            } else {
+                chunkResult_ = source_.SaveState(chunkOutput_);
+            }
+            StoreRelease(chunkState_, kChunkDone);
+        }
+        StoreRelease(control.sequence_, controlRead_ + kControls);
+        controlRead_++;
+    }
+}
+
+#pragma mark
+#pragma mark Audio thread
+
+void RenderAhead::QueueMidi(int frame, const char* data) {
+    if (eventCount_ == kMaxEvents) {
+        TRACE_INSTANT("render ahead event dropped", data[0] & 0xff);
+        droppedEvents_++;
+        return;
+    }
+    Command& command = events_[eventCount_++];
+    command.frame_ = frame < 0 ? 0 : frame;
+    command.length_ = -1;
+    for (int i = 0; i < 3; i++) command.data_[i] = data[i];
+}
+
+void RenderAhead::Process(float* output, int length, bool catchUp) {
+    Pull(output, length, catchUp);
+}
+
+void RenderAhead::Process(double* output, int length, bool catchUp) {
+    Pull(output, length, catchUp);
+}
+
+template <typename T> void RenderAhead::Pull(T* output, int length, bool catchUp) {
+    // Send the events clamped to the block, keeping a slot for its end.
+    // The events that don't fit wait for the next block (at its top).
+    int sent = 0;
+    for (; sent < eventCount_; sent++) {
+        Command command = events_[sent];
+        command.frame_ = pendingLength_ + (command.frame_ < length ? command.frame_ : length);
+        if (!PushCommand(command, 2)) break;
+    }
+    eventCount_ -= sent;
+    for (int i = 0; i < eventCount_; i++) {
+        events_[i] = events_[sent + i];
+        events_[i].frame_ = 0;
+    }
+    // When the end doesn't fit either, the block is merged into the next
+    // one, so that the worker still renders every sample in place.
+    Command end = { 0, pendingLength_ + length, { 0, 0, 0 } };
+    if (PushCommand(end, 1)) {
+        pendingLength_ = 0;
+    } else {
+        TRACE_INSTANT("render ahead command ring full", length);
+        pendingLength_ += length;
+    }
+    
+    // Copy the rendered samples out. The samples not rendered yet are
+    // replaced with silence; the worker skips them when it gets there.
+    unsigned int read = sampleRead_;
+    int available = static_cast<int>(LoadAcquire(sampleWrite_) - read);
+    // Do the work of the worker, waiting for the step it's in.
+    while (catchUp && available < length && DoWork(true)) {
+        available = static_cast<int>(LoadAcquire(sampleWrite_) - read);
+    }
+    int count = available < 0 ? 0 : (available < length ? available : length);
+    for (int i = 0; i < count; i++) output[i] = samples_[(read + i) & sampleMask_];
+    for (int i = count; i < length; i++) output[i] = 0;
+    if (count < length) {
+        TRACE_INSTANT("render ahead underrun", length - count);
+        underruns_ += length - count;
+    }
+    StoreRelease(sampleRead_, read + length);
+}
+
+// Pushes the command when the ring has the reserve of free slots.
+bool RenderAhead::PushCommand(const Command& command, int reserve) {
+    unsigned int write = commandWrite_;
+    if (write - LoadAcquire(commandRead_) > static_cast<unsigned int>(kCommands - reserve)) return false;
+    commands_[write % kCommands] = command;
+    StoreRelease(commandWrite_, write + 1);
+    return true;
+}
+
+#pragma mark
+#pragma mark Worker thread
+
+#ifdef _WIN32
+unsigned long __stdcall RenderAhead::ThreadEntry(void* arg) {
+    static_cast<RenderAhead*>(arg)->Run();
+    return 0;
+}
+#else
+void* RenderAhead::ThreadEntry(void* arg) {
+    static_cast<RenderAhead*>(arg)->Run();
+    return NULL;
+}
+#endif
+
+void RenderAhead::Run() {
+    Trace_set_thread_name("VST2413 render ahead");
+    // Poll the rings so that the audio thread never has to signal.
+    while (!LoadAcquire(quit_)) {
+        if (!DoWork(false)) Sleep1ms();
+    }
+}
+
+bool RenderAhead::DoWork(bool wait) {
+    // Also called from the audio thread to catch up; the busy flag keeps
+    // them apart. The worker leaves the step to the audio thread then.
+    while (!CompareExchange(busy_, 0, 1)) {
+        if (!wait) return false;
+    }
+    ApplyControls();
+    bool worked = RenderStep();
+    StoreRelease(busy_, 0);
+    return worked;
+}
+
+bool RenderAhead::RenderStep() {
+    unsigned int read = commandRead_;
+    unsigned int commandWrite = LoadAcquire(commandWrite_);
+    if (read == commandWrite) return false;
+    const Command& command = commands_[read % kCommands];
+    TRACE_SCOPE("RenderAhead::DoWork", command.length_);
+    
+    // Begin a block once its end is queued, so that the source doesn't
+    // measure the wait for the rest of it.
+    if (!inBlock_) {
+        unsigned int end = read;
+        while (end != commandWrite && commands_[end % kCommands].length_ < 0) end++;
+        if (end == commandWrite) return false;
+        source_.BeginBlock();
+        inBlock_ = true;
+    }
+    
+    // Render up to the event or the end of the block.
+    int target = command.length_ >= 0 ? command.length_ : command.frame_;
+    while (blockPosition_ < target) {
+        unsigned int write = sampleWrite_;
+        unsigned int sampleRead = LoadAcquire(sampleRead_);
+        // Skip the samples the audio thread has output as silence already,
+        // without rendering them.
+        int late = static_cast<int>(sampleRead - write);
+        if (late > 0) {
+            int skip = target - blockPosition_ < late ? target - blockPosition_ : late;
+            StoreRelease(sampleWrite_, write + skip);
+            blockPosition_ += skip;
+            continue;
+        }
+        int space = static_cast<int>(sampleRead + sampleMask_ + 1 - write);
+        int count = target - blockPosition_;
+        if (count > space) count = space;
+        if (count > static_cast<int>(sampleMask_ + 1)) count = sampleMask_ + 1;
+        if (count > kMaxRenderLength) count = kMaxRenderLength;
+        // The ring is full; wait for the audio thread.
+        if (count <= 0) return false;
+        // Render in two parts at the end of the ring.
+        int offset = write & sampleMask_;
+        int first = static_cast<int>(sampleMask_ + 1) - offset;
+        if (first > count) first = count;
+        source_.RenderAudio(&samples_[offset], first);
+        if (count > first) source_.RenderAudio(&samples_[0], count - first);
+        StoreRelease(sampleWrite_, write + count);
+        blockPosition_ += count;
+    }
+    
+    if (command.length_ >= 0) {
+        source_.EndBlock();
+        blockPosition_ = 0;
+        inBlock_ = false;
+    } else {
+        source_.ProcessMidi(command.data_);
+    }
+    StoreRelease(commandRead_, read + 1);
+    return true;
+}
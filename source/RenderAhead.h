@@ -0,0 +1,176 @@
+#ifndef __RenderAhead__
+#define __RenderAhead__
+
+#include <vector>
+
+// Renders the output ahead of the host on a worker thread.
+//
+// The audio thread only queues the MIDI events and copies the rendered
+// samples out of a ring buffer, so the emulation cost (and its spikes) is
+// moved off the real-time thread. The output is delayed by GetLatency()
+// samples, which the plug-in reports to the host with setInitialDelay.
+//
+// The rings are single-producer/single-consumer; the audio thread never
+// blocks on the worker. When the worker falls behind, the missing samples
+// are output as silence and skipped later, so the latency stays constant.
+//
+// The parameter changes and the state chunks are handed to the worker
+// through a control queue too, so that nothing else touches the source
+// while it renders and no thread takes a lock the worker holds.
+class RenderAhead {
+public:
+    // The rendering side. Called on the worker thread while it's running
+    // (or on the audio thread catching up), on the calling thread otherwise.
+    class Source {
+    public:
+        virtual ~Source() {}
+        virtual void ProcessMidi(const char* data) = 0;
+        // A block is rendered in segments split at its events, between
+        // BeginBlock and EndBlock (so that the source measures the block).
+        virtual void BeginBlock() = 0;
+        virtual void RenderAudio(float* buffer, int length) = 0;
+        virtual void EndBlock() = 0;
+        virtual void ApplyParameter(int index, float value) = 0;
+        // State chunk; both return the size in bytes (0 when it's invalid).
+        virtual int LoadState(const unsigned char* data, int size) { return 0; }
+        virtual int SaveState(unsigned char* data) { return 0; }
+    };
+    
+    // Time given to the worker on top of a host block (sec).
+    static const float kAheadTime;
+    
+    explicit RenderAhead(Source& source);
+    ~RenderAhead();
+    
+    // Starts or stops the worker. Call them while the host is not
+    // processing (resume/suspend).
+    void Start(float sampleRate, int blockSize);
+    void Stop();
+    bool IsRunning() const { return running_; }
+    
+    // Delay of the output in samples.
+    int GetLatency() const { return latency_; }
+    static int CalculateLatency(float sampleRate, int blockSize);
+    
+    // Number of samples output as silence because the worker was late.
+    unsigned int GetUnderruns() const { return underruns_; }
+    
+    // Number of parameter changes lost to the full control queue.
+    unsigned int GetDroppedParameters() const { return droppedParameters_; }
+    
+    // Number of MIDI events lost to the full event queue.
+    unsigned int GetDroppedEvents() const { return droppedEvents_; }
+    
+    // Any thread: queues a parameter change; the worker applies it before
+    // its next render, within about a millisecond. It's applied right away
+    // while the worker is stopped.
+    void SetParameter(int index, float value);
+    
+    // Other threads than the audio thread: loads or saves the state chunk
+    // on the worker and waits for it.
+    int LoadState(const unsigned char* data, int size);
+    int SaveState(unsigned char* data);
+    
+    // Audio thread: queues an event at the frame in the next block. It's
+    // dropped when the queue is full.
+    void QueueMidi(int frame, const char* data);
+    
+    // Audio thread: sends the queued events and takes a block out.
+    // With catchUp, the samples the worker has not rendered yet are
+    // rendered on the calling thread instead (for offline processing).
+    void Process(float* output, int length, bool catchUp = false);
+    void Process(double* output, int length, bool catchUp = false);
+
+private:
+    // The end of a block, or an event when length_ < 0.
+    struct Command {
+        int frame_;
+        int length_;
+        char data_[3];
+    };
+    
+    // A parameter change, or a state chunk transfer when index_ < 0.
+    struct Control {
+        volatile unsigned int sequence_;
+        int index_;
+        float value_;
+    };
+    
+    static const int kMaxEvents = 256;
+    static const int kCommands = 1024;
+    static const int kControls = 256;
+    static const int kControlLoadState = -1;
+    static const int kControlSaveState = -2;
+    
+    Source& source_;
+    bool running_;
+    int latency_;
+    unsigned int underruns_;
+    
+    // Platform thread.
+    void* thread_;
+    volatile unsigned int quit_;
+    
+    // Set while the worker or the audio thread catching up renders.
+    volatile unsigned int busy_;
+    
+    // Events of the next block (audio thread only).
+    Command events_[kMaxEvents];
+    int eventCount_;
+    unsigned int droppedEvents_;
+    
+    // Length of the blocks whose end didn't fit in the command ring; it's
+    // sent with the next end (audio thread only).
+    int pendingLength_;
+    
+    // Command ring (audio thread -> worker).
+    Command commands_[kCommands];
+    volatile unsigned int commandWrite_;
+    volatile unsigned int commandRead_;
+    
+    // Control queue (any thread -> worker). Each cell has a sequence number
+    // so that several threads can push; the worker is the only consumer.
+    Control controls_[kControls];
+    volatile unsigned int controlWrite_;
+    unsigned int controlRead_;
+    volatile unsigned int droppedParameters_;
+    
+    // State chunk in transfer (one at a time).
+    volatile unsigned int chunkState_;
+    const unsigned char* chunkInput_;
+    unsigned char* chunkOutput_;
+    int chunkSize_;
+    int chunkResult_;
+    
+    // Sample ring (worker -> audio thread).
+    std::vector<float> samples_;
+    unsigned int sampleMask_;
+    volatile unsigned int sampleWrite_;
+    volatile unsigned int sampleRead_;
+    
+    // Position of the worker in the current block, and whether the source
+    // has begun it.
+    int blockPosition_;
+    bool inBlock_;
+    
+    bool PushCommand(const Command& command, int reserve);
+    bool PushControl(int index, float value);
+    int TransferState(int control, const unsigned char* input, unsigned char* output, int size);
+    void ApplyControls();
+    bool DoWork(bool wait);
+    bool RenderStep();
+    template <typename T> void Pull(T* output, int length, bool catchUp);
+
+#ifdef _WIN32
+    static unsigned long __stdcall ThreadEntry(void* arg);
+#else
+    static void* ThreadEntry(void* arg);
+#endif
+    void Run();
+    
+    // Not copyable.
+    RenderAhead(const RenderAhead&);
+    RenderAhead& operator = (const RenderAhead&);
+};
+
+#endif
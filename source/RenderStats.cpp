@@ -0,0 +1,133 @@
+#include "RenderStats.h"
+#include "QualityGovernor.h"
+#include <cstring>
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+namespace {
+    // Time constant of the smoothed load (sec).
+    const float kAverageTime = 0.1f;
+    
+#ifdef _WIN32
+    inline unsigned int LoadAcquire(const volatile unsigned int& value) {
+        unsigned int result = value;
+        MemoryBarrier();
+        return result;
+    }
+    
+    inline void StoreRelease(volatile unsigned int& target, unsigned int value) {
+        MemoryBarrier();
+        target = value;
+    }
+    
+    inline void Fence() { MemoryBarrier(); }
+#else
+    inline unsigned int LoadAcquire(const volatile unsigned int& value) {
+        return __atomic_load_n(&value, __ATOMIC_ACQUIRE);
+    }
+    
+    inline void StoreRelease(volatile unsigned int& target, unsigned int value) {
+        __atomic_store_n(&target, value, __ATOMIC_RELEASE);
+    }
+    
+    inline void Fence() { __atomic_thread_fence(__ATOMIC_SEQ_CST); }
+#endif
+}
+
+const char* const RenderStats::kCanDo = "vst2413RenderStats";
+
+RenderStats::RenderStats()
+:   sequence_(0),
+    resetRequest_(0),
+    blockStart_(0),
+    lastWrites_(0)
+{
+    Clear();
+    published_ = current_;
+}
+
+void RenderStats::Clear() {
+    std::memset(&current_, 0, sizeof current_);
+    events_ = 0;
+    steals_ = 0;
+    windowSamples_ = 0;
+    windowWrites_ = 0;
+    windowEvents_ = 0;
+    windowBlocks_ = 0;
+}
+
+void RenderStats::BeginBlock() {
+    blockStart_ = QualityGovernor::GetTime();
+}
+
+void RenderStats::EndBlock(int samples, unsigned int sampleRate, int activeVoices, unsigned int writes) {
+    if (samples <= 0 || sampleRate == 0) return;
+    float time = static_cast<float>(QualityGovernor::GetTime() - blockStart_);
+    if (LoadAcquire(resetRequest_)) {
+        StoreRelease(resetRequest_, 0);
+        Clear();
+    }
+    
+    float blockTime = static_cast<float>(samples) / sampleRate;
+    float load = time / blockTime;
+    int bucket = 0;
+    for (float limit = 1.0f / 128; bucket < kBuckets - 1 && load >= limit; limit *= 2) bucket++;
+    current_.histogram_[bucket]++;
+    current_.blocks_++;
+    float k = blockTime / kAverageTime;
+    current_.load_ += (load - current_.load_) * (k < 1 ? k : 1);
+    if (load > current_.worstLoad_) {
+        current_.worstLoad_ = load;
+        current_.worstTime_ = time;
+        current_.worstLength_ = samples;
+    }
+    current_.activeVoices_ = activeVoices;
+    if (events_ > current_.maxEvents_) current_.maxEvents_ = events_;
+    current_.steals_ = steals_;
+    
+    // The rates are updated every second of audio.
+    windowSamples_ += samples;
+    // The count starts over when the chips are replaced.
+    windowWrites_ += writes >= lastWrites_ ? writes - lastWrites_ : writes;
+    windowEvents_ += events_;
+    windowBlocks_++;
+    lastWrites_ = writes;
+    events_ = 0;
+    if (windowSamples_ >= sampleRate) {
+        current_.writesPerSecond_ = static_cast<float>(windowWrites_) * sampleRate / windowSamples_;
+        current_.eventsPerBlock_ = static_cast<float>(windowEvents_) / windowBlocks_;
+        windowSamples_ = 0;
+        windowWrites_ = 0;
+        windowEvents_ = 0;
+        windowBlocks_ = 0;
+    }
+    
+    // Publish: the count is odd while the copy is being written.
+    unsigned int sequence = sequence_;
+    StoreRelease(sequence_, sequence + 1);
+    Fence();
+    published_ = current_;
+    StoreRelease(sequence_, sequence + 2);
+}
+
+void RenderStats::Read(Snapshot& snapshot) const {
+    for (;;) {
+        unsigned int sequence = LoadAcquire(sequence_);
+        if (sequence & 1) continue;
+        snapshot = published_;
+        Fence();
+        if (LoadAcquire(sequence_) == sequence) return;
+    }
+}
+
+void RenderStats::Reset() {
+    StoreRelease(resetRequest_, 1);
+}
+
+int RenderStats::CountVoices(unsigned int soundingMask) {
+    int count = 0;
+    for (; soundingMask; soundingMask &= soundingMask - 1) count++;
+    return count;
+}
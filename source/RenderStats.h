@@ -0,0 +1,74 @@
+#ifndef __RenderStats__
+#define __RenderStats__
+
+// Rolling statistics of the rendering of a driver, for the meters of the
+// host (the DSP cost of each track, the instances close to an overrun).
+//
+// The thread calling Render updates them once per block. Any other thread
+// takes a consistent copy with Read without locking: the block update is
+// published under a sequence count, and the reader retries while it moves.
+//
+// The plug-ins copy them into a Snapshot on the vendorSpecific call with
+// kVendorOpcode (index), sizeof(Snapshot) (value) and the Snapshot (ptr),
+// and answer canDo(kCanDo).
+class RenderStats {
+public:
+    static const int kVendorOpcode = 0x56327374;   // 'V2st'
+    static const char* const kCanDo;
+    
+    // Histogram of the block load (render time over the real time of the
+    // block): under 1/128, 1/64, ... 1/2, under 1 and over 1 (an overrun).
+    static const int kBuckets = 9;
+    
+    struct Snapshot {
+        unsigned int blocks_;
+        unsigned int histogram_[kBuckets];
+        float load_;            // smoothed load
+        float worstLoad_;
+        float worstTime_;       // render time of the worst block (sec)
+        int worstLength_;       // and its length (samples)
+        int activeVoices_;      // sounding channels and drums after the last block
+        float writesPerSecond_; // register writes per second of audio
+        float eventsPerBlock_;  // events (notes, wheel, parameters) per block
+        unsigned int maxEvents_;    // most events before a block
+        unsigned int steals_;   // held notes cut off for new ones
+    };
+    
+    RenderStats();
+    
+    // Rendering thread.
+    void BeginBlock();
+    // writes is the running count of the register writes of the chips.
+    void EndBlock(int samples, unsigned int sampleRate, int activeVoices, unsigned int writes);
+    void AddEvent() { events_++; }
+    void AddSteal() { steals_++; }
+    
+    // Any thread.
+    void Read(Snapshot& snapshot) const;
+    // Clears the statistics at the next block.
+    void Reset();
+    
+    // Number of the voices in a mask of OPLL_getSoundingMask.
+    static int CountVoices(unsigned int soundingMask);
+
+private:
+    Snapshot published_;
+    volatile unsigned int sequence_;
+    volatile unsigned int resetRequest_;
+    
+    // Rendering thread state.
+    Snapshot current_;
+    double blockStart_;
+    unsigned int events_;
+    unsigned int steals_;
+    unsigned int lastWrites_;
+    // Rates over the last second of audio.
+    unsigned int windowSamples_;
+    unsigned int windowWrites_;
+    unsigned int windowEvents_;
+    unsigned int windowBlocks_;
+    
+    void Clear();
+};
+
+#endif
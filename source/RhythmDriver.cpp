@@ -1,6 +1,11 @@
 #include "RhythmDriver.h"
+#include "CpuDispatch.h"
+#include "DrumMap.h"
+#include "SampleFormat.h"
+#include "Trace.h"
 #include "emu2413/emu2413.h"
 #include <cmath>
+#include <cstring>
 
 #ifdef _WIN32
 #define snprintf _snprintf
@@ -10,72 +15,33 @@ namespace {
     // OPLL master clock = 3.579545 MHz
     const unsigned int kMasterClock = 3579545;
     
-#pragma mark
-#pragma mark OPLL controller functions
-
-    namespace OPLLC {
-        void ResetRhythmMode(OPLL* opll) {
-            OPLL_writeReg(opll, 0x0e, 0x20);
-            OPLL_writeReg(opll, 0x16, 0x20);
-            OPLL_writeReg(opll, 0x17, 0x50);
-            OPLL_writeReg(opll, 0x18, 0xC0);
-            OPLL_writeReg(opll, 0x26, 0x05);
-            OPLL_writeReg(opll, 0x27, 0x05);
-            OPLL_writeReg(opll, 0x28, 0x01);
-        }
-        
-        void SendKeyState(OPLL* opll, int state) {
-            OPLL_writeReg(opll, 0xe, 0x20 + (state & 0x1f));
-        }
-        
-        void SetVolumeRegisters(OPLL* opll, const float* volumes, int position) {
-            int data1 = (1.0f - volumes[position & 6]) * 15;
-            int data2 = (1.0f - volumes[position | 1]) * 15;
-            OPLL_writeReg(opll, 0x36 + position / 2, data1 + (data2 << 4));
-        }
-    }
-
-#pragma mark
-#pragma mark Utility functions
+    // Scale from the chip output to the float output.
+    const float kOutputGain = 4.0f / 32767;
+    
+    // Drums which interact through the shared slots (HH/CYM) and noise (SD/HH).
+    const int kLinkedDrums = DrumMap::kKeyBitHiHat | DrumMap::kKeyBitCymbal | DrumMap::kKeyBitSnare;
+    
+    // Gate time of the cached hits (sec).
+    const float kCachedGate = 0.1f;
+    // Maximum length of the cached hits (sec).
+    const float kMaxHitLength = 2.0f;
+    // The chip is regarded as quiet after this number of silent samples.
+    const int kQuietLength = 256;
     
-    int NoteToKeyBit(int note) {
-        switch (note) {
-            case 36:
-                return 16; // kick
-            case 38:
-                return 8; // snare
-            case 43:
-            case 47:
-            case 50:
-                return 4; // tom
-            case 49:
-            case 51:
-                return 2; // cymbal
-            case 42:
-            case 44:
-                return 1; // hat
+    // Converts a key bit into a drum index.
+    int KeyBitToDrum(int keyBit) {
+        int drum = 0;
+        while (keyBit > 1) {
+            keyBit >>= 1;
+            drum++;
         }
-        return 0;
+        return drum;
     }
     
-    int NoteToVolumeRegisterPosition(int note) {
-        switch (note) {
-            case 36:
-                return 0; // kick
-            case 38:
-                return 2; // snare
-            case 43:
-            case 47:
-            case 50:
-                return 5; // tom
-            case 49:
-            case 51:
-                return 4; // cymbal
-            case 42:
-            case 44:
-                return 3; // hat
-        }
-        return 1; // null
+    // Volume level (0-15) in the same way as DrumMap::SendVolume.
+    int VelocityToLevel(float velocity) {
+        int level = (1.0f - velocity) * 15;
+        return level < 0 ? 0 : (level > 15 ? 15 : level);
     }
 }
 
@@ -84,48 +50,302 @@ namespace {
 
 RhythmDriver::RhythmDriver(unsigned int sampleRate)
 :   opll_(0),
-    state_(0)
+    sampleRate_(sampleRate),
+    state_(0),
+    cached_(false),
+    chipActive_(false),
+    chipQuietCount_(0),
+    tier_(QualityGovernor::kTierDirect),
+    halfPhase_(0),
+    halfPrev_(0),
+    halfNext_(0),
+    blockLength_(0)
 {
-    for (int i = 0; i < 6; i++) volumes_[i] = 0;
-    opll_ = OPLL_new(kMasterClock, sampleRate);
-    OPLLC::ResetRhythmMode(opll_);
+    std::memset(hitOffsets_, 0, sizeof hitOffsets_);
+    std::memset(hitLengths_, 0, sizeof hitLengths_);
+    for (int i = 0; i < DrumMap::kVolumes; i++) volumes_[i] = 0;
+    // The chip is created on Prepare or SetSampleRate.
 }
 
 RhythmDriver::~RhythmDriver() {
-    OPLL_delete(opll_);
+    if (opll_) OPLL_delete(opll_);
+}
+
+void RhythmDriver::Prepare() {
+    if (IsPrepared()) return;
+    TRACE_SCOPE("RhythmDriver::Prepare", sampleRate_);
+    OPLL_set_isa(CpuDispatch::GetIsa());
+    opll_ = OPLL_new(kMasterClock, sampleRate_);
+    ApplyQualityTier();
+    DrumMap::ResetRhythmMode(opll_);
+    if (cached_) BuildCache();
 }
 
 #pragma mark
 #pragma mark Output setting
 
 void RhythmDriver::SetSampleRate(unsigned int sampleRate) {
-    OPLL_set_rate(opll_, sampleRate);
+    // The cache is rendered per sample rate.
+    if (sampleRate != sampleRate_) cache_.clear();
+    sampleRate_ = sampleRate;
+    if (!IsPrepared()) {
+        Prepare();
+        return;
+    }
+    ApplyQualityTier();
+    if (cached_ && cache_.empty()) {
+        KeyOffAll();
+        BuildCache();
+    }
+}
+
+void RhythmDriver::SetCachedMode(bool enable) {
+    if (enable == cached_) return;
+    KeyOffAll();
+    cached_ = enable;
+    if (enable && cache_.empty() && IsPrepared()) BuildCache();
 }
 
 #pragma mark
 #pragma mark Key on and off
 
 void RhythmDriver::KeyOn(int note, float velocity) {
-    state_ |= NoteToKeyBit(note);
-    int vrp = NoteToVolumeRegisterPosition(note);
-    volumes_[vrp] = velocity;
-    OPLLC::SetVolumeRegisters(opll_, volumes_, vrp);
-    OPLLC::SendKeyState(opll_, state_);
+    stats_.AddEvent();
+    if (!IsPrepared()) return;
+    TRACE_SCOPE("RhythmDriver::KeyOn", note);
+    int keyBit = drumMap_.NoteToKeyBit(note);
+    velocity = drumMap_.ApplyCurve(note, velocity);
+    if (!cached_ || (keyBit & kLinkedDrums)) {
+        KeyOnChip(keyBit, velocity);
+        return;
+    }
+    if (keyBit == 0) return;
+    // Stop the drum on the chip and start the cached hit.
+    if (state_ & keyBit) {
+        state_ &= ~keyBit;
+        DrumMap::SendKeyState(opll_, state_);
+    }
+    int drum = KeyBitToDrum(keyBit);
+    int level = VelocityToLevel(velocity);
+    Voice& voice = voices_[drum];
+    voice.offset_ = hitOffsets_[drum][level];
+    voice.length_ = hitLengths_[drum][level];
+    voice.position_ = 0;
 }
 
 void RhythmDriver::KeyOff(int note) {
-    state_ &= ~NoteToKeyBit(note);
-    OPLLC::SendKeyState(opll_, state_);
+    stats_.AddEvent();
+    if (!IsPrepared()) return;
+    state_ &= ~drumMap_.NoteToKeyBit(note);
+    DrumMap::SendKeyState(opll_, state_);
 }
 
 void RhythmDriver::KeyOffAll() {
     state_ = 0;
-    OPLLC::SendKeyState(opll_, state_);
+    if (IsPrepared()) DrumMap::SendKeyState(opll_, state_);
+    for (int i = 0; i < kDrums; i++) voices_[i] = Voice();
 }
 
 #pragma mark
 #pragma mark Output processing
 
-float RhythmDriver::Step() {
-    return (4.0f / 32767) * OPLL_calc(opll_);
+void RhythmDriver::Render(float* buffer, int length) {
+    BeginBlock();
+    RenderSegment(buffer, length);
+    EndBlock();
+}
+
+void RhythmDriver::Render(double* buffer, int length) {
+    BeginBlock();
+    RenderSegment(buffer, length);
+    EndBlock();
+}
+
+void RhythmDriver::BeginBlock() {
+    governor_.BeginBlock();
+    stats_.BeginBlock();
+    blockLength_ = 0;
+}
+
+void RhythmDriver::RenderSegment(float* buffer, int length) {
+    TRACE_SCOPE("RhythmDriver::Render", length);
+    blockLength_ += length;
+    while (length > 0) {
+        int count = length < kRenderBlock ? length : kRenderBlock;
+        RenderRaw(renderBuffer_, count);
+        SampleFormat::Int32ToFloat(renderBuffer_, buffer, count, kOutputGain);
+        buffer += count;
+        length -= count;
+    }
+}
+
+void RhythmDriver::RenderSegment(double* buffer, int length) {
+    TRACE_SCOPE("RhythmDriver::Render", length);
+    blockLength_ += length;
+    while (length > 0) {
+        int count = length < kRenderBlock ? length : kRenderBlock;
+        RenderRaw(renderBuffer_, count);
+        SampleFormat::Int32ToDouble(renderBuffer_, buffer, count, kOutputGain);
+        buffer += count;
+        length -= count;
+    }
+}
+
+void RhythmDriver::EndBlock() {
+    UpdateQualityTier(blockLength_);
+    UpdateStats(blockLength_);
+}
+
+void RhythmDriver::RenderRaw(int* buffer, int length) {
+    if (!IsPrepared()) {
+        for (int i = 0; i < length; i++) buffer[i] = 0;
+        return;
+    }
+    if (!cached_) {
+        for (int i = 0; i < length; i += kRenderBlock) {
+            RenderChip(buffer + i, length - i < kRenderBlock ? length - i : kRenderBlock);
+        }
+        declicker_.Process(buffer, length);
+        return;
+    }
+    
+    // Mix the cached hits.
+    for (int i = 0; i < length; i++) buffer[i] = 0;
+    for (int drum = 0; drum < kDrums; drum++) {
+        Voice& voice = voices_[drum];
+        int count = voice.length_ - voice.position_;
+        if (count <= 0) continue;
+        if (count > length) count = length;
+        const short* source = &cache_[0] + voice.offset_ + voice.position_;
+        for (int i = 0; i < count; i++) buffer[i] += source[i];
+        voice.position_ += count;
+    }
+    
+    // Clock the chip only while it has something to play. The chunks end
+    // where the chip could go quiet, so it stops at the same sample.
+    for (int position = 0; position < length && chipActive_;) {
+        int count = length - position;
+        if (count > kRenderBlock) count = kRenderBlock;
+        if (state_ == 0 && count > kQuietLength - chipQuietCount_) count = kQuietLength - chipQuietCount_;
+        RenderChip(chipBuffer_, count);
+        for (int i = 0; i < count; i++) {
+            int sample = chipBuffer_[i];
+            buffer[position + i] += sample;
+            if (state_ == 0 && sample == 0) {
+                if (++chipQuietCount_ >= kQuietLength) chipActive_ = false;
+            } else {
+                chipQuietCount_ = 0;
+            }
+        }
+        position += count;
+    }
+    declicker_.Process(buffer, length);
+}
+
+void RhythmDriver::SetQualityTier(QualityGovernor::Tier tier) {
+    governor_.SetTier(tier);
+    if (tier == tier_) return;
+    TRACE_INSTANT("quality tier", tier);
+    tier_ = tier;
+    if (IsPrepared()) {
+        ApplyQualityTier();
+        if (chipActive_ || !cached_) declicker_.Trigger();
+    }
+}
+
+#pragma mark
+#pragma mark Internal functions
+
+void RhythmDriver::BuildCache() {
+    TRACE_SCOPE("RhythmDriver::BuildCache", sampleRate_);
+    int gate = kCachedGate * sampleRate_;
+    int maxLength = kMaxHitLength * sampleRate_;
+    cache_.clear();
+    
+    // Render each drum at each volume level on a scratch chip. The linked
+    // drums always play on the chip.
+    OPLL* scratch = OPLL_new(kMasterClock, sampleRate_);
+    for (int drum = 0; drum < kDrums; drum++) {
+        if ((1 << drum) & kLinkedDrums) continue;
+        for (int level = 0; level < kLevels; level++) {
+            OPLL_reset(scratch);
+            DrumMap::ResetRhythmMode(scratch);
+            float volumes[DrumMap::kVolumes] = { 0 };
+            int vrp = DrumMap::KeyBitToVolumeRegisterPosition(1 << drum);
+            volumes[vrp] = 1.0f - (level + 0.5f) * (1.0f / 15);
+            DrumMap::SendVolume(scratch, volumes, vrp);
+            DrumMap::SendKeyState(scratch, 1 << drum);
+            
+            int offset = static_cast<int>(cache_.size());
+            int length = 0, quiet = 0;
+            for (int i = 0; i < maxLength && quiet < kQuietLength; i++) {
+                if (i == gate) DrumMap::SendKeyState(scratch, 0);
+                int sample = OPLL_calc(scratch);
+                cache_.push_back(sample);
+                if (sample != 0) {
+                    length = i + 1;
+                    quiet = 0;
+                } else if (i >= gate) {
+                    quiet++;
+                }
+            }
+            // Trim the silent tail.
+            cache_.resize(offset + length);
+            hitOffsets_[drum][level] = offset;
+            hitLengths_[drum][level] = length;
+        }
+    }
+    OPLL_delete(scratch);
+    
+    for (int i = 0; i < kDrums; i++) voices_[i] = Voice();
+}
+
+void RhythmDriver::RenderChip(int* buffer, int length) {
+    if (tier_ != QualityGovernor::kTierReduced) {
+        OPLL_calc_block(opll_, buffer, length);
+        return;
+    }
+    TRACE_SCOPE("half rate", length);
+    // Clock the chip every other sample and interpolate between.
+    OPLL_calc_block(opll_, halfBuffer_, (length + 1 - halfPhase_) / 2);
+    const int* next = halfBuffer_;
+    for (int i = 0; i < length; i++) {
+        halfPhase_ ^= 1;
+        if (halfPhase_) {
+            halfPrev_ = halfNext_;
+            halfNext_ = *next++;
+            buffer[i] = (halfPrev_ + halfNext_) >> 1;
+        } else {
+            buffer[i] = halfNext_;
+        }
+    }
+}
+
+void RhythmDriver::ApplyQualityTier() {
+    OPLL_set_quality(opll_, tier_ == QualityGovernor::kTierHigh ? 1 : 0);
+    OPLL_set_rate(opll_, tier_ == QualityGovernor::kTierReduced ? sampleRate_ / 2 : sampleRate_);
+}
+
+void RhythmDriver::UpdateQualityTier(int length) {
+    governor_.EndBlock(length, sampleRate_);
+    if (governor_.IsEnabled() && governor_.GetTier() != tier_) SetQualityTier(governor_.GetTier());
+}
+
+void RhythmDriver::UpdateStats(int length) {
+    int voices = 0;
+    unsigned int writes = 0;
+    if (IsPrepared()) {
+        voices = RenderStats::CountVoices(OPLL_getSoundingMask(opll_) & OPLL_MASK_RHYTHM);
+        for (int i = 0; i < kDrums; i++) {
+            if (voices_[i].position_ < voices_[i].length_) voices++;
+        }
+        writes = OPLL_getWriteCount(opll_);
+    }
+    stats_.EndBlock(length, sampleRate_, voices, writes);
+}
+
+void RhythmDriver::KeyOnChip(int keyBit, float velocity) {
+    state_ = DrumMap::SendKeyOn(opll_, state_, volumes_, keyBit, velocity);
+    chipActive_ = true;
+    chipQuietCount_ = 0;
 }
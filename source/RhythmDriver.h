@@ -1,7 +1,11 @@
 #ifndef __RhythmDriver__
 #define __RhythmDriver__
 
+#include "DrumMap.h"
+#include "QualityGovernor.h"
+#include "RenderStats.h"
 #include <string>
+#include <vector>
 
 extern "C" {
     struct __OPLL;
@@ -14,18 +18,95 @@ public:
     RhythmDriver(unsigned int sampleRate);
     ~RhythmDriver();
     
+    // Creates the chip (and the cache in the cached mode). The constructor
+    // doesn't touch the emulator, so this (or the first SetSampleRate) has
+    // to be called before playing.
+    void Prepare();
+    bool IsPrepared() { return opll_ != 0; }
+    
     void SetSampleRate(unsigned int sampleRate);
     
+    // Cached mode: the bass drum and tom hits are played back from
+    // one-shots pre-rendered at each volume level, and their key offs are
+    // ignored. The hi-hat, cymbal and snare stay on the chip, as they share
+    // slots and the noise generator.
+    void SetCachedMode(bool enable);
+    bool GetCachedMode() { return cached_; }
+    // Enabling the cached mode renders the cache unless it's ready.
+    bool IsCacheReady() { return !cache_.empty(); }
+    
+    DrumMap& GetDrumMap() { return drumMap_; }
+    
     void KeyOn(int note, float velocity);
     void KeyOff(int note);
     void KeyOffAll();
     
-    float Step();
+    void Render(float* buffer, int length);
+    void Render(double* buffer, int length);
+    // A host block rendered in segments (split at its events): the governor
+    // and the statistics measure the whole block, not each segment.
+    void BeginBlock();
+    void RenderSegment(float* buffer, int length);
+    void RenderSegment(double* buffer, int length);
+    void EndBlock();
+    // Raw output (16-bit range).
+    void RenderRaw(int* buffer, int length);
+    
+    // Quality tier of the chip (the cached hits are not affected). While
+    // the governor is enabled it picks the tier from the render time.
+    void SetQualityTier(QualityGovernor::Tier tier);
+    QualityGovernor::Tier GetQualityTier() { return tier_; }
+    QualityGovernor& GetGovernor() { return governor_; }
+    
+    // Statistics of the rendered blocks.
+    RenderStats& GetStats() { return stats_; }
     
 private:
+    static const int kDrums = 5;
+    static const int kLevels = 16;
+    
+    // Playback position in a cached hit.
+    struct Voice {
+        int offset_;
+        int length_;
+        int position_;
+        Voice() : offset_(0), length_(0), position_(0) {}
+    };
+    
     struct __OPLL* opll_;
+    unsigned int sampleRate_;
+    DrumMap drumMap_;
     int state_;
-    float volumes_[6];
+    float volumes_[DrumMap::kVolumes];
+    
+    bool cached_;
+    std::vector<short> cache_;
+    int hitOffsets_[kDrums][kLevels];
+    int hitLengths_[kDrums][kLevels];
+    Voice voices_[kDrums];
+    bool chipActive_;
+    int chipQuietCount_;
+    
+    static const int kRenderBlock = 256;
+    int renderBuffer_[kRenderBlock];
+    int chipBuffer_[kRenderBlock];
+    int halfBuffer_[kRenderBlock];
+    
+    QualityGovernor governor_;
+    QualityGovernor::Tier tier_;
+    RenderStats stats_;
+    Declicker declicker_;
+    int halfPhase_;         // upsampler state in the reduced tier
+    int halfPrev_;
+    int halfNext_;
+    int blockLength_;       // samples rendered in the current block
+    
+    void RenderChip(int* buffer, int length);
+    void ApplyQualityTier();
+    void UpdateQualityTier(int length);
+    void UpdateStats(int length);
+    void BuildCache();
+    void KeyOnChip(int keyBit, float velocity);
 };
 
 #endif
@@ -0,0 +1,235 @@
+#include "SampleFormat.h"
+#include "CpuDispatch.h"
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SAMPLE_FORMAT_SSE2
+#include <emmintrin.h>
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SAMPLE_FORMAT_VARIANTS
+#include <immintrin.h>
+#define SAMPLE_FORMAT_AVX2 __attribute__((target("avx2")))
+#define SAMPLE_FORMAT_AVX512 __attribute__((target("avx512f")))
+#endif
+
+#pragma mark Instruction set variants
+
+#ifdef SAMPLE_FORMAT_VARIANTS
+namespace {
+    // Each of them converts the whole vectors and returns the count;
+    // the rest is left to the generic code.
+    
+    SAMPLE_FORMAT_AVX2 int Int32ToFloatAVX2(const int* input, float* output, int length, float gain) {
+        int i = 0;
+        __m256 g = _mm256_set1_ps(gain);
+        for (; i + 8 <= length; i += 8) {
+            __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(input + i));
+            _mm256_storeu_ps(output + i, _mm256_mul_ps(_mm256_cvtepi32_ps(x), g));
+        }
+        return i;
+    }
+    
+    // The zero-masked conversions are used as the plain ones trigger
+    // -Wmaybe-uninitialized in the GCC headers.
+    
+    SAMPLE_FORMAT_AVX512 int Int32ToFloatAVX512(const int* input, float* output, int length, float gain) {
+        int i = 0;
+        __m512 g = _mm512_set1_ps(gain);
+        for (; i + 16 <= length; i += 16) {
+            __m512i x = _mm512_loadu_si512(input + i);
+            _mm512_storeu_ps(output + i, _mm512_mul_ps(_mm512_maskz_cvtepi32_ps(0xffff, x), g));
+        }
+        return i;
+    }
+    
+    SAMPLE_FORMAT_AVX2 int Int32ToDoubleAVX2(const int* input, double* output, int length, double gain) {
+        int i = 0;
+        __m256d g = _mm256_set1_pd(gain);
+        for (; i + 4 <= length; i += 4) {
+            __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(input + i));
+            _mm256_storeu_pd(output + i, _mm256_mul_pd(_mm256_cvtepi32_pd(x), g));
+        }
+        return i;
+    }
+    
+    SAMPLE_FORMAT_AVX512 int Int32ToDoubleAVX512(const int* input, double* output, int length, double gain) {
+        int i = 0;
+        __m512d g = _mm512_set1_pd(gain);
+        for (; i + 8 <= length; i += 8) {
+            __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(input + i));
+            _mm512_storeu_pd(output + i, _mm512_mul_pd(_mm512_maskz_cvtepi32_pd(0xff, x), g));
+        }
+        return i;
+    }
+    
+    SAMPLE_FORMAT_AVX2 int AccumulateAVX2(const int* input, int* output, int length) {
+        int i = 0;
+        for (; i + 8 <= length; i += 8) {
+            __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(input + i));
+            __m256i y = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(output + i));
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(output + i), _mm256_add_epi32(x, y));
+        }
+        return i;
+    }
+    
+    SAMPLE_FORMAT_AVX512 int AccumulateAVX512(const int* input, int* output, int length) {
+        int i = 0;
+        for (; i + 16 <= length; i += 16) {
+            __m512i x = _mm512_loadu_si512(input + i);
+            __m512i y = _mm512_loadu_si512(output + i);
+            _mm512_storeu_si512(output + i, _mm512_add_epi32(x, y));
+        }
+        return i;
+    }
+}
+#endif
+
+#pragma mark
+
+#pragma mark Integer to floating point
+
+void SampleFormat::Int16ToFloat(const short* input, float* output, int length, float gain) {
+    int i = 0;
+#ifdef SAMPLE_FORMAT_SSE2
+    __m128 g = _mm_set1_ps(gain);
+    for (; i + 8 <= length; i += 8) {
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(input + i));
+        // Sign-extend to 32 bits.
+        __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16);
+        __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16);
+        _mm_storeu_ps(output + i, _mm_mul_ps(_mm_cvtepi32_ps(lo), g));
+        _mm_storeu_ps(output + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi), g));
+    }
+#endif
+    for (; i < length; i++) output[i] = input[i] * gain;
+}
+
+void SampleFormat::Int16ToDouble(const short* input, double* output, int length, double gain) {
+    int i = 0;
+#ifdef SAMPLE_FORMAT_SSE2
+    __m128d g = _mm_set1_pd(gain);
+    for (; i + 4 <= length; i += 4) {
+        __m128i x = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(input + i));
+        __m128i w = _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16);
+        _mm_storeu_pd(output + i, _mm_mul_pd(_mm_cvtepi32_pd(w), g));
+        _mm_storeu_pd(output + i + 2, _mm_mul_pd(_mm_cvtepi32_pd(_mm_srli_si128(w, 8)), g));
+    }
+#endif
+    for (; i < length; i++) output[i] = input[i] * gain;
+}
+
+void SampleFormat::Int32ToFloat(const int* input, float* output, int length, float gain) {
+    int i = 0;
+#ifdef SAMPLE_FORMAT_VARIANTS
+    switch (CpuDispatch::GetIsa()) {
+        case CpuDispatch::kIsaAVX512: i = Int32ToFloatAVX512(input, output, length, gain); break;
+        case CpuDispatch::kIsaAVX2: i = Int32ToFloatAVX2(input, output, length, gain); break;
+        default: break;
+    }
+#endif
+#ifdef SAMPLE_FORMAT_SSE2
+    __m128 g = _mm_set1_ps(gain);
+    for (; i + 4 <= length; i += 4) {
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(input + i));
+        _mm_storeu_ps(output + i, _mm_mul_ps(_mm_cvtepi32_ps(x), g));
+    }
+#endif
+    for (; i < length; i++) output[i] = static_cast<float>(input[i]) * gain;
+}
+
+void SampleFormat::Int32ToDouble(const int* input, double* output, int length, double gain) {
+    int i = 0;
+#ifdef SAMPLE_FORMAT_VARIANTS
+    switch (CpuDispatch::GetIsa()) {
+        case CpuDispatch::kIsaAVX512: i = Int32ToDoubleAVX512(input, output, length, gain); break;
+        case CpuDispatch::kIsaAVX2: i = Int32ToDoubleAVX2(input, output, length, gain); break;
+        default: break;
+    }
+#endif
+#ifdef SAMPLE_FORMAT_SSE2
+    __m128d g = _mm_set1_pd(gain);
+    for (; i + 4 <= length; i += 4) {
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(input + i));
+        _mm_storeu_pd(output + i, _mm_mul_pd(_mm_cvtepi32_pd(x), g));
+        _mm_storeu_pd(output + i + 2, _mm_mul_pd(_mm_cvtepi32_pd(_mm_srli_si128(x, 8)), g));
+    }
+#endif
+    for (; i < length; i++) output[i] = input[i] * gain;
+}
+
+#pragma mark
+#pragma mark Mixing
+
+void SampleFormat::Accumulate(const int* input, int* output, int length) {
+    int i = 0;
+#ifdef SAMPLE_FORMAT_VARIANTS
+    switch (CpuDispatch::GetIsa()) {
+        case CpuDispatch::kIsaAVX512: i = AccumulateAVX512(input, output, length); break;
+        case CpuDispatch::kIsaAVX2: i = AccumulateAVX2(input, output, length); break;
+        default: break;
+    }
+#endif
+#ifdef SAMPLE_FORMAT_SSE2
+    for (; i + 4 <= length; i += 4) {
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(input + i));
+        __m128i y = _mm_loadu_si128(reinterpret_cast<const __m128i*>(output + i));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(output + i), _mm_add_epi32(x, y));
+    }
+#endif
+    for (; i < length; i++) output[i] += input[i];
+}
+
+#pragma mark
+#pragma mark Channel layout
+
+void SampleFormat::FanOut(const float* input, float** outputs, int channels, int length) {
+    for (int ch = 0; ch < channels; ch++) {
+        if (outputs[ch] != input) std::memcpy(outputs[ch], input, sizeof(float) * length);
+    }
+}
+
+void SampleFormat::FanOut(const double* input, double** outputs, int channels, int length) {
+    for (int ch = 0; ch < channels; ch++) {
+        if (outputs[ch] != input) std::memcpy(outputs[ch], input, sizeof(double) * length);
+    }
+}
+
+void SampleFormat::Interleave(const float* const* inputs, float* output, int channels, int length) {
+    int i = 0;
+#ifdef SAMPLE_FORMAT_SSE2
+    if (channels == 2) {
+        const float* left = inputs[0];
+        const float* right = inputs[1];
+        for (; i + 4 <= length; i += 4) {
+            __m128 l = _mm_loadu_ps(left + i);
+            __m128 r = _mm_loadu_ps(right + i);
+            _mm_storeu_ps(output + i * 2, _mm_unpacklo_ps(l, r));
+            _mm_storeu_ps(output + i * 2 + 4, _mm_unpackhi_ps(l, r));
+        }
+    }
+#endif
+    for (; i < length; i++) {
+        for (int ch = 0; ch < channels; ch++) output[i * channels + ch] = inputs[ch][i];
+    }
+}
+
+void SampleFormat::Deinterleave(const float* input, float** outputs, int channels, int length) {
+    int i = 0;
+#ifdef SAMPLE_FORMAT_SSE2
+    if (channels == 2) {
+        float* left = outputs[0];
+        float* right = outputs[1];
+        for (; i + 4 <= length; i += 4) {
+            __m128 a = _mm_loadu_ps(input + i * 2);
+            __m128 b = _mm_loadu_ps(input + i * 2 + 4);
+            _mm_storeu_ps(left + i, _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)));
+            _mm_storeu_ps(right + i, _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+        }
+    }
+#endif
+    for (; i < length; i++) {
+        for (int ch = 0; ch < channels; ch++) outputs[ch][i] = input[i * channels + ch];
+    }
+}
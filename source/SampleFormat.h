@@ -0,0 +1,28 @@
+#ifndef __SampleFormat__
+#define __SampleFormat__
+
+// Sample format conversion kernels shared by the drivers and the tools.
+// SSE2 is used when the compiler targets it; the other targets run the
+// scalar versions. The 32-bit conversions and the mixing also have AVX2
+// and AVX-512 variants chosen by CpuDispatch. The buffers don't have to
+// be aligned.
+namespace SampleFormat {
+    // Integer to floating point with gain.
+    void Int16ToFloat(const short* input, float* output, int length, float gain);
+    void Int16ToDouble(const short* input, double* output, int length, double gain);
+    void Int32ToFloat(const int* input, float* output, int length, float gain);
+    void Int32ToDouble(const int* input, double* output, int length, double gain);
+    
+    // Adds the input to the output (mixing the chips).
+    void Accumulate(const int* input, int* output, int length);
+    
+    // Copies a mono buffer to each of the channels.
+    void FanOut(const float* input, float** outputs, int channels, int length);
+    void FanOut(const double* input, double** outputs, int channels, int length);
+    
+    // Conversion between the separate channel buffers and an interleaved buffer.
+    void Interleave(const float* const* inputs, float* output, int channels, int length);
+    void Deinterleave(const float* input, float** outputs, int channels, int length);
+}
+
+#endif
@@ -0,0 +1,159 @@
+#include "SessionCapture.h"
+
+#ifdef VST2413_CAPTURE
+
+#include <cstdio>
+#include <cstdlib>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <process.h>
+#define snprintf _snprintf
+#else
+#include <unistd.h>
+#endif
+
+namespace {
+    // Calls per instance between the writes (16 MB).
+    const unsigned int kCapacity = 1 << 20;
+    
+    volatile int instanceCount = 0;
+
+#ifdef _WIN32
+    inline unsigned int FetchAdd(volatile unsigned int& target) {
+        return InterlockedIncrement(reinterpret_cast<volatile LONG*>(&target)) - 1;
+    }
+    
+    inline int GetProcessId() {
+        return _getpid();
+    }
+#else
+    inline unsigned int FetchAdd(volatile unsigned int& target) {
+        return __atomic_fetch_add(&target, 1, __ATOMIC_RELAXED);
+    }
+    
+    inline int GetProcessId() {
+        return static_cast<int>(getpid());
+    }
+#endif
+}
+
+#pragma mark Creation and destruction
+
+SessionCapture::SessionCapture(char plugin)
+:   plugin_(plugin),
+    records_(0),
+    count_(0),
+    dropped_(0),
+    processed_(false),
+    written_(false)
+{
+    path_[0] = 0;
+    const char* directory = std::getenv("VST2413_CAPTURE");
+    if (!directory || !*directory) return;
+    int instance = static_cast<int>(FetchAdd(reinterpret_cast<volatile unsigned int&>(instanceCount)));
+    snprintf(path_, sizeof path_, "%s/vst2413%c-%d-%d.session", directory, plugin, GetProcessId(), instance);
+    path_[sizeof path_ - 1] = 0;
+    records_ = static_cast<Record*>(std::malloc(sizeof(Record) * kCapacity));
+}
+
+SessionCapture::~SessionCapture() {
+    if (records_ && (processed_ || written_)) Write();
+    std::free(records_);
+}
+
+#pragma mark
+#pragma mark Recording
+
+void SessionCapture::SetChunk(const void* data, int size) {
+    if (!records_ || size <= 0) return;
+    Record* record = Reserve();
+    if (!record) return;
+    record->type_ = kChunk;
+    record->value_ = static_cast<int>(chunks_.size());
+    record->size_ = size;
+    const unsigned char* bytes = static_cast<const unsigned char*>(data);
+    chunks_.insert(chunks_.end(), bytes, bytes + size);
+}
+
+void SessionCapture::Suspend() {
+    // Not the first call, which the plug-ins make on construction.
+    if (count_ > 0 || written_) Add(kSuspend, 0, 0);
+    if (records_ && processed_) Write();
+}
+
+void SessionCapture::Midi(int frame, const char* data) {
+    if (!records_) return;
+    Record* record = Reserve();
+    if (!record) return;
+    record->type_ = kMidi;
+    record->value_ = frame;
+    for (int i = 0; i < 3; i++) record->data_[i] = static_cast<unsigned char>(data[i]);
+}
+
+SessionCapture::Record* SessionCapture::Reserve() {
+    unsigned int index = FetchAdd(count_);
+    if (index >= kCapacity) {
+        FetchAdd(dropped_);
+        return 0;
+    }
+    return &records_[index];
+}
+
+void SessionCapture::Add(Type type, int value, float number) {
+    if (!records_) return;
+    Record* record = Reserve();
+    if (!record) return;
+    record->type_ = type;
+    record->value_ = value;
+    record->number_ = number;
+}
+
+#pragma mark
+#pragma mark File output
+
+void SessionCapture::Write() {
+    std::FILE* file = std::fopen(path_, written_ ? "a" : "w");
+    if (!file) return;
+    if (!written_) std::fprintf(file, "session 1 %c\n", plugin_);
+    
+    unsigned int count = count_ < kCapacity ? count_ : kCapacity;
+    for (unsigned int i = 0; i < count; i++) {
+        const Record& r = records_[i];
+        switch (r.type_) {
+            case kRate:
+                std::fprintf(file, "rate %.9g\n", r.number_);
+                break;
+            case kParameter:
+                std::fprintf(file, "param %d %.9g\n", r.value_, r.number_);
+                break;
+            case kChunk:
+                std::fprintf(file, "chunk ");
+                for (int j = 0; j < r.size_; j++) std::fprintf(file, "%02x", chunks_[r.value_ + j]);
+                std::fprintf(file, "\n");
+                break;
+            case kResume:
+                std::fprintf(file, "resume\n");
+                break;
+            case kSuspend:
+                std::fprintf(file, "suspend\n");
+                break;
+            case kMidi:
+                std::fprintf(file, "midi %d %02x %02x %02x\n", r.value_, r.data_[0], r.data_[1], r.data_[2]);
+                break;
+            case kProcess:
+                std::fprintf(file, "process %d\n", r.value_);
+                break;
+        }
+    }
+    if (dropped_ > 0) std::fprintf(file, "dropped %u\n", dropped_);
+    std::fclose(file);
+    
+    written_ = true;
+    count_ = 0;
+    dropped_ = 0;
+    processed_ = false;
+    chunks_.clear();
+}
+
+#endif
@@ -0,0 +1,105 @@
+#ifndef __SessionCapture__
+#define __SessionCapture__
+
+// Capture of the host calls of a plug-in instance, for the replay
+// benchmark (bench/Replay.cpp) and its corpus (bench/sessions).
+//
+// Compiled in when VST2413_CAPTURE is defined; the calls are empty
+// otherwise. It records only when the VST2413_CAPTURE environment
+// variable gives a directory, where each instance writes the file
+// vst2413<plug-in>-<process id>-<instance>.session.
+//
+// The calls are recorded into a fixed-size buffer without locking, so
+// the audio thread stays real-time safe, and are appended to the file on
+// suspend (once a block was processed) and on destruction, while the
+// audio thread is idle. The calls past the end of the buffer are dropped.
+//
+// The file is text with one call per line. It has nothing but what the
+// plug-in sees: no host, track or file names.
+//
+//   session 1 <p, r or s>          first line: format version and plug-in
+//   rate <Hz>                      setSampleRate
+//   param <index> <value>          setParameter
+//   chunk <bytes in hex>           setChunk
+//   resume
+//   suspend
+//   midi <frame> <status> <data1> <data2>  MIDI event (hex bytes)
+//   process <frames>               processReplacing or processDoubleReplacing
+//   dropped <calls>                calls lost to the full buffer here
+//
+// The MIDI events apply to the next process. Lines starting with # are
+// comments.
+
+#ifdef VST2413_CAPTURE
+
+#include <vector>
+
+class SessionCapture {
+public:
+    // The plug-in is 'p', 'r' or 's'.
+    explicit SessionCapture(char plugin);
+    ~SessionCapture();
+    
+    void SetSampleRate(float sampleRate) { Add(kRate, 0, sampleRate); }
+    void SetParameter(int index, float value) { Add(kParameter, index, value); }
+    void SetChunk(const void* data, int size);
+    void Resume() { Add(kResume, 0, 0); }
+    // Records the call and writes the file.
+    void Suspend();
+    
+    // Audio thread.
+    void Midi(int frame, const char* data);
+    void Process(int length) { Add(kProcess, length, 0); processed_ = true; }
+
+private:
+    enum Type {
+        kRate,
+        kParameter,
+        kChunk,
+        kResume,
+        kSuspend,
+        kMidi,
+        kProcess
+    };
+    
+    struct Record {
+        char type_;
+        unsigned char data_[3];
+        int value_;         // index, frame, length or chunk offset
+        float number_;      // sample rate or value
+        int size_;          // chunk size
+    };
+    
+    char plugin_;
+    Record* records_;       // null while inactive
+    volatile unsigned int count_;
+    volatile unsigned int dropped_;
+    volatile bool processed_;
+    std::vector<unsigned char> chunks_;
+    char path_[1024];
+    bool written_;
+    
+    // Reserves a record; null when the buffer is full.
+    Record* Reserve();
+    void Add(Type type, int value, float number);
+    void Write();
+};
+
+#else
+
+class SessionCapture {
+public:
+    explicit SessionCapture(char plugin) {}
+    
+    void SetSampleRate(float sampleRate) {}
+    void SetParameter(int index, float value) {}
+    void SetChunk(const void* data, int size) {}
+    void Resume() {}
+    void Suspend() {}
+    void Midi(int frame, const char* data) {}
+    void Process(int length) {}
+};
+
+#endif
+
+#endif
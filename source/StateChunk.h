@@ -0,0 +1,34 @@
+#ifndef __StateChunk__
+#define __StateChunk__
+
+#include <cstring>
+
+// Byte-level helpers for the binary state chunks.
+// All the multi-byte values are stored in little-endian order.
+namespace StateChunk {
+    inline unsigned char* WriteByte(unsigned char* data, int value) {
+        *data = static_cast<unsigned char>(value);
+        return data + 1;
+    }
+    
+    inline const unsigned char* ReadByte(const unsigned char* data, int& value) {
+        value = *data;
+        return data + 1;
+    }
+    
+    inline unsigned char* WriteFloat(unsigned char* data, float value) {
+        unsigned int bits;
+        std::memcpy(&bits, &value, 4);
+        for (int i = 0; i < 4; i++) data[i] = static_cast<unsigned char>(bits >> (i * 8));
+        return data + 4;
+    }
+    
+    inline const unsigned char* ReadFloat(const unsigned char* data, float& value) {
+        unsigned int bits = 0;
+        for (int i = 0; i < 4; i++) bits |= static_cast<unsigned int>(data[i]) << (i * 8);
+        std::memcpy(&value, &bits, 4);
+        return data + 4;
+    }
+}
+
+#endif
@@ -1,88 +1,213 @@
 #include "SynthDriver.h"
+#include "CpuDispatch.h"
+#include "StateChunk.h"
+#include "PatchLibrary.h"
+#include "SampleFormat.h"
+#include "Trace.h"
 #include "emu2413/emu2413.h"
 #include <cmath>
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
 
 #ifdef _WIN32
-#define snprintf _snprintf
+#define vsnprintf _vsnprintf
 #endif
 
 namespace {
     // OPLL master clock = 3.579545 MHz
     const unsigned int kMasterClock = 3579545;
     
+    // Scale from the chip output to the float output.
+    const float kOutputGain = 4.0f / 32767;
+    
+    // Signature of the state chunk.
+    const char kStateMagic[4] = { 'V', '2', '4', 'S' };
+    
 #pragma mark Utility functions
     
     template <typename T> T Clamp(T value, T min, T max) {
         return value < min ? min : (value > max ? max : value);
     }
+    
+    // Text into a caller's buffer, always terminated (_vsnprintf isn't).
+    void CopyText(char* text, int size, const char* source) {
+        std::strncpy(text, source, size - 1);
+        text[size - 1] = 0;
+    }
+    
+    void FormatText(char* text, int size, const char* format, ...) {
+        va_list args;
+        va_start(args, format);
+        vsnprintf(text, size, format, args);
+        va_end(args);
+        text[size - 1] = 0;
+    }
 
 #pragma mark
 #pragma mark OPLL controller functions
 
     namespace OPLLC {
-        int CalculateFNumber(int note, float tune) {
-            int intervalFromA = (note - 9) % 12;
-            return 144.1792f * powf(2.0f, (1.0f / 12) * (intervalFromA + tune));
+        // Pitch is given in semitones (MIDI note number).
+        int CalculateBlockAndFNumber(float pitch) {
+            int block = Clamp(static_cast<int>(floorf((pitch - 9) / 12)), 0, 7);
+            int fnum = 144.1792f * powf(2.0f, (1.0f / 12) * (pitch - 9 - 12 * block));
+            return (block << 9) + Clamp(fnum, 0, 511);
         }
         
-        int NoteToBlock(int note) {
-            return Clamp((note - 9) / 12, 0, 7);
-        }
-        
-        int CalculateBlockAndFNumber(int note, const float* parameters, float wheel) {
-            int range = parameters[SynthDriver::kParameterWheelRange] * 12;
-            float tune = parameters[SynthDriver::kParameterFineTune] - 0.5f;
-            return (NoteToBlock(note) << 9) + CalculateFNumber(note, wheel * range + tune);
-        }
-
-        void SendKeyOn(OPLL* opll, const float* parameters, int channel, int program, int note, float wheel, float velocity) {
-            int bf = CalculateBlockAndFNumber(note, parameters, wheel);
+        void SendKeyOn(OPLL* opll, int channel, int program, int bf, float velocity) {
             int vl = 15.0f - velocity * 15;
             OPLL_writeReg(opll, 0x10 + channel, bf & 0xff);
             OPLL_writeReg(opll, 0x20 + channel, 0x10 + (bf >> 8));
             OPLL_writeReg(opll, 0x30 + channel, (program << 4) + vl);
         }
-
-        void SendKeyOff(OPLL* opll, const float* parameters, int channel, int program, int note, float wheel) {
-            int bf = CalculateBlockAndFNumber(note, parameters, wheel);
+        
+        void SendKeyOff(OPLL* opll, int channel, int bf) {
             OPLL_writeReg(opll, 0x20 + channel, bf >> 8);
         }
-
-        void AdjustPitch(OPLL* opll, const float* parameters, int channel, int note, float wheel, bool keyOn) {
-            int bf = CalculateBlockAndFNumber(note, parameters, wheel);
-            OPLL_writeReg(opll, 0x10 + channel, bf & 0xff);
-            OPLL_writeReg(opll, 0x20 + channel, (keyOn ? 0x10 : 0) + (bf >> 8));
+        
+        // Only rewrites the registers which are actually changed.
+        void AdjustPitch(OPLL* opll, int channel, int prevBF, int bf, bool keyOn) {
+            if ((bf & 0xff) != (prevBF & 0xff)) OPLL_writeReg(opll, 0x10 + channel, bf & 0xff);
+            if ((bf >> 8) != (prevBF >> 8)) OPLL_writeReg(opll, 0x20 + channel, (keyOn ? 0x10 : 0) + (bf >> 8));
         }
         
-        void SendARDR(OPLL* opll, const float* parameters, int op) {
-            int ar = (1.0f - parameters[SynthDriver::kParameterAR0 + op]) * 15;
-            int dr = (1.0f - parameters[SynthDriver::kParameterDR0 + op]) * 15;
-            OPLL_writeReg(opll, 4 + op, (ar << 4) + dr);
+        // Converts a normalized value into an integer field of the register.
+        // The bias keeps values like (15 - n) / 15 from truncating to n - 1.
+        int Quantize(float value, int steps) {
+            return Clamp(static_cast<int>(value * steps + 1.0e-4f), 0, steps);
         }
-
-        void SendSLRR(OPLL* opll, const float* parameters, int op) {
-            int sl = (1.0f - parameters[SynthDriver::kParameterSL0 + op]) * 15;
-            int rr = (1.0f - parameters[SynthDriver::kParameterRR0 + op]) * 15;
-            OPLL_writeReg(opll, 6 + op, (sl << 4) + rr);
+        
+        // Calculates a user patch register (0x00-0x07) from the parameters.
+        // The bits not covered by the parameters (EG, KR and KL) are given separately.
+        int CalculatePatchRegister(const float* parameters, const unsigned char* bits, int reg) {
+            switch (reg) {
+                case 0:
+                case 1: {
+                    int am  = parameters[SynthDriver::kParameterAM0  + reg] < 0.5f ? 0 : 0x80;
+                    int vib = parameters[SynthDriver::kParameterVIB0 + reg] < 0.5f ? 0 : 0x40;
+                    int mul = Quantize(parameters[SynthDriver::kParameterMUL0 + reg], 15);
+                    return am + vib + bits[reg] + mul;
+                }
+                case 2:
+                    return bits[2] + Quantize(1.0f - parameters[SynthDriver::kParameterTL], 63);
+                case 3: {
+                    int dc = parameters[SynthDriver::kParameterDC] < 0.5f ? 0 : 0x10;
+                    int dm = parameters[SynthDriver::kParameterDM] < 0.5f ? 0 : 0x08;
+                    int fb = Quantize(parameters[SynthDriver::kParameterFB], 7);
+                    return bits[3] + dc + dm + fb;
+                }
+                case 4:
+                case 5: {
+                    int ar = Quantize(1.0f - parameters[SynthDriver::kParameterAR0 + reg - 4], 15);
+                    int dr = Quantize(1.0f - parameters[SynthDriver::kParameterDR0 + reg - 4], 15);
+                    return (ar << 4) + dr;
+                }
+                default: {
+                    int sl = Quantize(1.0f - parameters[SynthDriver::kParameterSL0 + reg - 6], 15);
+                    int rr = Quantize(1.0f - parameters[SynthDriver::kParameterRR0 + reg - 6], 15);
+                    return (sl << 4) + rr;
+                }
+            }
         }
-
-        void SendMUL(OPLL* opll, const float* parameters, int op) {
-            int am  = parameters[SynthDriver::kParameterAM0  + op] < 0.5f ? 0 : 0x80;
-            int vib = parameters[SynthDriver::kParameterVIB0 + op] < 0.5f ? 0 : 0x40;
-            int mul = parameters[SynthDriver::kParameterMUL0 + op] * 15;
-            OPLL_writeReg(opll, op, am + vib + 0x20 + mul);
+        
+        // Inverse of CalculatePatchRegister.
+        void ParsePatchDump(const unsigned char* dump, float* parameters, unsigned char* bits) {
+            for (int op = 0; op < 2; op++) {
+                parameters[SynthDriver::kParameterAM0  + op] = (dump[op] & 0x80) ? 1.0f : 0.0f;
+                parameters[SynthDriver::kParameterVIB0 + op] = (dump[op] & 0x40) ? 1.0f : 0.0f;
+                parameters[SynthDriver::kParameterMUL0 + op] = (dump[op] & 15) * (1.0f / 15);
+                parameters[SynthDriver::kParameterAR0 + op] = (15 - (dump[4 + op] >> 4)) * (1.0f / 15);
+                parameters[SynthDriver::kParameterDR0 + op] = (15 - (dump[4 + op] & 15)) * (1.0f / 15);
+                parameters[SynthDriver::kParameterSL0 + op] = (15 - (dump[6 + op] >> 4)) * (1.0f / 15);
+                parameters[SynthDriver::kParameterRR0 + op] = (15 - (dump[6 + op] & 15)) * (1.0f / 15);
+                bits[op] = dump[op] & 0x30;
+            }
+            parameters[SynthDriver::kParameterTL] = (63 - (dump[2] & 63)) * (1.0f / 63);
+            parameters[SynthDriver::kParameterDC] = (dump[3] & 0x10) ? 1.0f : 0.0f;
+            parameters[SynthDriver::kParameterDM] = (dump[3] & 0x08) ? 1.0f : 0.0f;
+            parameters[SynthDriver::kParameterFB] = (dump[3] & 7) * (1.0f / 7);
+            bits[2] = dump[2] & 0xc0;
+            bits[3] = dump[3] & 0xc0;
         }
-
-        void SendFB(OPLL* opll, const float* parameters) {
-            int dc = parameters[SynthDriver::kParameterDC] < 0.5f ? 0 : 0x10;
-            int dm = parameters[SynthDriver::kParameterDM] < 0.5f ? 0 : 0x08;
-            int fb = parameters[SynthDriver::kParameterFB] * 7;
-            OPLL_writeReg(opll, 3, dc + dm + fb);
+        
+        // Returns the user patch register which holds the parameter, or -1.
+        int ParameterToPatchRegister(int id) {
+            switch (id) {
+                case SynthDriver::kParameterMUL0:
+                case SynthDriver::kParameterVIB0:
+                case SynthDriver::kParameterAM0:
+                    return 0;
+                case SynthDriver::kParameterMUL1:
+                case SynthDriver::kParameterVIB1:
+                case SynthDriver::kParameterAM1:
+                    return 1;
+                case SynthDriver::kParameterTL:
+                    return 2;
+                case SynthDriver::kParameterFB:
+                case SynthDriver::kParameterDM:
+                case SynthDriver::kParameterDC:
+                    return 3;
+                case SynthDriver::kParameterAR0:
+                case SynthDriver::kParameterDR0:
+                    return 4;
+                case SynthDriver::kParameterAR1:
+                case SynthDriver::kParameterDR1:
+                    return 5;
+                case SynthDriver::kParameterSL0:
+                case SynthDriver::kParameterRR0:
+                    return 6;
+                case SynthDriver::kParameterSL1:
+                case SynthDriver::kParameterRR1:
+                    return 7;
+                default:
+                    return -1;
+            }
+        }
+        
+        void SendParameter(OPLL* opll, const float* parameters, const unsigned char* bits, int id) {
+            int reg = ParameterToPatchRegister(id);
+            if (reg >= 0) OPLL_writeReg(opll, reg, CalculatePatchRegister(parameters, bits, reg));
+        }
+        
+        // Attenuation at which the release tails are cut (dB, 0 = off).
+        int CullLevel(const float* parameters) {
+            return static_cast<int>(parameters[SynthDriver::kParameterCullLevel] * 48 + 0.5f);
         }
+    }
+
+#pragma mark
+#pragma mark Modulation functions
 
-        void SendTL(OPLL* opll, const float* parameters) {
-            int tl = (1.0f - parameters[SynthDriver::kParameterTL]) * 63;
-            OPLL_writeReg(opll, 2, tl);
+    namespace Modulation {
+        const float kPi = 3.14159265f;
+        
+        // Default control rate (Hz).
+        const float kDefaultControlRate = 1000.0f;
+        
+        float GlideTime(const float* parameters) {
+            return parameters[SynthDriver::kParameterGlide];
+        }
+        
+        float VibratoDepth(const float* parameters) {
+            return parameters[SynthDriver::kParameterVibratoDepth];
+        }
+        
+        float VibratoRate(const float* parameters) {
+            return parameters[SynthDriver::kParameterVibratoRate] * 10;
+        }
+        
+        float VibratoDelay(const float* parameters) {
+            return parameters[SynthDriver::kParameterVibratoDelay] * 2;
+        }
+        
+        float WheelSmoothingTime(const float* parameters) {
+            return parameters[SynthDriver::kParameterWheelSmoothing] * 0.2f;
+        }
+        
+        // Coefficient of the exponential approach with the time constant.
+        float ApproachCoefficient(float time, float interval) {
+            return time > 0 ? 1.0f - expf(-interval / time) : 1.0f;
         }
     }
 }
@@ -91,12 +216,31 @@ namespace {
 #pragma mark Creation and destruction
 
 SynthDriver::SynthDriver(unsigned int sampleRate)
-:   opll_(0),
-    program_(kProgramUser),
+:   chips_(1),
+    maxChips_(kMaxChips),
+    sampleRate_(sampleRate),
+    library_(0),
     lastChannel_(0),
-    wheel_(0)
+    rhythmMode_(false),
+    drumKeyLow_(1),
+    drumKeyHigh_(0),
+    drumState_(0),
+    pitchDirty_(false),
+    controlCounter_(0),
+    tier_(QualityGovernor::kTierDirect),
+    halfPhase_(0),
+    halfPrev_(0),
+    halfNext_(0),
+    blockLength_(0)
 {
-    opll_ = OPLL_new(kMasterClock, sampleRate);
+    for (int i = 0; i < kMaxChips; i++) opll_[i] = 0;
+    for (int i = 0; i < DrumMap::kVolumes; i++) drumVolumes_[i] = 0;
+    for (int i = 0; i < kParts; i++) {
+        programs_[i] = kProgramUser;
+        wheelTargets_[i] = 0;
+        wheels_[i] = 0;
+        lastPitches_[i] = -1;
+    }
     // Initialize all the parameters.
     for (int i = 0; i < kParameters; i++) {
         parameters_[i] = 0.0f;
@@ -107,32 +251,95 @@ SynthDriver::SynthDriver(unsigned int sampleRate)
     parameters_[kParameterMUL1] = 1.1f / 15;
     parameters_[kParameterWheelRange] = 3.0f / 12;
     parameters_[kParameterFineTune] = 0.5f;
-    // Initialize the program on the OPLL.
-    OPLLC::SendARDR(opll_, parameters_, 0);
-    OPLLC::SendARDR(opll_, parameters_, 1);
-    OPLLC::SendSLRR(opll_, parameters_, 0);
-    OPLLC::SendSLRR(opll_, parameters_, 1);
-    OPLLC::SendMUL(opll_, parameters_, 0);
-    OPLLC::SendMUL(opll_, parameters_, 1);
-    OPLLC::SendFB(opll_, parameters_);
-    OPLLC::SendTL(opll_, parameters_);
+    // EG type on, the others off.
+    patchBits_[0] = patchBits_[1] = 0x20;
+    patchBits_[2] = patchBits_[3] = 0;
+    SetControlRate(Modulation::kDefaultControlRate);
+    // The chips are created on Prepare or SetSampleRate.
 }
 
 SynthDriver::~SynthDriver() {
-    OPLL_delete(opll_);
+    for (int i = 0; i < kMaxChips; i++) {
+        if (opll_[i]) OPLL_delete(opll_[i]);
+    }
+}
+
+void SynthDriver::Prepare() {
+    if (IsPrepared()) return;
+    TRACE_SCOPE("SynthDriver::Prepare", chips_);
+    OPLL_set_isa(CpuDispatch::GetIsa());
+    // All the chips up to the limit are created here, so that switching
+    // the expansion chips (an automatable parameter) doesn't allocate.
+    for (int i = 0; i < maxChips_; i++) {
+        opll_[i] = OPLL_new(kMasterClock, sampleRate_);
+        SetUpChip(opll_[i]);
+    }
+    if (rhythmMode_) SendRhythmMode();
 }
 
 #pragma mark
 #pragma mark Output setting
 
 void SynthDriver::SetSampleRate(unsigned int sampleRate) {
-    OPLL_set_rate(opll_, sampleRate);
+    sampleRate_ = sampleRate;
+    if (IsPrepared()) {
+        for (int i = 0; i < chips_; i++) ApplyQualityTier(opll_[i]);
+    } else {
+        Prepare();
+    }
+    SetControlRate(controlRate_);
+}
+
+void SynthDriver::SetControlRate(float rate) {
+    controlRate_ = Clamp(rate, 50.0f, 4000.0f);
+    controlInterval_ = Clamp(static_cast<int>(sampleRate_ / controlRate_), 1, static_cast<int>(sampleRate_));
+    controlCounter_ = Clamp(controlCounter_, 0, controlInterval_);
+}
+
+void SynthDriver::SetChipCount(int count) {
+    count = Clamp(count, 1, maxChips_);
+    if (count == chips_) return;
+    TRACE_SCOPE("SynthDriver::SetChipCount", count);
+    Panic();
+    if (IsPrepared()) {
+        // The idle chips missed the settings; start them over.
+        for (int i = chips_; i < count; i++) {
+            OPLL_reset(opll_[i]);
+            SetUpChip(opll_[i]);
+        }
+    }
+    chips_ = count;
+    lastChannel_ = 0;
+}
+
+void SynthDriver::SetMaxChipCount(int count) {
+    maxChips_ = Clamp(count, 1, kMaxChips);
+    if (chips_ > maxChips_) SetChipCount(maxChips_);
+    if (!IsPrepared()) return;
+    // Raised after Prepare; the chips above are not deleted.
+    for (int i = 0; i < maxChips_; i++) {
+        if (opll_[i]) continue;
+        opll_[i] = OPLL_new(kMasterClock, sampleRate_);
+        SetUpChip(opll_[i]);
+    }
+}
+
+void SynthDriver::SetRhythmMode(bool enable) {
+    if (enable == rhythmMode_) return;
+    Panic();
+    rhythmMode_ = enable;
+    if (IsPrepared()) SendRhythmMode();
+    lastChannel_ = 0;
 }
 
 #pragma mark
 #pragma mark Program
 
-SynthDriver::String SynthDriver::GetProgramName(ProgramID id) {
+void SynthDriver::SetProgram(ProgramID id) {
+    for (int i = 0; i < kParts; i++) programs_[i] = id;
+}
+
+void SynthDriver::GetProgramName(ProgramID id, char* text, int size) {
     static const char* names[] = {
         "User",
         "Violin",
@@ -151,99 +358,112 @@ SynthDriver::String SynthDriver::GetProgramName(ProgramID id) {
         "A.Bass",
         "E.Guitar"
     };
-    return names[id];
+    CopyText(text, size, names[id]);
 }
 
 #pragma mark
 #pragma mark Key on and off
 
-void SynthDriver::KeyOn(int note, float velocity) {
+void SynthDriver::KeyOn(int part, int note, float velocity) {
+    stats_.AddEvent();
+    if (!IsPrepared()) return;
+    TRACE_SCOPE("SynthDriver::KeyOn", note);
+    if (IsDrumNote(part, note)) {
+        float volume = drumMap_.ApplyCurve(note, velocity);
+        drumState_ = DrumMap::SendKeyOn(opll_[0], drumState_, drumVolumes_, drumMap_.NoteToKeyBit(note), volume);
+        return;
+    }
     int index = ChooseChannelIndex();
     ChannelInfo& info = channels_[index];
-    OPLLC::SendKeyOn(opll_, parameters_, index, program_, note, wheel_, velocity);
+    if (info.active_) stats_.AddSteal();
+    info.part_ = part;
     info.note_ = note;
     info.velocity_ = velocity;
     info.active_ = true;
+    // Glide from the last note in the part.
+    bool glide = Modulation::GlideTime(parameters_) > 0 && lastPitches_[part] >= 0;
+    info.pitch_ = glide ? lastPitches_[part] : note;
+    info.vibratoTime_ = 0;
+    info.blockAndFNumber_ = OPLLC::CalculateBlockAndFNumber(CalculatePitch(info));
+    OPLLC::SendKeyOn(opll_[index / kChannels], index % kChannels, programs_[part], info.blockAndFNumber_, velocity);
+    lastPitches_[part] = note;
     lastChannel_ = index;
 }
 
-void SynthDriver::KeyOff(int note) {
-    for (int i = 0; i < kChannels; i++) {
+void SynthDriver::KeyOff(int part, int note) {
+    stats_.AddEvent();
+    if (!IsPrepared()) return;
+    TRACE_SCOPE("SynthDriver::KeyOff", note);
+    if (IsDrumNote(part, note)) {
+        drumState_ &= ~drumMap_.NoteToKeyBit(note);
+        DrumMap::SendKeyState(opll_[0], drumState_);
+        return;
+    }
+    for (int i = 0; i < chips_ * kChannels; i++) {
         ChannelInfo& info = channels_[i];
-        if (info.active_ && info.note_ == note) {
-            OPLLC::SendKeyOff(opll_, parameters_, i, program_, note, wheel_);
+        if (info.active_ && info.part_ == part && info.note_ == note) {
+            OPLLC::SendKeyOff(opll_[i / kChannels], i % kChannels, info.blockAndFNumber_);
             info.active_ = false;
             break;
         }
     }
 }
 
+void SynthDriver::KeyOffPart(int part) {
+    if (part == kDrumPart) KeyOffDrums();
+    for (int i = 0; i < chips_ * kChannels; i++) {
+        ChannelInfo& info = channels_[i];
+        if (info.active_ && info.part_ == part) {
+            OPLLC::SendKeyOff(opll_[i / kChannels], i % kChannels, info.blockAndFNumber_);
+            info.active_ = false;
+        }
+    }
+}
+
 void SynthDriver::KeyOffAll() {
-    for (int i = 0; i < kChannels; i++) {
+    KeyOffDrums();
+    for (int i = 0; i < chips_ * kChannels; i++) {
         ChannelInfo& info = channels_[i];
         if (info.active_) {
-            OPLLC::SendKeyOff(opll_, parameters_, i, program_, info.note_, wheel_);
+            OPLLC::SendKeyOff(opll_[i / kChannels], i % kChannels, info.blockAndFNumber_);
             info.active_ = false;
         }
     }
 }
 
+void SynthDriver::Panic() {
+    // Silence the chips at once instead of waiting for the release.
+    drumState_ = 0;
+    for (int i = 0; i < chips_ * kChannels; i++) channels_[i].active_ = false;
+    if (IsPrepared()) {
+        for (int i = 0; i < chips_; i++) OPLL_panic(opll_[i]);
+    }
+}
+
 #pragma mark
 #pragma mark Modifiers
 
-void SynthDriver::SetPitchWheel(float value) {
-    wheel_ = value;
-    for (int i = 0; i < kChannels; i++) {
-        ChannelInfo& info = channels_[i];
-        OPLLC::AdjustPitch(opll_, parameters_, i, info.note_, wheel_, info.active_);
-    }
+void SynthDriver::SetPitchWheel(int part, float value) {
+    stats_.AddEvent();
+    // Applied on the next control tick.
+    wheelTargets_[part] = value;
 }
 
 #pragma mark
 #pragma mark Parameters
 
 void SynthDriver::SetParameter(ParameterID id, float value) {
+    TRACE_SCOPE("SynthDriver::SetParameter", id);
+    stats_.AddEvent();
     parameters_[id] = value;
-    switch (id) {
-        case kParameterAR0:
-        case kParameterDR0:
-            OPLLC::SendARDR(opll_, parameters_, 0);
-            break;
-        case kParameterAR1:
-        case kParameterDR1:
-            OPLLC::SendARDR(opll_, parameters_, 1);
-            break;
-        case kParameterSL0:
-        case kParameterRR0:
-            OPLLC::SendSLRR(opll_, parameters_, 0);
-            break;
-        case kParameterSL1:
-        case kParameterRR1:
-            OPLLC::SendSLRR(opll_, parameters_, 1);
-            break;
-        case kParameterMUL0:
-        case kParameterVIB0:
-        case kParameterAM0:
-            OPLLC::SendMUL(opll_, parameters_, 0);
-            break;
-        case kParameterMUL1:
-        case kParameterVIB1:
-        case kParameterAM1:
-            OPLLC::SendMUL(opll_, parameters_, 1);
-            break;
-        case kParameterFB:
-        case kParameterDM:
-        case kParameterDC:
-            OPLLC::SendFB(opll_, parameters_);
-            break;
-        case kParameterTL:
-            OPLLC::SendTL(opll_, parameters_);
-            break;
-        case kParameterWheelRange:
-        case kParameterFineTune:
-            SetPitchWheel(wheel_);
-        case kParameters:
-            break;
+    if (id == kParameterCullLevel) {
+        if (IsPrepared()) {
+            for (int i = 0; i < chips_; i++) OPLL_set_cull_level(opll_[i], OPLLC::CullLevel(parameters_));
+        }
+    } else if (id >= kParameterWheelRange) {
+        pitchDirty_ = true;
+    } else if (IsPrepared()) {
+        for (int i = 0; i < chips_; i++) OPLLC::SendParameter(opll_[i], parameters_, patchBits_, id);
     }
 }
 
@@ -251,7 +471,7 @@ float SynthDriver::GetParameter(ParameterID id) {
     return parameters_[id];
 }
 
-SynthDriver::String SynthDriver::GetParameterName(ParameterID id) {
+void SynthDriver::GetParameterName(ParameterID id, char* text, int size) {
     static const char* names[kParameters] = {
         "AR 0",
         "AR 1",
@@ -272,12 +492,19 @@ SynthDriver::String SynthDriver::GetParameterName(ParameterID id) {
         "VIB0",
         "VIB1",
         "P.Wheel",
-        "FineTune"
+        "FineTune",
+        "Glide",
+        "Vib.Dep",
+        "Vib.Rate",
+        "Vib.Dly",
+        "W.Smooth",
+        "Cull"
     };
-    return names[id];
+    CopyText(text, size, names[id]);
 }
 
-SynthDriver::String SynthDriver::GetParameterLabel(ParameterID id) {
+void SynthDriver::GetParameterLabel(ParameterID id, char* text, int size) {
+    const char* label = "";
     switch (id) {
         case kParameterAR0:
         case kParameterAR1:
@@ -285,21 +512,36 @@ SynthDriver::String SynthDriver::GetParameterLabel(ParameterID id) {
         case kParameterDR1:
         case kParameterRR0:
         case kParameterRR1:
-            return "msec";
+        case kParameterGlide:
+        case kParameterVibratoDelay:
+        case kParameterWheelSmoothing:
+            label = "msec";
+            break;
+        case kParameterVibratoDepth:
+            label = "cent";
+            break;
+        case kParameterVibratoRate:
+            label = "Hz";
+            break;
         case kParameterSL0:
         case kParameterSL1:
         case kParameterTL:
-            return "db";
+        case kParameterCullLevel:
+            label = "db";
+            break;
         case kParameterWheelRange:
-            return "st";
+            label = "st";
+            break;
         case kParameterFineTune:
-            return "cent";
+            label = "cent";
+            break;
         default:
-            return "";
+            break;
     }
+    CopyText(text, size, label);
 }
 
-SynthDriver::String SynthDriver::GetParameterText(ParameterID id) {
+void SynthDriver::GetParameterText(ParameterID id, char* text, int size) {
     // Attack rates
     if (id == kParameterAR0 || id == kParameterAR1) {
         static const char* texts[16] = {
@@ -308,7 +550,8 @@ SynthDriver::String SynthDriver::GetParameterText(ParameterID id) {
             "27.03", "54.87", "108.13", "216.27",
             "432.54", "865.88", "1730.15", "inf"
         };
-        return texts[static_cast<int>(parameters_[id] * 15)];
+        CopyText(text, size, texts[static_cast<int>(parameters_[id] * 15)]);
+        return;
     }
     // Decay-like rates
     if (id == kParameterDR0 || id == kParameterDR1 || id == kParameterRR0 || id == kParameterRR1) {
@@ -318,13 +561,13 @@ SynthDriver::String SynthDriver::GetParameterText(ParameterID id) {
             "326.98", "653.95", "1307.91", "2615.82",
             "5231.64", "10463.30", "20926.60", "inf"
         };
-        return texts[static_cast<int>(parameters_[id] * 15)];
+        CopyText(text, size, texts[static_cast<int>(parameters_[id] * 15)]);
+        return;
     }
     // Levels
     if (id == kParameterSL0 || id == kParameterSL1 || id == kParameterTL) {
-        char buffer[32];
-        snprintf(buffer, sizeof buffer, "%d", static_cast<int>((1.0f - parameters_[id]) * 45));
-        return buffer;
+        FormatText(text, size, "%d", static_cast<int>((1.0f - parameters_[id]) * 45));
+        return;
     }
     // Multipliers
     if (id == kParameterMUL0 || id == kParameterMUL1) {
@@ -334,46 +577,415 @@ SynthDriver::String SynthDriver::GetParameterText(ParameterID id) {
             "8", "9", "10", "10",
             "12", "12", "15", "15"
         };
-        return texts[static_cast<int>(parameters_[id] * 15)];
+        CopyText(text, size, texts[static_cast<int>(parameters_[id] * 15)]);
+        return;
     }
     // Feedback
     if (id == kParameterFB) {
         static const char* texts[8] = {
             "0", "n/16", "n/8", "n/4", "n/2", "n", "2n", "4n"
         };
-        return texts[static_cast<int>(parameters_[id] * 7)];
+        CopyText(text, size, texts[static_cast<int>(parameters_[id] * 7)]);
+        return;
     }
     // Wheel range
     if (id == kParameterWheelRange) {
-        char buffer[32];
-        snprintf(buffer, sizeof buffer, "%d", static_cast<int>(parameters_[id] * 12));
-        return buffer;
+        FormatText(text, size, "%d", static_cast<int>(parameters_[id] * 12));
+        return;
     }
     // Fine tune
     if (id == kParameterFineTune) {
-        char buffer[32];
-        snprintf(buffer, sizeof buffer, "%.2f", (parameters_[id] - 0.5f) * 100);
-        return buffer;
+        FormatText(text, size, "%.2f", (parameters_[id] - 0.5f) * 100);
+        return;
+    }
+    // Modulation times
+    if (id == kParameterGlide || id == kParameterVibratoDelay || id == kParameterWheelSmoothing) {
+        float time = (id == kParameterGlide) ? Modulation::GlideTime(parameters_) :
+                     (id == kParameterVibratoDelay) ? Modulation::VibratoDelay(parameters_) :
+                     Modulation::WheelSmoothingTime(parameters_);
+        FormatText(text, size, "%d", static_cast<int>(time * 1000));
+        return;
+    }
+    // Vibrato depth
+    if (id == kParameterVibratoDepth) {
+        FormatText(text, size, "%d", static_cast<int>(Modulation::VibratoDepth(parameters_) * 100));
+        return;
+    }
+    // Vibrato rate
+    if (id == kParameterVibratoRate) {
+        FormatText(text, size, "%.2f", Modulation::VibratoRate(parameters_));
+        return;
+    }
+    // Culling level
+    if (id == kParameterCullLevel) {
+        int level = OPLLC::CullLevel(parameters_);
+        if (level == 0) {
+            CopyText(text, size, "off");
+            return;
+        }
+        FormatText(text, size, "-%d", level);
+        return;
     }
     // Switches
-    return parameters_[id] < 0.5f ? "off" : "on";
+    CopyText(text, size, parameters_[id] < 0.5f ? "off" : "on");
+}
+
+#pragma mark
+#pragma mark User patch
+
+void SynthDriver::SetUserPatch(const unsigned char* dump) {
+    OPLLC::ParsePatchDump(dump, parameters_, patchBits_);
+    // Write the dump directly to the registers.
+    if (!IsPrepared()) return;
+    TRACE_SCOPE("patch upload", 8 * chips_);
+    for (int i = 0; i < chips_; i++) {
+        for (int reg = 0; reg < 8; reg++) OPLL_writeReg(opll_[i], reg, dump[reg]);
+    }
+}
+
+void SynthDriver::GetUserPatch(unsigned char* dump) {
+    for (int reg = 0; reg < 8; reg++) {
+        dump[reg] = OPLLC::CalculatePatchRegister(parameters_, patchBits_, reg);
+    }
+}
+
+bool SynthDriver::SelectLibraryPatch(int index) {
+    if (!library_ || !library_->IsOpen() || index < 0 || index >= library_->GetCount()) return false;
+    SetUserPatch(library_->GetEntry(index).dump);
+    return true;
+}
+
+#pragma mark
+#pragma mark State chunk
+
+int SynthDriver::SaveState(unsigned char* data) {
+    unsigned char* p = data;
+    std::memcpy(p, kStateMagic, 4);
+    p += 4;
+    p = StateChunk::WriteByte(p, kStateVersion);
+    p = StateChunk::WriteByte(p, kParameters);
+    for (int i = 0; i < kParameters; i++) p = StateChunk::WriteFloat(p, parameters_[i]);
+    for (int i = 0; i < kParts; i++) p = StateChunk::WriteByte(p, programs_[i]);
+    p = StateChunk::WriteByte(p, chips_);
+    p = StateChunk::WriteFloat(p, controlRate_);
+    for (int i = 0; i < 4; i++) p = StateChunk::WriteByte(p, patchBits_[i]);
+    return static_cast<int>(p - data);
+}
+
+int SynthDriver::GetStateSize(const unsigned char* data, int size) {
+    if (size < 6 || std::memcmp(data, kStateMagic, 4) != 0) return 0;
+    int version = data[4];
+    int count = data[5];
+    // Version 2 added the patch bits.
+    int stateSize = 6 + count * 4 + kParts + 1 + 4 + (version >= 2 ? 4 : 0);
+    if (version > kStateVersion || size < stateSize) return 0;
+    return stateSize;
+}
+
+int SynthDriver::LoadState(const unsigned char* data, int size) {
+    if (GetStateSize(data, size) == 0) return 0;
+    TRACE_SCOPE("SynthDriver::LoadState", size);
+    
+    const unsigned char* p = data + 4;
+    int version, count;
+    p = StateChunk::ReadByte(p, version);
+    p = StateChunk::ReadByte(p, count);
+    int patchBitsSize = version >= 2 ? 4 : 0;
+    
+    // Parameters unknown to this version are skipped.
+    for (int i = 0; i < count; i++) {
+        float value;
+        p = StateChunk::ReadFloat(p, value);
+        if (i < kParameters) parameters_[i] = Clamp(value, 0.0f, 1.0f);
+    }
+    for (int i = 0; i < kParts; i++) {
+        int program;
+        p = StateChunk::ReadByte(p, program);
+        programs_[i] = static_cast<ProgramID>(Clamp(program, 0, kPrograms - 1));
+    }
+    int chips;
+    float controlRate;
+    p = StateChunk::ReadByte(p, chips);
+    p = StateChunk::ReadFloat(p, controlRate);
+    if (patchBitsSize > 0) {
+        for (int i = 0; i < 4; i++) {
+            int bits;
+            p = StateChunk::ReadByte(p, bits);
+            patchBits_[i] = bits & (i < 2 ? 0x30 : 0xc0);
+        }
+    } else {
+        patchBits_[0] = patchBits_[1] = 0x20;
+        patchBits_[2] = patchBits_[3] = 0;
+    }
+    
+    // Upload the whole patch to the chips at once.
+    SetChipCount(chips);
+    Panic();
+    if (IsPrepared()) {
+        for (int i = 0; i < chips_; i++) ApplyParameters(opll_[i]);
+    }
+    SetControlRate(controlRate);
+    pitchDirty_ = true;
+    
+    return static_cast<int>(p - data);
 }
 
 #pragma mark
 #pragma mark Output processing
 
-float SynthDriver::Step() {
-    return (4.0f / 32767) * OPLL_calc(opll_);
+void SynthDriver::Render(float* buffer, int length) {
+    BeginBlock();
+    RenderSegment(buffer, length);
+    EndBlock();
+}
+
+void SynthDriver::Render(double* buffer, int length) {
+    BeginBlock();
+    RenderSegment(buffer, length);
+    EndBlock();
+}
+
+void SynthDriver::BeginBlock() {
+    governor_.BeginBlock();
+    stats_.BeginBlock();
+    blockLength_ = 0;
+}
+
+void SynthDriver::RenderSegment(float* buffer, int length) {
+    TRACE_SCOPE("SynthDriver::Render", length);
+    blockLength_ += length;
+    while (length > 0) {
+        int count = length < kRenderBlock ? length : kRenderBlock;
+        RenderRaw(renderBuffer_, count);
+        SampleFormat::Int32ToFloat(renderBuffer_, buffer, count, kOutputGain);
+        buffer += count;
+        length -= count;
+    }
+}
+
+void SynthDriver::RenderSegment(double* buffer, int length) {
+    TRACE_SCOPE("SynthDriver::Render", length);
+    blockLength_ += length;
+    while (length > 0) {
+        int count = length < kRenderBlock ? length : kRenderBlock;
+        RenderRaw(renderBuffer_, count);
+        SampleFormat::Int32ToDouble(renderBuffer_, buffer, count, kOutputGain);
+        buffer += count;
+        length -= count;
+    }
+}
+
+void SynthDriver::EndBlock() {
+    UpdateQualityTier(blockLength_);
+    UpdateStats(blockLength_);
+}
+
+void SynthDriver::RenderRaw(int* buffer, int length) {
+    if (!IsPrepared()) {
+        for (int i = 0; i < length; i++) buffer[i] = 0;
+        return;
+    }
+    // Split the block at the control ticks.
+    while (length > 0) {
+        if (controlCounter_ == 0) {
+            UpdateModulation();
+            controlCounter_ = controlInterval_;
+        }
+        int count = controlCounter_ < length ? controlCounter_ : length;
+        RenderChips(buffer, count);
+        declicker_.Process(buffer, count);
+        controlCounter_ -= count;
+        buffer += count;
+        length -= count;
+    }
+}
+
+void SynthDriver::SetQualityTier(QualityGovernor::Tier tier) {
+    governor_.SetTier(tier);
+    if (tier == tier_) return;
+    TRACE_INSTANT("quality tier", tier);
+    tier_ = tier;
+    if (IsPrepared()) {
+        for (int i = 0; i < chips_; i++) ApplyQualityTier(opll_[i]);
+        declicker_.Trigger();
+    }
 }
 
 #pragma mark
 #pragma mark Internal functions
 
+void SynthDriver::SetUpChip(OPLL* opll) {
+    ApplyQualityTier(opll);
+    ApplyParameters(opll);
+}
+
+// Sends all the parameters the chip keeps (the patch and the cull level).
+void SynthDriver::ApplyParameters(OPLL* opll) {
+    OPLL_set_cull_level(opll, OPLLC::CullLevel(parameters_));
+    UploadPatch(opll);
+}
+
+void SynthDriver::UploadPatch(OPLL* opll) {
+    TRACE_SCOPE("patch upload", 8);
+    for (int reg = 0; reg < 8; reg++) {
+        OPLL_writeReg(opll, reg, OPLLC::CalculatePatchRegister(parameters_, patchBits_, reg));
+    }
+}
+
+void SynthDriver::ApplyQualityTier(OPLL* opll) {
+    OPLL_set_quality(opll, tier_ == QualityGovernor::kTierHigh ? 1 : 0);
+    OPLL_set_rate(opll, tier_ == QualityGovernor::kTierReduced ? sampleRate_ / 2 : sampleRate_);
+}
+
+void SynthDriver::UpdateQualityTier(int length) {
+    governor_.EndBlock(length, sampleRate_);
+    if (governor_.IsEnabled() && governor_.GetTier() != tier_) SetQualityTier(governor_.GetTier());
+}
+
+void SynthDriver::UpdateStats(int length) {
+    int voices = 0;
+    unsigned int writes = 0;
+    if (IsPrepared()) {
+        for (int i = 0; i < chips_; i++) {
+            voices += RenderStats::CountVoices(OPLL_getSoundingMask(opll_[i]));
+            writes += OPLL_getWriteCount(opll_[i]);
+        }
+    }
+    stats_.EndBlock(length, sampleRate_, voices, writes);
+}
+
+float SynthDriver::CalculatePitch(const ChannelInfo& info) {
+    int range = parameters_[kParameterWheelRange] * 12;
+    float tune = parameters_[kParameterFineTune] - 0.5f;
+    float pitch = info.pitch_ + wheels_[info.part_] * range + tune;
+    // Delayed vibrato
+    float vibratoTime = info.vibratoTime_ - Modulation::VibratoDelay(parameters_);
+    if (vibratoTime > 0) {
+        float phase = 2 * Modulation::kPi * Modulation::VibratoRate(parameters_) * vibratoTime;
+        pitch += Modulation::VibratoDepth(parameters_) * sinf(phase);
+    }
+    return pitch;
+}
+
+void SynthDriver::UpdateModulation() {
+    TRACE_SCOPE("modulation", controlInterval_);
+    float interval = 1.0f / controlRate_;
+    
+    // Smooth the pitch wheels.
+    float wheelCoeff = Modulation::ApproachCoefficient(Modulation::WheelSmoothingTime(parameters_), interval);
+    bool wheelMoved[kParts];
+    for (int i = 0; i < kParts; i++) {
+        float prev = wheels_[i];
+        wheels_[i] += (wheelTargets_[i] - wheels_[i]) * wheelCoeff;
+        if (fabsf(wheelTargets_[i] - wheels_[i]) < 1.0e-4f) wheels_[i] = wheelTargets_[i];
+        wheelMoved[i] = (wheels_[i] != prev);
+    }
+    
+    float glideCoeff = Modulation::ApproachCoefficient(Modulation::GlideTime(parameters_), interval);
+    bool vibrato = Modulation::VibratoDepth(parameters_) > 0;
+    
+    for (int i = 0; i < chips_ * kChannels; i++) {
+        if (!IsMelodicChannel(i)) continue;
+        ChannelInfo& info = channels_[i];
+        // Released channels only follow the wheel and the tuning.
+        bool update = pitchDirty_ || wheelMoved[info.part_];
+        if (info.active_) {
+            if (info.pitch_ != info.note_) {
+                info.pitch_ += (info.note_ - info.pitch_) * glideCoeff;
+                if (fabsf(info.note_ - info.pitch_) < 1.0e-3f) info.pitch_ = info.note_;
+                update = true;
+            }
+            info.vibratoTime_ += interval;
+            update |= vibrato;
+        }
+        if (!update) continue;
+        // Coalesce into one register update per tick.
+        int bf = OPLLC::CalculateBlockAndFNumber(CalculatePitch(info));
+        if (bf != info.blockAndFNumber_) {
+            OPLLC::AdjustPitch(opll_[i / kChannels], i % kChannels, info.blockAndFNumber_, bf, info.active_);
+            info.blockAndFNumber_ = bf;
+        }
+    }
+    
+    pitchDirty_ = false;
+}
+
+void SynthDriver::RenderChips(int* buffer, int length) {
+    while (length > 0) {
+        int count = length < kRenderBlock ? length : kRenderBlock;
+        if (tier_ == QualityGovernor::kTierReduced) {
+            TRACE_SCOPE("half rate", count);
+            // Clock the chips every other sample and interpolate between.
+            CalculateChips(halfBuffer_, (count + 1 - halfPhase_) / 2);
+            const int* next = halfBuffer_;
+            for (int i = 0; i < count; i++) {
+                halfPhase_ ^= 1;
+                if (halfPhase_) {
+                    halfPrev_ = halfNext_;
+                    halfNext_ = *next++;
+                    buffer[i] = (halfPrev_ + halfNext_) >> 1;
+                } else {
+                    buffer[i] = halfNext_;
+                }
+            }
+        } else {
+            CalculateChips(buffer, count);
+        }
+        buffer += count;
+        length -= count;
+    }
+}
+
+void SynthDriver::CalculateChips(int* buffer, int length) {
+    OPLL_calc_block(opll_[0], buffer, length);
+    for (int chip = 1; chip < chips_; chip++) {
+        OPLL_calc_block(opll_[chip], chipBuffer_, length);
+        SampleFormat::Accumulate(chipBuffer_, buffer, length);
+    }
+}
+
 int SynthDriver::ChooseChannelIndex() {
+    // Prefer the silent channels to the ones still in the release tail,
+    // and steal a held note only when all the channels are held.
+    unsigned int sounding[kMaxChips];
+    for (int chip = 0; chip < chips_; chip++) sounding[chip] = OPLL_getSoundingMask(opll_[chip]);
+    int voices = chips_ * kChannels;
     int index = lastChannel_;
-    for (int offs = 0; offs < kChannels - 1; offs++) {
-        if (++index == kChannels) index = 0;
-        if (!channels_[index].active_) return index;
+    int choice = -1, choiceRank = 4;
+    for (int offs = 0; offs < voices; offs++) {
+        if (++index == voices) index = 0;
+        if (!IsMelodicChannel(index)) continue;
+        bool silent = (sounding[index / kChannels] & OPLL_MASK_CH(index % kChannels)) == 0;
+        int rank = (channels_[index].active_ ? 2 : 0) + (silent ? 0 : 1);
+        if (rank < choiceRank) {
+            choice = index;
+            choiceRank = rank;
+            if (rank == 0) break;
+        }
+    }
+    return choice;
+}
+
+void SynthDriver::SendRhythmMode() {
+    if (rhythmMode_) {
+        // Take over the channels 6-8 of the first chip.
+        DrumMap::ResetRhythmMode(opll_[0]);
+        for (int i = 0; i < DrumMap::kVolumes; i += 2) DrumMap::SendVolume(opll_[0], drumVolumes_, i);
+    } else {
+        OPLL_writeReg(opll_[0], 0x0e, 0);
     }
-    return lastChannel_ + 1;
+}
+
+bool SynthDriver::IsMelodicChannel(int index) {
+    return !rhythmMode_ || index < kRhythmModeChannels || index >= kChannels;
+}
+
+bool SynthDriver::IsDrumNote(int part, int note) {
+    return rhythmMode_ && (part == kDrumPart || (note >= drumKeyLow_ && note <= drumKeyHigh_));
+}
+
+void SynthDriver::KeyOffDrums() {
+    if (drumState_ == 0) return;
+    drumState_ = 0;
+    DrumMap::SendKeyState(opll_[0], drumState_);
 }
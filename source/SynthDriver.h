@@ -1,17 +1,29 @@
 #ifndef __SynthDriver__
 #define __SynthDriver__
 
+#include "DrumMap.h"
+#include "QualityGovernor.h"
+#include "RenderStats.h"
 #include <string>
 
 extern "C" {
     struct __OPLL;
 }
 
+class PatchLibrary;
+
 class SynthDriver {
 public:
     typedef std::string String;
     
     static const int kChannels = 9;
+    static const int kMaxChips = 4;
+    static const int kParts = 16;
+    
+    // In the rhythm mode the first chip has 6 melodic channels and the drums.
+    static const int kRhythmModeChannels = 6;
+    // Part which plays the drums (MIDI channel 10).
+    static const int kDrumPart = 9;
     
     enum ProgramID {
         kProgramUser,
@@ -40,50 +52,186 @@ public:
         kParameterVIB1,
         kParameterWheelRange,
         kParameterFineTune,
+        kParameterGlide,
+        kParameterVibratoDepth,
+        kParameterVibratoRate,
+        kParameterVibratoDelay,
+        kParameterWheelSmoothing,
+        kParameterCullLevel,
         kParameters
     };
     
     SynthDriver(unsigned int sampleRate);
     ~SynthDriver();
     
+    // Creates the chips. The constructor doesn't touch the emulator, so
+    // this (or the first SetSampleRate) has to be called before playing.
+    void Prepare();
+    bool IsPrepared() { return opll_[0] != 0; }
+    
     void SetSampleRate(unsigned int sampleRate);
     
-    void SetProgram(ProgramID id) { program_ = id; }
-    ProgramID GetProgram() { return program_; }
-    String GetProgramName(ProgramID id);
+    // Pitch modulation (glide, vibrato and wheel smoothing) is updated
+    // at the control rate, not on every incoming MIDI message.
+    void SetControlRate(float rate);
+    float GetControlRate() { return controlRate_; }
+    
+    // Multi-chip expansion: voices are allocated across the active chips.
+    void SetChipCount(int count);
+    int GetChipCount() { return chips_; }
+    // Upper limit of the chip count (kMaxChips by default). Prepare creates
+    // this many chips, so that switching the count doesn't allocate; a
+    // single-chip user sets 1 before Prepare.
+    void SetMaxChipCount(int count);
+    
+    // Rhythm mode: the drum part and the notes in the drum key range
+    // (disabled when low > high) play the rhythm section of the first chip.
+    void SetRhythmMode(bool enable);
+    bool GetRhythmMode() { return rhythmMode_; }
+    void SetDrumKeyRange(int low, int high) { drumKeyLow_ = low; drumKeyHigh_ = high; }
+    DrumMap& GetDrumMap() { return drumMap_; }
     
-    void KeyOn(int note, float velocity);
-    void KeyOff(int note);
+    // SetProgram changes the program of all the parts.
+    void SetProgram(ProgramID id);
+    ProgramID GetProgram() { return programs_[0]; }
+    void SetPartProgram(int part, ProgramID id) { programs_[part] = id; }
+    ProgramID GetPartProgram(int part) { return programs_[part]; }
+    void GetProgramName(ProgramID id, char* text, int size);
+    
+    void KeyOn(int note, float velocity) { KeyOn(0, note, velocity); }
+    void KeyOn(int part, int note, float velocity);
+    void KeyOff(int note) { KeyOff(0, note); }
+    void KeyOff(int part, int note);
+    void KeyOffPart(int part);
     void KeyOffAll();
+    // Cuts all the sounds without the release.
+    void Panic();
     
-    void SetPitchWheel(float value);
+    void SetPitchWheel(float value) { SetPitchWheel(0, value); }
+    void SetPitchWheel(int part, float value);
     
     void SetParameter(ParameterID id, float value);
     float GetParameter(ParameterID id);
-    String GetParameterName(ParameterID id);
-    String GetParameterLabel(ParameterID id);
-    String GetParameterText(ParameterID id);
+    // The text getters fill a buffer of the given size (including the
+    // terminator) without allocating, as some hosts call them from the
+    // audio thread.
+    void GetParameterName(ParameterID id, char* text, int size);
+    void GetParameterLabel(ParameterID id, char* text, int size);
+    void GetParameterText(ParameterID id, char* text, int size);
+    
+    // User patch as the 8-byte register dump (0x00-0x07).
+    void SetUserPatch(const unsigned char* dump);
+    void GetUserPatch(unsigned char* dump);
+    
+    // The library is not owned by the driver and must outlive it.
+    void SetPatchLibrary(const PatchLibrary* library) { library_ = library; }
+    const PatchLibrary* GetPatchLibrary() { return library_; }
+    // Switches the user patch to the library entry.
+    bool SelectLibraryPatch(int index);
+    
+    // Binary state chunk: parameters, part programs and options.
+    static const int kStateVersion = 2;
+    static const int kMaxStateSize = 6 + kParameters * 4 + kParts + 1 + 4 + 4;
+    
+    // Returns the number of bytes written.
+    int SaveState(unsigned char* data);
+    // Returns the number of bytes read, or zero when the data is invalid.
+    int LoadState(const unsigned char* data, int size);
+    // Size of the state at the data without loading it, or zero when the
+    // data is invalid.
+    static int GetStateSize(const unsigned char* data, int size);
     
-    float Step();
+    // Renders all the chips into the buffer in one pass.
+    void Render(float* buffer, int length);
+    void Render(double* buffer, int length);
+    // A host block rendered in segments (split at its events): the governor
+    // and the statistics measure the whole block, not each segment.
+    void BeginBlock();
+    void RenderSegment(float* buffer, int length);
+    void RenderSegment(double* buffer, int length);
+    void EndBlock();
+    // Raw output: sum of the chip outputs (16-bit range per chip).
+    void RenderRaw(int* buffer, int length);
+    
+    // Quality tier of the chips. While the governor is enabled it picks
+    // the tier from the render time of each block.
+    void SetQualityTier(QualityGovernor::Tier tier);
+    QualityGovernor::Tier GetQualityTier() { return tier_; }
+    QualityGovernor& GetGovernor() { return governor_; }
+    
+    // Statistics of the rendered blocks.
+    RenderStats& GetStats() { return stats_; }
     
 private:
     struct ChannelInfo {
         bool active_;
+        int part_;
         int note_;
         int velocity_;
-        ChannelInfo() : active_(false) {}
+        float pitch_;           // current pitch without modulation (gliding)
+        float vibratoTime_;     // time elapsed since key on (sec)
+        int blockAndFNumber_;   // last value sent to the registers
+        ChannelInfo() : active_(false), part_(0), note_(0), pitch_(0), vibratoTime_(0), blockAndFNumber_(0) {}
     };
     
-    struct __OPLL* opll_;
-
-    ProgramID program_;
+    struct __OPLL* opll_[kMaxChips];
+    int chips_;
+    int maxChips_;
+    unsigned int sampleRate_;
+    
+    ProgramID programs_[kParts];
     float parameters_[kParameters];
+    unsigned char patchBits_[4];    // EG/KR/KL bits not covered by the parameters
+    const PatchLibrary* library_;
     
-    ChannelInfo channels_[kChannels];
+    ChannelInfo channels_[kMaxChips * kChannels];
     int lastChannel_;
-    float wheel_;
     
+    bool rhythmMode_;
+    DrumMap drumMap_;
+    int drumKeyLow_;
+    int drumKeyHigh_;
+    int drumState_;
+    float drumVolumes_[DrumMap::kVolumes];
+    
+    float wheelTargets_[kParts];
+    float wheels_[kParts];
+    float lastPitches_[kParts];
+    bool pitchDirty_;
+    
+    float controlRate_;
+    int controlInterval_;
+    int controlCounter_;
+    
+    static const int kRenderBlock = 256;
+    int renderBuffer_[kRenderBlock];
+    int chipBuffer_[kRenderBlock];
+    int halfBuffer_[kRenderBlock];
+    
+    QualityGovernor governor_;
+    QualityGovernor::Tier tier_;
+    RenderStats stats_;
+    Declicker declicker_;
+    int halfPhase_;         // upsampler state in the reduced tier
+    int halfPrev_;
+    int halfNext_;
+    int blockLength_;       // samples rendered in the current block
+    
+    void SetUpChip(struct __OPLL* opll);
+    void ApplyParameters(struct __OPLL* opll);
+    void UploadPatch(struct __OPLL* opll);
+    void ApplyQualityTier(struct __OPLL* opll);
+    void UpdateQualityTier(int length);
+    void UpdateStats(int length);
+    float CalculatePitch(const ChannelInfo& info);
+    void UpdateModulation();
+    void RenderChips(int* buffer, int length);
+    void CalculateChips(int* buffer, int length);
     int ChooseChannelIndex();
+    void SendRhythmMode();
+    bool IsMelodicChannel(int index);
+    bool IsDrumNote(int part, int note);
+    void KeyOffDrums();
 };
 
 #endif
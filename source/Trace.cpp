@@ -0,0 +1,185 @@
+#include "Trace.h"
+#include "QualityGovernor.h"
+#include <cstdio>
+#include <cstdlib>
+
+#ifdef _WIN32
+#include <windows.h>
+#define TRACE_THREAD_LOCAL __declspec(thread)
+#else
+#define TRACE_THREAD_LOCAL __thread
+#endif
+
+namespace {
+    // Events per thread.
+    const unsigned int kCapacity = 1 << 17;
+    
+    struct Event {
+        const char* name_;
+        double time_;
+        int value_;
+        char phase_;        // B, E, i or C
+    };
+    
+    // Written by its thread only; the count is published with release
+    // ordering for the writer of the file.
+    struct Buffer {
+        Buffer* next_;
+        int id_;
+        const char* threadName_;
+        volatile unsigned int count_;
+        volatile unsigned int dropped_;
+        Event events_[kCapacity];
+    };
+    
+    Buffer* volatile buffers = 0;
+    volatile int threadCount = 0;
+    TRACE_THREAD_LOCAL Buffer* threadBuffer = 0;
+    
+    // Times are relative to the first use.
+    double startTime = QualityGovernor::GetTime();
+
+#ifdef _WIN32
+    inline unsigned int LoadAcquire(const volatile unsigned int& value) {
+        unsigned int result = value;
+        MemoryBarrier();
+        return result;
+    }
+    
+    inline void StoreRelease(volatile unsigned int& target, unsigned int value) {
+        MemoryBarrier();
+        target = value;
+    }
+    
+    inline Buffer* LoadBuffers() {
+        Buffer* result = buffers;
+        MemoryBarrier();
+        return result;
+    }
+    
+    void PushBuffer(Buffer* buffer) {
+        buffer->id_ = InterlockedIncrement(reinterpret_cast<volatile LONG*>(&threadCount));
+        do {
+            buffer->next_ = buffers;
+        } while (InterlockedCompareExchangePointer(reinterpret_cast<void* volatile*>(&buffers), buffer, buffer->next_) != buffer->next_);
+    }
+#else
+    inline unsigned int LoadAcquire(const volatile unsigned int& value) {
+        return __atomic_load_n(&value, __ATOMIC_ACQUIRE);
+    }
+    
+    inline void StoreRelease(volatile unsigned int& target, unsigned int value) {
+        __atomic_store_n(&target, value, __ATOMIC_RELEASE);
+    }
+    
+    inline Buffer* LoadBuffers() {
+        return __atomic_load_n(&buffers, __ATOMIC_ACQUIRE);
+    }
+    
+    void PushBuffer(Buffer* buffer) {
+        buffer->id_ = __atomic_add_fetch(&threadCount, 1, __ATOMIC_RELAXED);
+        buffer->next_ = __atomic_load_n(&buffers, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&buffers, &buffer->next_, buffer, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {}
+    }
+#endif
+    
+    Buffer* GetThreadBuffer() {
+        if (!threadBuffer) {
+            Buffer* buffer = static_cast<Buffer*>(std::malloc(sizeof(Buffer)));
+            if (!buffer) return 0;
+            buffer->threadName_ = 0;
+            buffer->count_ = 0;
+            buffer->dropped_ = 0;
+            PushBuffer(buffer);
+            threadBuffer = buffer;
+        }
+        return threadBuffer;
+    }
+    
+    void Record(char phase, const char* name, int value) {
+        Buffer* buffer = GetThreadBuffer();
+        if (!buffer) return;
+        unsigned int count = buffer->count_;
+        if (count == kCapacity) {
+            buffer->dropped_++;
+            return;
+        }
+        Event& event = buffer->events_[count];
+        event.name_ = name;
+        event.time_ = QualityGovernor::GetTime();
+        event.value_ = value;
+        event.phase_ = phase;
+        StoreRelease(buffer->count_, count + 1);
+    }
+    
+    // Writes the trace on exit when VST2413_TRACE is set.
+    struct ExitWriter {
+        ~ExitWriter() {
+            const char* path = std::getenv("VST2413_TRACE");
+            if (path && *path && LoadBuffers()) Trace_write(path);
+        }
+    } exitWriter;
+}
+
+void Trace_begin(const char* name, int value) {
+    Record('B', name, value);
+}
+
+void Trace_end(const char* name) {
+    Record('E', name, 0);
+}
+
+void Trace_instant(const char* name, int value) {
+    Record('i', name, value);
+}
+
+void Trace_counter(const char* name, int value) {
+    Record('C', name, value);
+}
+
+void Trace_set_thread_name(const char* name) {
+    Buffer* buffer = GetThreadBuffer();
+    if (buffer) buffer->threadName_ = name;
+}
+
+int Trace_write(const char* path) {
+    FILE* file = std::fopen(path, "w");
+    if (!file) return 0;
+    std::fprintf(file, "{\"traceEvents\":[\n");
+    const char* separator = "";
+    for (Buffer* buffer = LoadBuffers(); buffer; buffer = buffer->next_) {
+        if (buffer->threadName_) {
+            std::fprintf(file, "%s{\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"name\":\"thread_name\",\"args\":{\"name\":\"%s\"}}",
+                         separator, buffer->id_, buffer->threadName_);
+            separator = ",\n";
+        }
+        unsigned int count = LoadAcquire(buffer->count_);
+        for (unsigned int i = 0; i < count; i++) {
+            const Event& event = buffer->events_[i];
+            double us = (event.time_ - startTime) * 1e6;
+            std::fprintf(file, "%s{\"ph\":\"%c\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"name\":\"%s\"",
+                         separator, event.phase_, buffer->id_, us, event.name_);
+            switch (event.phase_) {
+                case 'B': std::fprintf(file, ",\"args\":{\"value\":%d}}", event.value_); break;
+                case 'i': std::fprintf(file, ",\"s\":\"t\",\"args\":{\"value\":%d}}", event.value_); break;
+                case 'C': std::fprintf(file, ",\"args\":{\"%s\":%d}}", event.name_, event.value_); break;
+                default: std::fprintf(file, "}"); break;
+            }
+            separator = ",\n";
+        }
+        if (buffer->dropped_ > 0) {
+            std::fprintf(file, "%s{\"ph\":\"i\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"name\":\"dropped events\",\"s\":\"t\",\"args\":{\"value\":%u}}",
+                         separator, buffer->id_, (QualityGovernor::GetTime() - startTime) * 1e6, buffer->dropped_);
+            separator = ",\n";
+        }
+    }
+    std::fprintf(file, "\n]}\n");
+    return std::fclose(file) == 0;
+}
+
+void Trace_clear() {
+    for (Buffer* buffer = LoadBuffers(); buffer; buffer = buffer->next_) {
+        StoreRelease(buffer->count_, 0);
+        buffer->dropped_ = 0;
+    }
+}
@@ -0,0 +1,71 @@
+#ifndef __Trace__
+#define __Trace__
+
+// Timeline trace of the render path in the Chrome trace event format
+// (chrome://tracing, Perfetto).
+//
+// The trace points are compiled in when VST2413_TRACE is defined and are
+// empty otherwise. Each thread records into its own fixed-size buffer,
+// which is allocated on the first event of the thread and never locked;
+// the events past the end of the buffer are dropped. The names must be
+// string literals, as only the pointers are stored.
+//
+// The tools write the trace with --trace. Anywhere else (the plug-ins in
+// a host), the VST2413_TRACE environment variable gives a file the trace
+// is written to when the process exits.
+//
+// The interface is C, so that the trace points can go into emu2413.
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void Trace_begin (const char *name, int value);
+void Trace_end (const char *name);
+void Trace_instant (const char *name, int value);
+void Trace_counter (const char *name, int value);
+/* Names the calling thread in the trace. */
+void Trace_set_thread_name (const char *name);
+
+/* Writes the events recorded so far. Returns 0 on failure. */
+int Trace_write (const char *path);
+/* Drops the recorded events. Only while the other threads are idle. */
+void Trace_clear (void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#ifdef VST2413_TRACE
+
+#define TRACE_BEGIN(name, value) Trace_begin (name, value)
+#define TRACE_END(name) Trace_end (name)
+#define TRACE_INSTANT(name, value) Trace_instant (name, value)
+#define TRACE_COUNTER(name, value) Trace_counter (name, value)
+
+#ifdef __cplusplus
+// Begin and end of the enclosing scope.
+class TraceScope {
+public:
+    TraceScope(const char* name, int value) : name_(name) { Trace_begin(name, value); }
+    ~TraceScope() { Trace_end(name_); }
+private:
+    const char* name_;
+};
+
+#define TRACE_SCOPE_JOIN2(a, b) a##b
+#define TRACE_SCOPE_JOIN(a, b) TRACE_SCOPE_JOIN2(a, b)
+#define TRACE_SCOPE(name, value) TraceScope TRACE_SCOPE_JOIN(traceScope, __LINE__)(name, value)
+#endif
+
+#else
+
+#define TRACE_BEGIN(name, value) ((void) 0)
+#define TRACE_END(name) ((void) 0)
+#define TRACE_INSTANT(name, value) ((void) 0)
+#define TRACE_COUNTER(name, value) ((void) 0)
+#define TRACE_SCOPE(name, value) ((void) 0)
+
+#endif
+
+#endif
@@ -1,4 +1,6 @@
 #include "Vst2413p.h"
+#include "StateChunk.h"
+#include "Trace.h"
 
 namespace {
     typedef std::string String;
@@ -9,9 +11,36 @@ namespace {
         return static_cast<SynthDriver::ProgramID>(static_cast<int>(value * range + SynthDriver::kProgramFirstPreset));
     }
 
+    // Converts a MIDI program number to a SynthDriver program ID.
+    SynthDriver::ProgramID ProgramNumberToProgramID(int number) {
+        int range = SynthDriver::kPrograms - SynthDriver::kProgramFirstPreset;
+        return static_cast<SynthDriver::ProgramID>(number % range + SynthDriver::kProgramFirstPreset);
+    }
+
+    // Converts a float value to a number of chips.
+    int ValueToChipCount(float value) {
+        return static_cast<int>(value * (SynthDriver::kMaxChips - 1) + 0.5f) + 1;
+    }
+
+    // Drum modes: off, MIDI channel 10, or channel 10 plus the drum keys on any channel.
+    enum DrumMode {
+        kDrumModeOff,
+        kDrumModeChannel,
+        kDrumModeSplit
+    };
+    
+    // Converts a float value to a drum mode.
+    DrumMode ValueToDrumMode(float value) {
+        return static_cast<DrumMode>(static_cast<int>(value * kDrumModeSplit + 0.5f));
+    }
+    
+    // Drum keys in the split mode (kick to ride cymbal).
+    const int kDrumKeyLow = 36;
+    const int kDrumKeyHigh = 51;
+
     // Converts a VST parameter index to a SynthDriver parameter ID.
     SynthDriver::ParameterID IndexToParameterID(int parameterIndex) {
-        return (parameterIndex == 1) ? SynthDriver::kParameterWheelRange : SynthDriver::kParameterFineTune;
+        return (parameterIndex == Vst2413p::kParameterWheelRange) ? SynthDriver::kParameterWheelRange : SynthDriver::kParameterFineTune;
     }
 }
 
@@ -22,17 +51,28 @@ AudioEffect* createEffectInstance(audioMasterCallback audioMaster) {
 }
 
 Vst2413p::Vst2413p(audioMasterCallback audioMaster)
-:   AudioEffectX(audioMaster, 0, 3), // only 3 parameters are supported
+:   AudioEffectX(audioMaster, 0, kParameters),
     driver_(44100),
-    instrumentParameter_(0)
+    instrumentParameter_(0),
+    multitimbralParameter_(0),
+    chipsParameter_(0),
+    drumsParameter_(0),
+    renderAheadParameter_(0),
+    renderAhead_(*this),
+    capture_('p'),
+    eventQueue_(*this, renderAhead_)
 {
     if(audioMaster != NULL) {
         setNumInputs(0);
         setNumOutputs(1);
         setUniqueID(kUniqueId);
         canProcessReplacing();
+        canDoubleReplacing();
+        programsAreChunks();
         isSynth();
     }
+    // Degrade the emulation under CPU pressure instead of dropping out.
+    driver_.GetGovernor().SetEnabled(true);
     driver_.SetProgram(ValueToProgramID(instrumentParameter_));
     suspend();
 }
@@ -41,80 +81,269 @@ Vst2413p::Vst2413p(audioMasterCallback audioMaster)
 #pragma mark Processing functions
 
 VstInt32 Vst2413p::processEvents(VstEvents* events) {
+    TRACE_SCOPE("processEvents", events->numEvents);
 	for (VstInt32 i = 0; i < events->numEvents; i++) {
 		if (events->events[i]->type != kVstMidiType) continue;
 
-		const char* data = reinterpret_cast<VstMidiEvent*>(events->events[i])->midiData;
-        
-        switch (data[0] & 0xf0) {
-            // key off
-            case 0x80:
-                driver_.KeyOff(data[1] & 0x7f);
-                break;
-            // key On
-            case 0x90:
-                driver_.KeyOn(data[1] & 0x7f, 1.0f / 128 * (data[2] & 0x7f));
-                break;
-            // all keys off
-            case 0xb0:
-                if (data[1] == 0x7e || data[1] == 0x7b) driver_.KeyOffAll();
-                break;
-            // pitch wheel
-            case 0xe0: {
-                int position = ((data[2] & 0x7f) << 7) + (data[1] & 0x7f);
-                driver_.SetPitchWheel((1.0f / 0x2000) * (position - 0x2000));
-                break;
-            }
-            default:
-                break;
-        }
+		const VstMidiEvent* midi = reinterpret_cast<VstMidiEvent*>(events->events[i]);
+        capture_.Midi(midi->deltaFrames, midi->midiData);
+        eventQueue_.Queue(midi->deltaFrames, midi->midiData);
 	}
 	return 1;
 }
 
 void Vst2413p::processReplacing(float** inputs, float** outputs, VstInt32 sampleFrames) {
-    for (VstInt32 i = 0; i < sampleFrames; i++) outputs[0][i] = driver_.Step();
+    TRACE_SCOPE("processReplacing", sampleFrames);
+    capture_.Process(sampleFrames);
+    Render(outputs[0], sampleFrames);
+}
+
+void Vst2413p::processDoubleReplacing(double** inputs, double** outputs, VstInt32 sampleFrames) {
+    TRACE_SCOPE("processDoubleReplacing", sampleFrames);
+    capture_.Process(sampleFrames);
+    Render(outputs[0], sampleFrames);
+}
+
+template <typename T> void Vst2413p::Render(T* output, VstInt32 sampleFrames) {
+    bool offline = getCurrentProcessLevel() == kVstProcessLevelOffline;
+    driver_.GetGovernor().SetOffline(offline);
+    eventQueue_.Render(driver_, output, sampleFrames, offline);
+}
+
+void Vst2413p::ProcessMidi(const char* data) {
+    TRACE_SCOPE("ProcessMidi", data[0] & 0xff);
+    // Each MIDI channel drives its own part in the multitimbral mode.
+    // The drum channel is kept apart whenever the drums are enabled.
+    int channel = data[0] & 0x0f;
+    bool drums = driver_.GetRhythmMode() && channel == SynthDriver::kDrumPart;
+    int part = (IsMultitimbral() || drums) ? channel : 0;
+    
+    switch (data[0] & 0xf0) {
+        // key off
+        case 0x80:
+            driver_.KeyOff(part, data[1] & 0x7f);
+            break;
+        // key On
+        case 0x90:
+            driver_.KeyOn(part, data[1] & 0x7f, 1.0f / 128 * (data[2] & 0x7f));
+            break;
+        // all keys off
+        case 0xb0:
+            if (data[1] == 0x78) driver_.Panic();
+            if (data[1] == 0x7e || data[1] == 0x7b) driver_.KeyOffPart(part);
+            break;
+        // program change
+        case 0xc0:
+            if (IsMultitimbral()) driver_.SetPartProgram(part, ProgramNumberToProgramID(data[1] & 0x7f));
+            break;
+        // pitch wheel
+        case 0xe0: {
+            int position = ((data[2] & 0x7f) << 7) + (data[1] & 0x7f);
+            driver_.SetPitchWheel(part, (1.0f / 0x2000) * (position - 0x2000));
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+void Vst2413p::BeginBlock() {
+    driver_.BeginBlock();
+}
+
+void Vst2413p::RenderAudio(float* buffer, int length) {
+    driver_.RenderSegment(buffer, length);
+}
+
+void Vst2413p::EndBlock() {
+    driver_.EndBlock();
 }
 
 #pragma mark
 #pragma mark Parameter
 
 void Vst2413p::setParameter(VstInt32 index, float value) {
-    if (index == 0) {
-        instrumentParameter_ = value;
-        driver_.SetProgram(ValueToProgramID(value));
-    } else {
-        driver_.SetParameter(IndexToParameterID(index), value);
+    capture_.SetParameter(index, value);
+    if (index == kParameterRenderAhead) {
+        bool changed = (value >= 0.5f) != IsRenderAhead();
+        renderAheadParameter_ = value;
+        // Switched on the next resume; ask the host to restart the plug-in.
+        if (changed) ioChanged();
+        return;
+    }
+    // Applied by the worker in the render-ahead mode, which updates the
+    // values returned by getParameter then.
+    renderAhead_.SetParameter(index, value);
+}
+
+void Vst2413p::ApplyParameter(int index, float value) {
+    switch (index) {
+        case kParameterInstrument:
+            instrumentParameter_ = value;
+            driver_.SetProgram(ValueToProgramID(value));
+            break;
+        case kParameterMultitimbral:
+            multitimbralParameter_ = value;
+            driver_.KeyOffAll();
+            driver_.SetProgram(ValueToProgramID(instrumentParameter_));
+            break;
+        case kParameterChips:
+            chipsParameter_ = value;
+            driver_.SetChipCount(ValueToChipCount(value));
+            break;
+        case kParameterDrums:
+            drumsParameter_ = value;
+            ApplyDrumMode();
+            break;
+        default:
+            driver_.SetParameter(IndexToParameterID(index), value);
+            break;
     }
 }
 
 float Vst2413p::getParameter(VstInt32 index) {
-    if (index == 0) {
-        return instrumentParameter_;
-    } else {
-        return driver_.GetParameter(IndexToParameterID(index));
+    switch (index) {
+        case kParameterInstrument:
+            return instrumentParameter_;
+        case kParameterMultitimbral:
+            return multitimbralParameter_;
+        case kParameterChips:
+            return chipsParameter_;
+        case kParameterDrums:
+            return drumsParameter_;
+        case kParameterRenderAhead:
+            return renderAheadParameter_;
+        default:
+            return driver_.GetParameter(IndexToParameterID(index));
     }
 }
 
 void Vst2413p::getParameterLabel(VstInt32 index, char* text) {
-    if (index != 0) {
-        vst_strncpy(text, driver_.GetParameterLabel(IndexToParameterID(index)).c_str(), kVstMaxParamStrLen);
+    switch (index) {
+        case kParameterInstrument:
+        case kParameterMultitimbral:
+        case kParameterChips:
+        case kParameterDrums:
+        case kParameterRenderAhead:
+            vst_strncpy(text, "", kVstMaxParamStrLen);
+            break;
+        default:
+            driver_.GetParameterLabel(IndexToParameterID(index), text, kVstMaxParamStrLen + 1);
+            break;
     }
 }
 
 void Vst2413p::getParameterDisplay(VstInt32 index, char* text) {
-    if (index == 0) {
-        vst_strncpy(text, driver_.GetProgramName(ValueToProgramID(instrumentParameter_)).c_str(), kVstMaxParamStrLen);
-    } else {
-        vst_strncpy(text, driver_.GetParameterText(IndexToParameterID(index)).c_str(), kVstMaxParamStrLen);
+    switch (index) {
+        case kParameterInstrument:
+            driver_.GetProgramName(ValueToProgramID(instrumentParameter_), text, kVstMaxParamStrLen + 1);
+            break;
+        case kParameterMultitimbral:
+            vst_strncpy(text, IsMultitimbral() ? "on" : "off", kVstMaxParamStrLen);
+            break;
+        case kParameterChips:
+            int2string(ValueToChipCount(chipsParameter_), text, kVstMaxParamStrLen);
+            break;
+        case kParameterDrums: {
+            static const char* texts[] = { "off", "ch 10", "split" };
+            vst_strncpy(text, texts[ValueToDrumMode(drumsParameter_)], kVstMaxParamStrLen);
+            break;
+        }
+        case kParameterRenderAhead:
+            vst_strncpy(text, IsRenderAhead() ? "on" : "off", kVstMaxParamStrLen);
+            break;
+        default:
+            driver_.GetParameterText(IndexToParameterID(index), text, kVstMaxParamStrLen + 1);
+            break;
     }
 }
 
 void Vst2413p::getParameterName(VstInt32 index, char* text) {
-    if (index == 0) {
-        vst_strncpy(text, "Instrument", kVstMaxParamStrLen);
+    switch (index) {
+        case kParameterInstrument:
+            vst_strncpy(text, "Instrument", kVstMaxParamStrLen);
+            break;
+        case kParameterMultitimbral:
+            vst_strncpy(text, "Multi", kVstMaxParamStrLen);
+            break;
+        case kParameterChips:
+            vst_strncpy(text, "Chips", kVstMaxParamStrLen);
+            break;
+        case kParameterDrums:
+            vst_strncpy(text, "Drums", kVstMaxParamStrLen);
+            break;
+        case kParameterRenderAhead:
+            vst_strncpy(text, "Ahead", kVstMaxParamStrLen);
+            break;
+        default:
+            driver_.GetParameterName(IndexToParameterID(index), text, kVstMaxParamStrLen + 1);
+            break;
+    }
+}
+
+#pragma mark
+#pragma mark State chunk
+
+// The plug-in parameters follow the driver state in the chunk. All but
+// the render-ahead switch go through the worker in the render-ahead mode.
+
+VstInt32 Vst2413p::getChunk(void** data, bool isPreset) {
+    unsigned char* p = chunk_ + renderAhead_.SaveState(chunk_);
+    p = StateChunk::WriteFloat(p, renderAheadParameter_);
+    *data = chunk_;
+    return static_cast<VstInt32>(p - chunk_);
+}
+
+VstInt32 Vst2413p::setChunk(void* data, VstInt32 byteSize, bool isPreset) {
+    capture_.SetChunk(data, byteSize);
+    const unsigned char* p = static_cast<const unsigned char*>(data);
+    int size = renderAhead_.LoadState(p, byteSize);
+    if (size == 0) return 0;
+    // The render-ahead switch was added later.
+    if (byteSize >= size + 4) {
+        float value;
+        StateChunk::ReadFloat(p + size, value);
+        if ((value >= 0.5f) != IsRenderAhead()) ioChanged();
+        renderAheadParameter_ = value;
+    }
+    return 1;
+}
+
+int Vst2413p::LoadState(const unsigned char* data, int size) {
+    // Check the whole chunk before loading any of it.
+    int driverSize = SynthDriver::GetStateSize(data, size);
+    if (driverSize == 0 || size < driverSize + 12) return 0;
+    driver_.LoadState(data, size);
+    const unsigned char* p = data + driverSize;
+    p = StateChunk::ReadFloat(p, instrumentParameter_);
+    p = StateChunk::ReadFloat(p, multitimbralParameter_);
+    p = StateChunk::ReadFloat(p, chipsParameter_);
+    // The drum mode was added later.
+    drumsParameter_ = 0;
+    if (size >= driverSize + 16) p = StateChunk::ReadFloat(p, drumsParameter_);
+    ApplyDrumMode();
+    return static_cast<int>(p - data);
+}
+
+int Vst2413p::SaveState(unsigned char* data) {
+    unsigned char* p = data + driver_.SaveState(data);
+    p = StateChunk::WriteFloat(p, instrumentParameter_);
+    p = StateChunk::WriteFloat(p, multitimbralParameter_);
+    p = StateChunk::WriteFloat(p, chipsParameter_);
+    p = StateChunk::WriteFloat(p, drumsParameter_);
+    return static_cast<int>(p - data);
+}
+
+#pragma mark
+#pragma mark Internal functions
+
+void Vst2413p::ApplyDrumMode() {
+    DrumMode mode = ValueToDrumMode(drumsParameter_);
+    driver_.SetRhythmMode(mode != kDrumModeOff);
+    if (mode == kDrumModeSplit) {
+        driver_.SetDrumKeyRange(kDrumKeyLow, kDrumKeyHigh);
     } else {
-        vst_strncpy(text, driver_.GetParameterName(IndexToParameterID(index)).c_str(), kVstMaxParamStrLen);
+        driver_.SetDrumKeyRange(1, 0);
     }
 }
 
@@ -122,10 +351,29 @@ void Vst2413p::getParameterName(VstInt32 index, char* text) {
 #pragma mark Output settings
 
 void Vst2413p::setSampleRate(float sampleRate) {
+    TRACE_INSTANT("setSampleRate", static_cast<int>(sampleRate));
+    capture_.SetSampleRate(sampleRate);
 	AudioEffectX::setSampleRate(sampleRate);
     driver_.SetSampleRate(sampleRate);
 }
 
+void Vst2413p::resume() {
+    capture_.Resume();
+    // The driver creates the chips on the first activation.
+    driver_.Prepare();
+    if (IsRenderAhead()) {
+        renderAhead_.Start(getSampleRate(), getBlockSize());
+    }
+    setInitialDelay(renderAhead_.GetLatency());
+    AudioEffectX::resume();
+}
+
+void Vst2413p::suspend() {
+    renderAhead_.Stop();
+    capture_.Suspend();
+    AudioEffectX::suspend();
+}
+
 bool Vst2413p::getOutputProperties(VstInt32 index, VstPinProperties* properties) {
     if (index == 0) {
         vst_strncpy(properties->label, "1 Out", kVstMaxLabelLen);
@@ -161,14 +409,25 @@ VstInt32 Vst2413p::canDo(char* text) {
     String str = text;
     if (str == "receiveVstEvents") return 1;
     if (str == "receiveVstMidiEvent") return 1;
+    if (str == RenderStats::kCanDo) return 1;
     return 0;
 }
 
+VstIntPtr Vst2413p::vendorSpecific(VstInt32 lArg, VstIntPtr lArg2, void* ptrArg, float floatArg) {
+    // Render statistics; a nonzero float clears them after the copy.
+    if (lArg == RenderStats::kVendorOpcode && lArg2 == sizeof(RenderStats::Snapshot) && ptrArg) {
+        driver_.GetStats().Read(*static_cast<RenderStats::Snapshot*>(ptrArg));
+        if (floatArg != 0) driver_.GetStats().Reset();
+        return 1;
+    }
+    return AudioEffectX::vendorSpecific(lArg, lArg2, ptrArg, floatArg);
+}
+
 #pragma mark
 #pragma mark MIDI channels I/O
 
 VstInt32 Vst2413p::getNumMidiInputChannels() {
-    return 1;
+    return IsMultitimbral() ? 16 : 1;
 }
 
 VstInt32 Vst2413p::getNumMidiOutputChannels() {
@@ -1,4 +1,5 @@
 #include "Vst2413r.h"
+#include "Trace.h"
 
 namespace {
     typedef std::string String;
@@ -11,16 +12,24 @@ AudioEffect* createEffectInstance(audioMasterCallback audioMaster) {
 }
 
 Vst2413r::Vst2413r(audioMasterCallback audioMaster)
-:   AudioEffectX(audioMaster, 0, 0),
-    driver_(44100)
+:   AudioEffectX(audioMaster, 0, kParameters),
+    driver_(44100),
+    cachedParameter_(0),
+    renderAheadParameter_(0),
+    renderAhead_(*this),
+    capture_('r'),
+    eventQueue_(*this, renderAhead_)
 {
     if(audioMaster != NULL) {
         setNumInputs(0);
         setNumOutputs(1);
         setUniqueID(kUniqueId);
         canProcessReplacing();
+        canDoubleReplacing();
         isSynth();
     }
+    // Degrade the emulation under CPU pressure instead of dropping out.
+    driver_.GetGovernor().SetEnabled(true);
     suspend();
 }
 
@@ -28,43 +37,148 @@ Vst2413r::Vst2413r(audioMasterCallback audioMaster)
 #pragma mark Processing functions
 
 VstInt32 Vst2413r::processEvents(VstEvents* events) {
+    TRACE_SCOPE("processEvents", events->numEvents);
 	for (VstInt32 i = 0; i < events->numEvents; i++) {
 		if (events->events[i]->type != kVstMidiType) continue;
 
-		const char* data = reinterpret_cast<VstMidiEvent*>(events->events[i])->midiData;
-        
-        switch (data[0] & 0xf0) {
-            // key off
-            case 0x80:
-                driver_.KeyOff(data[1] & 0x7f);
-                break;
-            // key On
-            case 0x90:
-                driver_.KeyOn(data[1] & 0x7f, 1.0f / 128 * (data[2] & 0x7f));
-                break;
-            // all keys off
-            case 0xb0:
-                if (data[1] == 0x7e || data[1] == 0x7b) driver_.KeyOffAll();
-                break;
-            default:
-                break;
-        }
+		const VstMidiEvent* midi = reinterpret_cast<VstMidiEvent*>(events->events[i]);
+        capture_.Midi(midi->deltaFrames, midi->midiData);
+        eventQueue_.Queue(midi->deltaFrames, midi->midiData);
 	}
 	return 1;
 }
 
 void Vst2413r::processReplacing(float** inputs, float** outputs, VstInt32 sampleFrames) {
-    for (VstInt32 i = 0; i < sampleFrames; i++) outputs[0][i] = driver_.Step();
+    TRACE_SCOPE("processReplacing", sampleFrames);
+    capture_.Process(sampleFrames);
+    Render(outputs[0], sampleFrames);
+}
+
+void Vst2413r::processDoubleReplacing(double** inputs, double** outputs, VstInt32 sampleFrames) {
+    TRACE_SCOPE("processDoubleReplacing", sampleFrames);
+    capture_.Process(sampleFrames);
+    Render(outputs[0], sampleFrames);
+}
+
+template <typename T> void Vst2413r::Render(T* output, VstInt32 sampleFrames) {
+    bool offline = getCurrentProcessLevel() == kVstProcessLevelOffline;
+    driver_.GetGovernor().SetOffline(offline);
+    eventQueue_.Render(driver_, output, sampleFrames, offline);
+}
+
+void Vst2413r::ProcessMidi(const char* data) {
+    TRACE_SCOPE("ProcessMidi", data[0] & 0xff);
+    switch (data[0] & 0xf0) {
+        // key off
+        case 0x80:
+            driver_.KeyOff(data[1] & 0x7f);
+            break;
+        // key On
+        case 0x90:
+            driver_.KeyOn(data[1] & 0x7f, 1.0f / 128 * (data[2] & 0x7f));
+            break;
+        // all keys off
+        case 0xb0:
+            if (data[1] == 0x7e || data[1] == 0x7b) driver_.KeyOffAll();
+            break;
+        default:
+            break;
+    }
+}
+
+void Vst2413r::BeginBlock() {
+    driver_.BeginBlock();
+}
+
+void Vst2413r::RenderAudio(float* buffer, int length) {
+    driver_.RenderSegment(buffer, length);
+}
+
+void Vst2413r::EndBlock() {
+    driver_.EndBlock();
+}
+
+#pragma mark
+#pragma mark Parameter
+
+void Vst2413r::setParameter(VstInt32 index, float value) {
+    capture_.SetParameter(index, value);
+    if (index == kParameterCached) {
+        cachedParameter_ = value;
+        // Rendering the cache is far too heavy for the audio thread; it's
+        // switched on the next resume then.
+        if (value >= 0.5f && driver_.IsPrepared() && !driver_.IsCacheReady()) {
+            ioChanged();
+            return;
+        }
+        // Applied by the worker in the render-ahead mode.
+        renderAhead_.SetParameter(index, value);
+    } else if (index == kParameterRenderAhead) {
+        bool changed = (value >= 0.5f) != IsRenderAhead();
+        renderAheadParameter_ = value;
+        // Switched on the next resume; ask the host to restart the plug-in.
+        if (changed) ioChanged();
+    }
+}
+
+void Vst2413r::ApplyParameter(int index, float value) {
+    if (index == kParameterCached) driver_.SetCachedMode(value >= 0.5f);
+}
+
+float Vst2413r::getParameter(VstInt32 index) {
+    if (index == kParameterCached) return cachedParameter_;
+    if (index == kParameterRenderAhead) return renderAheadParameter_;
+    return 0;
+}
+
+void Vst2413r::getParameterLabel(VstInt32 index, char* text) {
+    vst_strncpy(text, "", kVstMaxParamStrLen);
+}
+
+void Vst2413r::getParameterDisplay(VstInt32 index, char* text) {
+    if (index == kParameterCached) {
+        vst_strncpy(text, cachedParameter_ >= 0.5f ? "on" : "off", kVstMaxParamStrLen);
+    } else if (index == kParameterRenderAhead) {
+        vst_strncpy(text, IsRenderAhead() ? "on" : "off", kVstMaxParamStrLen);
+    }
+}
+
+void Vst2413r::getParameterName(VstInt32 index, char* text) {
+    if (index == kParameterCached) {
+        vst_strncpy(text, "Cached", kVstMaxParamStrLen);
+    } else if (index == kParameterRenderAhead) {
+        vst_strncpy(text, "Ahead", kVstMaxParamStrLen);
+    }
 }
 
 #pragma mark
 #pragma mark Output settings
 
 void Vst2413r::setSampleRate(float sampleRate) {
+    TRACE_INSTANT("setSampleRate", static_cast<int>(sampleRate));
+    capture_.SetSampleRate(sampleRate);
 	AudioEffectX::setSampleRate(sampleRate);
     driver_.SetSampleRate(sampleRate);
 }
 
+void Vst2413r::resume() {
+    capture_.Resume();
+    // The driver creates the chips on the first activation.
+    driver_.Prepare();
+    driver_.SetCachedMode(cachedParameter_ >= 0.5f);
+    if (IsRenderAhead()) {
+        renderAhead_.Start(getSampleRate(), getBlockSize());
+    }
+    setInitialDelay(renderAhead_.GetLatency());
+    AudioEffectX::resume();
+}
+
+void Vst2413r::suspend() {
+    renderAhead_.Stop();
+    capture_.Suspend();
+    AudioEffectX::suspend();
+}
+
 bool Vst2413r::getOutputProperties(VstInt32 index, VstPinProperties* properties) {
     if (index == 0) {
         vst_strncpy(properties->label, "1 Out", kVstMaxLabelLen);
@@ -100,9 +214,20 @@ VstInt32 Vst2413r::canDo(char* text) {
     String str = text;
     if (str == "receiveVstEvents") return 1;
     if (str == "receiveVstMidiEvent") return 1;
+    if (str == RenderStats::kCanDo) return 1;
     return 0;
 }
 
+VstIntPtr Vst2413r::vendorSpecific(VstInt32 lArg, VstIntPtr lArg2, void* ptrArg, float floatArg) {
+    // Render statistics; a nonzero float clears them after the copy.
+    if (lArg == RenderStats::kVendorOpcode && lArg2 == sizeof(RenderStats::Snapshot) && ptrArg) {
+        driver_.GetStats().Read(*static_cast<RenderStats::Snapshot*>(ptrArg));
+        if (floatArg != 0) driver_.GetStats().Reset();
+        return 1;
+    }
+    return AudioEffectX::vendorSpecific(lArg, lArg2, ptrArg, floatArg);
+}
+
 #pragma mark
 #pragma mark MIDI channels I/O
 
@@ -3,17 +3,35 @@
 
 #include "audioeffectx.h"
 #include "RhythmDriver.h"
+#include "RenderAhead.h"
+#include "EventQueue.h"
+#include "SessionCapture.h"
 
-class Vst2413r : public AudioEffectX {
+class Vst2413r : public AudioEffectX, public RenderAhead::Source {
 public:
     static const unsigned long kUniqueId = 'dAzz';
+    
+    enum ParameterIndex {
+        kParameterCached,
+        kParameterRenderAhead,
+        kParameters
+    };
 
     Vst2413r(audioMasterCallback audioMaster);
 
 	virtual void processReplacing(float** inputs, float** outputs, VstInt32 sampleFrames);
+	virtual void processDoubleReplacing(double** inputs, double** outputs, VstInt32 sampleFrames);
 	virtual VstInt32 processEvents(VstEvents* events);
 	
+	virtual void setParameter(VstInt32 index, float value);
+	virtual float getParameter(VstInt32 index);
+	virtual void getParameterLabel(VstInt32 index, char* label);
+	virtual void getParameterDisplay(VstInt32 index, char* text);
+	virtual void getParameterName(VstInt32 index, char* text);
+	
 	virtual void setSampleRate(float sampleRate);
+	virtual void resume();
+	virtual void suspend();
 	virtual bool getOutputProperties(VstInt32 index, VstPinProperties* properties);
     
 	virtual bool getEffectName(char* name);
@@ -21,12 +39,27 @@ public:
 	virtual bool getProductString(char* text);
 	virtual VstInt32 getVendorVersion();
 	virtual VstInt32 canDo(char* text);
+	virtual VstIntPtr vendorSpecific(VstInt32 lArg, VstIntPtr lArg2, void* ptrArg, float floatArg);
     
 	virtual VstInt32 getNumMidiInputChannels();
 	virtual VstInt32 getNumMidiOutputChannels();
+    
+	virtual void ProcessMidi(const char* data);
+	virtual void BeginBlock();
+	virtual void RenderAudio(float* buffer, int length);
+	virtual void EndBlock();
+	virtual void ApplyParameter(int index, float value);
 
 private:
     RhythmDriver driver_;
+    float cachedParameter_;
+    float renderAheadParameter_;
+    RenderAhead renderAhead_;
+    SessionCapture capture_;
+    EventQueue eventQueue_;
+    
+    bool IsRenderAhead() { return renderAheadParameter_ >= 0.5f; }
+    template <typename T> void Render(T* output, VstInt32 sampleFrames);
 };
 
 #endif
@@ -1,4 +1,6 @@
 #include "Vst2413s.h"
+#include "StateChunk.h"
+#include "Trace.h"
 
 namespace {
     typedef std::string String;
@@ -11,16 +13,26 @@ AudioEffect* createEffectInstance(audioMasterCallback audioMaster) {
 }
 
 Vst2413s::Vst2413s(audioMasterCallback audioMaster)
-:   AudioEffectX(audioMaster, 0, SynthDriver::kParameters),
-    driver_(44100)
+:   AudioEffectX(audioMaster, 0, kParameters),
+    driver_(44100),
+    renderAheadParameter_(0),
+    renderAhead_(*this),
+    capture_('s'),
+    eventQueue_(*this, renderAhead_)
 {
     if(audioMaster != NULL) {
         setNumInputs(0);
         setNumOutputs(1);
         setUniqueID(kUniqueId);
         canProcessReplacing();
+        canDoubleReplacing();
+        programsAreChunks();
         isSynth();
     }
+    // Degrade the emulation under CPU pressure instead of dropping out.
+    driver_.GetGovernor().SetEnabled(true);
+    // The lead synth plays a single chip; don't create the expansion ones.
+    driver_.SetMaxChipCount(1);
     suspend();
 }
 
@@ -28,72 +40,186 @@ Vst2413s::Vst2413s(audioMasterCallback audioMaster)
 #pragma mark Processing functions
 
 VstInt32 Vst2413s::processEvents(VstEvents* events) {
+    TRACE_SCOPE("processEvents", events->numEvents);
 	for (VstInt32 i = 0; i < events->numEvents; i++) {
 		if (events->events[i]->type != kVstMidiType) continue;
 
-		const char* data = reinterpret_cast<VstMidiEvent*>(events->events[i])->midiData;
-        
-        switch (data[0] & 0xf0) {
-            // key off
-            case 0x80:
-                driver_.KeyOff(data[1] & 0x7f);
-                break;
-            // key On
-            case 0x90:
-                driver_.KeyOn(data[1] & 0x7f, 1.0f / 128 * (data[2] & 0x7f));
-                break;
-            // all keys off
-            case 0xb0:
-                if (data[1] == 0x7e || data[1] == 0x7b) driver_.KeyOffAll();
-                break;
-            // pitch wheel
-            case 0xe0: {
-                int position = ((data[2] & 0x7f) << 7) + (data[1] & 0x7f);
-                driver_.SetPitchWheel((1.0f / 0x2000) * (position - 0x2000));
-                break;
-            }
-            default:
-                break;
-        }
+		const VstMidiEvent* midi = reinterpret_cast<VstMidiEvent*>(events->events[i]);
+        capture_.Midi(midi->deltaFrames, midi->midiData);
+        eventQueue_.Queue(midi->deltaFrames, midi->midiData);
 	}
 	return 1;
 }
 
 void Vst2413s::processReplacing(float** inputs, float** outputs, VstInt32 sampleFrames) {
-    for (VstInt32 i = 0; i < sampleFrames; i++) outputs[0][i] = driver_.Step();
+    TRACE_SCOPE("processReplacing", sampleFrames);
+    capture_.Process(sampleFrames);
+    Render(outputs[0], sampleFrames);
+}
+
+void Vst2413s::processDoubleReplacing(double** inputs, double** outputs, VstInt32 sampleFrames) {
+    TRACE_SCOPE("processDoubleReplacing", sampleFrames);
+    capture_.Process(sampleFrames);
+    Render(outputs[0], sampleFrames);
+}
+
+template <typename T> void Vst2413s::Render(T* output, VstInt32 sampleFrames) {
+    bool offline = getCurrentProcessLevel() == kVstProcessLevelOffline;
+    driver_.GetGovernor().SetOffline(offline);
+    eventQueue_.Render(driver_, output, sampleFrames, offline);
+}
+
+void Vst2413s::ProcessMidi(const char* data) {
+    TRACE_SCOPE("ProcessMidi", data[0] & 0xff);
+    switch (data[0] & 0xf0) {
+        // key off
+        case 0x80:
+            driver_.KeyOff(data[1] & 0x7f);
+            break;
+        // key On
+        case 0x90:
+            driver_.KeyOn(data[1] & 0x7f, 1.0f / 128 * (data[2] & 0x7f));
+            break;
+        // all keys off
+        case 0xb0:
+            if (data[1] == 0x78) driver_.Panic();
+            if (data[1] == 0x7e || data[1] == 0x7b) driver_.KeyOffAll();
+            break;
+        // pitch wheel
+        case 0xe0: {
+            int position = ((data[2] & 0x7f) << 7) + (data[1] & 0x7f);
+            driver_.SetPitchWheel((1.0f / 0x2000) * (position - 0x2000));
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+void Vst2413s::BeginBlock() {
+    driver_.BeginBlock();
+}
+
+void Vst2413s::RenderAudio(float* buffer, int length) {
+    driver_.RenderSegment(buffer, length);
+}
+
+void Vst2413s::EndBlock() {
+    driver_.EndBlock();
 }
 
 #pragma mark
 #pragma mark Parameter
 
 void Vst2413s::setParameter(VstInt32 index, float value) {
+    capture_.SetParameter(index, value);
+    if (index == kParameterRenderAhead) {
+        bool changed = (value >= 0.5f) != IsRenderAhead();
+        renderAheadParameter_ = value;
+        // Switched on the next resume; ask the host to restart the plug-in.
+        if (changed) ioChanged();
+        return;
+    }
+    // Applied by the worker in the render-ahead mode.
+    renderAhead_.SetParameter(index, value);
+}
+
+void Vst2413s::ApplyParameter(int index, float value) {
     driver_.SetParameter(static_cast<SynthDriver::ParameterID>(index), value);
 }
 
 float Vst2413s::getParameter(VstInt32 index) {
+    if (index == kParameterRenderAhead) return renderAheadParameter_;
     return driver_.GetParameter(static_cast<SynthDriver::ParameterID>(index));
 }
 
 void Vst2413s::getParameterLabel(VstInt32 index, char* text) {
-    vst_strncpy(text, driver_.GetParameterLabel(static_cast<SynthDriver::ParameterID>(index)).c_str(), kVstMaxParamStrLen);
+    if (index == kParameterRenderAhead) {
+        vst_strncpy(text, "", kVstMaxParamStrLen);
+        return;
+    }
+    driver_.GetParameterLabel(static_cast<SynthDriver::ParameterID>(index), text, kVstMaxParamStrLen + 1);
 }
 
 void Vst2413s::getParameterDisplay(VstInt32 index, char* text) {
-    vst_strncpy(text, driver_.GetParameterText(static_cast<SynthDriver::ParameterID>(index)).c_str(), kVstMaxParamStrLen);
+    if (index == kParameterRenderAhead) {
+        vst_strncpy(text, IsRenderAhead() ? "on" : "off", kVstMaxParamStrLen);
+        return;
+    }
+    driver_.GetParameterText(static_cast<SynthDriver::ParameterID>(index), text, kVstMaxParamStrLen + 1);
 }
 
 void Vst2413s::getParameterName(VstInt32 index, char* text) {
-    vst_strncpy(text, driver_.GetParameterName(static_cast<SynthDriver::ParameterID>(index)).c_str(), kVstMaxParamStrLen);
+    if (index == kParameterRenderAhead) {
+        vst_strncpy(text, "Ahead", kVstMaxParamStrLen);
+        return;
+    }
+    driver_.GetParameterName(static_cast<SynthDriver::ParameterID>(index), text, kVstMaxParamStrLen + 1);
+}
+
+#pragma mark
+#pragma mark State chunk
+
+// The render-ahead switch follows the driver state in the chunk. The
+// driver state goes through the worker in the render-ahead mode.
+
+VstInt32 Vst2413s::getChunk(void** data, bool isPreset) {
+    unsigned char* p = chunk_ + renderAhead_.SaveState(chunk_);
+    p = StateChunk::WriteFloat(p, renderAheadParameter_);
+    *data = chunk_;
+    return static_cast<VstInt32>(p - chunk_);
+}
+
+VstInt32 Vst2413s::setChunk(void* data, VstInt32 byteSize, bool isPreset) {
+    capture_.SetChunk(data, byteSize);
+    const unsigned char* p = static_cast<const unsigned char*>(data);
+    int size = renderAhead_.LoadState(p, byteSize);
+    if (size == 0) return 0;
+    // The switch was added later.
+    if (byteSize >= size + 4) {
+        float value;
+        StateChunk::ReadFloat(p + size, value);
+        if ((value >= 0.5f) != IsRenderAhead()) ioChanged();
+        renderAheadParameter_ = value;
+    }
+    return 1;
+}
+
+int Vst2413s::LoadState(const unsigned char* data, int size) {
+    return driver_.LoadState(data, size);
+}
+
+int Vst2413s::SaveState(unsigned char* data) {
+    return driver_.SaveState(data);
 }
 
 #pragma mark
 #pragma mark Output settings
 
 void Vst2413s::setSampleRate(float sampleRate) {
+    TRACE_INSTANT("setSampleRate", static_cast<int>(sampleRate));
+    capture_.SetSampleRate(sampleRate);
 	AudioEffectX::setSampleRate(sampleRate);
     driver_.SetSampleRate(sampleRate);
 }
 
+void Vst2413s::resume() {
+    capture_.Resume();
+    // The driver creates the chips on the first activation.
+    driver_.Prepare();
+    if (IsRenderAhead()) {
+        renderAhead_.Start(getSampleRate(), getBlockSize());
+    }
+    setInitialDelay(renderAhead_.GetLatency());
+    AudioEffectX::resume();
+}
+
+void Vst2413s::suspend() {
+    renderAhead_.Stop();
+    capture_.Suspend();
+    AudioEffectX::suspend();
+}
+
 bool Vst2413s::getOutputProperties(VstInt32 index, VstPinProperties* properties) {
     if (index == 0) {
         vst_strncpy(properties->label, "1 Out", kVstMaxLabelLen);
@@ -129,9 +255,20 @@ VstInt32 Vst2413s::canDo(char* text) {
     String str = text;
     if (str == "receiveVstEvents") return 1;
     if (str == "receiveVstMidiEvent") return 1;
+    if (str == RenderStats::kCanDo) return 1;
     return 0;
 }
 
+VstIntPtr Vst2413s::vendorSpecific(VstInt32 lArg, VstIntPtr lArg2, void* ptrArg, float floatArg) {
+    // Render statistics; a nonzero float clears them after the copy.
+    if (lArg == RenderStats::kVendorOpcode && lArg2 == sizeof(RenderStats::Snapshot) && ptrArg) {
+        driver_.GetStats().Read(*static_cast<RenderStats::Snapshot*>(ptrArg));
+        if (floatArg != 0) driver_.GetStats().Reset();
+        return 1;
+    }
+    return AudioEffectX::vendorSpecific(lArg, lArg2, ptrArg, floatArg);
+}
+
 #pragma mark
 #pragma mark MIDI channels I/O
 
@@ -3,16 +3,29 @@
 
 #include "audioeffectx.h"
 #include "SynthDriver.h"
+#include "RenderAhead.h"
+#include "EventQueue.h"
+#include "SessionCapture.h"
 
-class Vst2413s : public AudioEffectX {
+class Vst2413s : public AudioEffectX, public RenderAhead::Source {
 public:
     static const unsigned long kUniqueId = 'dAzy';
+    
+    // The plug-in parameters follow the driver parameters.
+    enum ParameterIndex {
+        kParameterRenderAhead = SynthDriver::kParameters,
+        kParameters
+    };
 
     Vst2413s(audioMasterCallback audioMaster);
 
 	virtual void processReplacing(float** inputs, float** outputs, VstInt32 sampleFrames);
+	virtual void processDoubleReplacing(double** inputs, double** outputs, VstInt32 sampleFrames);
 	virtual VstInt32 processEvents(VstEvents* events);
     
+	virtual VstInt32 getChunk(void** data, bool isPreset);
+	virtual VstInt32 setChunk(void* data, VstInt32 byteSize, bool isPreset);
+    
 	virtual void setParameter(VstInt32 index, float value);
 	virtual float getParameter(VstInt32 index);
 	virtual void getParameterLabel(VstInt32 index, char* label);
@@ -20,6 +33,8 @@ public:
 	virtual void getParameterName(VstInt32 index, char* text);
 	
 	virtual void setSampleRate(float sampleRate);
+	virtual void resume();
+	virtual void suspend();
 	virtual bool getOutputProperties(VstInt32 index, VstPinProperties* properties);
     
 	virtual bool getEffectName(char* name);
@@ -27,12 +42,29 @@ public:
 	virtual bool getProductString(char* text);
 	virtual VstInt32 getVendorVersion();
 	virtual VstInt32 canDo(char* text);
+	virtual VstIntPtr vendorSpecific(VstInt32 lArg, VstIntPtr lArg2, void* ptrArg, float floatArg);
     
 	virtual VstInt32 getNumMidiInputChannels();
 	virtual VstInt32 getNumMidiOutputChannels();
+    
+	virtual void ProcessMidi(const char* data);
+	virtual void BeginBlock();
+	virtual void RenderAudio(float* buffer, int length);
+	virtual void EndBlock();
+	virtual void ApplyParameter(int index, float value);
+	virtual int LoadState(const unsigned char* data, int size);
+	virtual int SaveState(unsigned char* data);
 
 private:
     SynthDriver driver_;
+    float renderAheadParameter_;
+    RenderAhead renderAhead_;
+    SessionCapture capture_;
+    EventQueue eventQueue_;
+    unsigned char chunk_[SynthDriver::kMaxStateSize + 4];
+    
+    bool IsRenderAhead() { return renderAheadParameter_ >= 0.5f; }
+    template <typename T> void Render(T* output, VstInt32 sampleFrames);
 };
 
 #endif
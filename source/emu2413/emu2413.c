@@ -48,8 +48,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
 #include <math.h>
 #include "emu2413.h"
+#include "../Trace.h"
 
 #ifdef EMU2413_COMPACTION
 #define OPLL_TONE_NUM 1
@@ -152,7 +154,7 @@ static unsigned char default_inst[OPLL_TONE_NUM][(16 + 3) * 16] = {
 #define EXPAND_BITS_X(x,s,d) (((x)<<((d)-(s)))|((1<<((d)-(s)))-1))
 
 /* Adjust envelope speed which depends on sampling rate. */
-#define RATE_ADJUST(x) (rate==49716?x:(e_uint32)((double)(x)*clk/72/rate + 0.5))        /* added 0.5 to round the value*/
+#define RATE_ADJUST(r,x) ((r)==49716?x:(e_uint32)((double)(x)*clk/72/(r) + 0.5))        /* added 0.5 to round the value*/
 
 #define MOD(o,x) (&(o)->slot[(x)<<1])
 #define CAR(o,x) (&(o)->slot[((x)<<1)|1])
@@ -161,8 +163,6 @@ static unsigned char default_inst[OPLL_TONE_NUM][(16 + 3) * 16] = {
 
 /* Input clock */
 static e_uint32 clk = 844451141;
-/* Sampling rate */
-static e_uint32 rate = 3354932;
 
 /* WaveTable for each envelope amp */
 static e_uint16 fullsintable[PG_WIDTH];
@@ -174,10 +174,6 @@ static e_uint16 *waveform[2] = { fullsintable, halfsintable };
 static e_int32 pmtable[PM_PG_WIDTH];
 static e_int32 amtable[AM_PG_WIDTH];
 
-/* Phase delta for LFO */
-static e_uint32 pm_dphase;
-static e_uint32 am_dphase;
-
 /* dB to Liner table */
 static e_int16 DB2LIN_TABLE[(DB_MUTE + DB_MUTE) * 2];
 
@@ -190,22 +186,19 @@ static OPLL_PATCH null_patch = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
 /* Basic voice Data */
 static OPLL_PATCH default_patch[OPLL_TONE_NUM][(16 + 3) * 2];
 
+/* Power-on state image (rebuilt when the tables change) */
+static OPLL reset_image;
+static e_uint32 reset_image_serial = 0;
+static e_uint32 table_serial = 1;
+
 /* Definition of envelope mode */
 enum OPLL_EG_STATE 
 { READY, ATTACK, DECAY, SUSHOLD, SUSTINE, RELEASE, SETTLE, FINISH };
 
-/* Phase incr table for Attack */
-static e_uint32 dphaseARTable[16][16];
-/* Phase incr table for Decay and Release */
-static e_uint32 dphaseDRTable[16][16];
-
 /* KSL + TL Table */
 static e_uint32 tllTable[16][8][1 << TL_BITS][4];
 static e_int32 rksTable[2][8][2];
 
-/* Phase incr table for PG */
-static e_uint32 dphaseTable[512][8][16];
-
 /***************************************************
  
                   Create tables
@@ -316,18 +309,15 @@ makeAmTable (void)
     amtable[i] = (e_int32) ((double) AM_DEPTH / 2 / DB_STEP * (1.0 + saw (2.0 * PI * i / PM_PG_WIDTH)));
 }
 
-/* Phase increment counter table */
-static void
-makeDphaseTable (void)
+/* Phase increment of PG. It depends on the rate of each OPLL, so it is
+   calculated on the register writes instead of being looked up. */
+static e_uint32
+calcDphase (e_uint32 r, e_uint32 fnum, e_uint32 block, e_uint32 ML)
 {
-  e_uint32 fnum, block, ML;
-  e_uint32 mltable[16] =
+  static const e_uint32 mltable[16] =
     { 1, 1 * 2, 2 * 2, 3 * 2, 4 * 2, 5 * 2, 6 * 2, 7 * 2, 8 * 2, 9 * 2, 10 * 2, 10 * 2, 12 * 2, 12 * 2, 15 * 2, 15 * 2 };
 
-  for (fnum = 0; fnum < 512; fnum++)
-    for (block = 0; block < 8; block++)
-      for (ML = 0; ML < 16; ML++)
-        dphaseTable[fnum][block][ML] = RATE_ADJUST (((fnum * mltable[ML]) << block) >> (20 - DP_BITS));
+  return RATE_ADJUST (r, ((fnum * mltable[ML]) << block) >> (20 - DP_BITS));
 }
 
 static void
@@ -405,7 +395,7 @@ static double decaytime[16][4] = {
 
 /* Rate Table for Attack */
 static void
-makeDphaseARTable (void)
+makeDphaseARTable (OPLL * opll)
 {
   e_int32 AR, Rks, RM, RL;
 
@@ -435,16 +425,16 @@ makeDphaseARTable (void)
       switch (AR)
       {
       case 0:
-        dphaseARTable[AR][Rks] = 0;
+        opll->dphaseARTable[AR][Rks] = 0;
         break;
       case 15:
-        dphaseARTable[AR][Rks] = 0;/*EG_DP_WIDTH;*/ 
+        opll->dphaseARTable[AR][Rks] = 0;/*EG_DP_WIDTH;*/ 
         break;
       default:
 #ifdef USE_SPEC_ENV_SPEED
-        dphaseARTable[AR][Rks] = RATE_ADJUST (attacktable[RM][RL]);
+        opll->dphaseARTable[AR][Rks] = RATE_ADJUST (opll->table_rate, attacktable[RM][RL]);
 #else
-        dphaseARTable[AR][Rks] = RATE_ADJUST ((3 * (RL + 4) << (RM + 1)));
+        opll->dphaseARTable[AR][Rks] = RATE_ADJUST (opll->table_rate, (3 * (RL + 4) << (RM + 1)));
 #endif
         break;
       }
@@ -453,7 +443,7 @@ makeDphaseARTable (void)
 
 /* Rate Table for Decay and Release */
 static void
-makeDphaseDRTable (void)
+makeDphaseDRTable (OPLL * opll)
 {
   e_int32 DR, Rks, RM, RL;
 
@@ -478,13 +468,13 @@ makeDphaseDRTable (void)
       switch (DR)
       {
       case 0:
-        dphaseDRTable[DR][Rks] = 0;
+        opll->dphaseDRTable[DR][Rks] = 0;
         break;
       default:
 #ifdef USE_SPEC_ENV_SPEED
-        dphaseDRTable[DR][Rks] = RATE_ADJUST (decaytable[RM][RL]);
+        opll->dphaseDRTable[DR][Rks] = RATE_ADJUST (opll->table_rate, decaytable[RM][RL]);
 #else
-        dphaseDRTable[DR][Rks] = RATE_ADJUST ((RL + 4) << (RM - 1));
+        opll->dphaseDRTable[DR][Rks] = RATE_ADJUST (opll->table_rate, (RL + 4) << (RM - 1));
 #endif
         break;
       }
@@ -596,33 +586,33 @@ OPLL_patch2dump (const OPLL_PATCH * patch, e_uint8 * dump)
 ************************************************************/
 
 INLINE static e_uint32
-calc_eg_dphase (OPLL_SLOT * slot)
+calc_eg_dphase (OPLL * opll, OPLL_SLOT * slot)
 {
 
   switch (slot->eg_mode)
   {
   case ATTACK:
-    return dphaseARTable[slot->patch->AR][slot->rks];
+    return opll->dphaseARTable[slot->patch->AR][slot->rks];
 
   case DECAY:
-    return dphaseDRTable[slot->patch->DR][slot->rks];
+    return opll->dphaseDRTable[slot->patch->DR][slot->rks];
 
   case SUSHOLD:
     return 0;
 
   case SUSTINE:
-    return dphaseDRTable[slot->patch->RR][slot->rks];
+    return opll->dphaseDRTable[slot->patch->RR][slot->rks];
 
   case RELEASE:
     if (slot->sustine)
-      return dphaseDRTable[5][slot->rks];
+      return opll->dphaseDRTable[5][slot->rks];
     else if (slot->patch->EG)
-      return dphaseDRTable[slot->patch->RR][slot->rks];
+      return opll->dphaseDRTable[slot->patch->RR][slot->rks];
     else
-      return dphaseDRTable[7][slot->rks];
+      return opll->dphaseDRTable[7][slot->rks];
 
   case SETTLE:
-    return dphaseDRTable[15][0];
+    return opll->dphaseDRTable[15][0];
 
   case FINISH:
     return 0;
@@ -644,49 +634,49 @@ calc_eg_dphase (OPLL_SLOT * slot)
 #define SLOT_TOM 16
 #define SLOT_CYM 17
 
-#define UPDATE_PG(S)  (S)->dphase = dphaseTable[(S)->fnum][(S)->block][(S)->patch->ML]
+#define UPDATE_PG(O,S)  (S)->dphase = calcDphase((O)->table_rate,(S)->fnum,(S)->block,(S)->patch->ML)
 #define UPDATE_TLL(S)\
 (((S)->type==0)?\
 ((S)->tll = tllTable[((S)->fnum)>>5][(S)->block][(S)->patch->TL][(S)->patch->KL]):\
 ((S)->tll = tllTable[((S)->fnum)>>5][(S)->block][(S)->volume][(S)->patch->KL]))
 #define UPDATE_RKS(S) (S)->rks = rksTable[((S)->fnum)>>8][(S)->block][(S)->patch->KR]
 #define UPDATE_WF(S)  (S)->sintbl = waveform[(S)->patch->WF]
-#define UPDATE_EG(S)  (S)->eg_dphase = calc_eg_dphase(S)
-#define UPDATE_ALL(S)\
-  UPDATE_PG(S);\
+#define UPDATE_EG(O,S)  (S)->eg_dphase = calc_eg_dphase(O,S)
+#define UPDATE_ALL(O,S)\
+  UPDATE_PG(O,S);\
   UPDATE_TLL(S);\
   UPDATE_RKS(S);\
   UPDATE_WF(S); \
-  UPDATE_EG(S)                  /* EG should be updated last. */
+  UPDATE_EG(O,S)                /* EG should be updated last. */
 
 
 /* Slot key on  */
 INLINE static void
-slotOn (OPLL_SLOT * slot)
+slotOn (OPLL * opll, OPLL_SLOT * slot)
 {
   slot->eg_mode = ATTACK;
   slot->eg_phase = 0;
   slot->phase = 0;
-  UPDATE_EG(slot);
+  UPDATE_EG (opll, slot);
 }
 
 /* Slot key on without reseting the phase */
 INLINE static void
-slotOn2 (OPLL_SLOT * slot)
+slotOn2 (OPLL * opll, OPLL_SLOT * slot)
 {
   slot->eg_mode = ATTACK;
   slot->eg_phase = 0;
-  UPDATE_EG(slot);
+  UPDATE_EG (opll, slot);
 }
 
 /* Slot key off */
 INLINE static void
-slotOff (OPLL_SLOT * slot)
+slotOff (OPLL * opll, OPLL_SLOT * slot)
 {
   if (slot->eg_mode == ATTACK)
     slot->eg_phase = EXPAND_BITS (AR_ADJUST_TABLE[HIGHBITS (slot->eg_phase, EG_DP_BITS - EG_BITS)], EG_BITS, EG_DP_BITS);
   slot->eg_mode = RELEASE;
-  UPDATE_EG(slot);
+  UPDATE_EG (opll, slot);
 }
 
 /* Channel key on */
@@ -694,9 +684,9 @@ INLINE static void
 keyOn (OPLL * opll, e_int32 i)
 {
   if (!opll->slot_on_flag[i * 2])
-    slotOn (MOD(opll,i));
+    slotOn (opll, MOD(opll,i));
   if (!opll->slot_on_flag[i * 2 + 1])
-    slotOn (CAR(opll,i));
+    slotOn (opll, CAR(opll,i));
   opll->key_status[i] = 1;
 }
 
@@ -705,7 +695,7 @@ INLINE static void
 keyOff (OPLL * opll, e_int32 i)
 {
   if (opll->slot_on_flag[i * 2 + 1])
-    slotOff (CAR(opll,i));
+    slotOff (opll, CAR(opll,i));
   opll->key_status[i] = 0;
 }
 
@@ -718,25 +708,25 @@ INLINE static void
 keyOn_SD (OPLL * opll)
 {
   if (!opll->slot_on_flag[SLOT_SD])
-    slotOn (CAR(opll,7));
+    slotOn (opll, CAR(opll,7));
 }
 INLINE static void
 keyOn_TOM (OPLL * opll)
 {
   if (!opll->slot_on_flag[SLOT_TOM])
-    slotOn (MOD(opll,8));
+    slotOn (opll, MOD(opll,8));
 }
 INLINE static void
 keyOn_HH (OPLL * opll)
 {
   if (!opll->slot_on_flag[SLOT_HH])
-    slotOn2 (MOD(opll,7));
+    slotOn2 (opll, MOD(opll,7));
 }
 INLINE static void
 keyOn_CYM (OPLL * opll)
 {
   if (!opll->slot_on_flag[SLOT_CYM]) {
-    slotOn2 (CAR(opll,8));
+    slotOn2 (opll, CAR(opll,8));
   }
 }
 
@@ -750,26 +740,26 @@ INLINE static void
 keyOff_SD (OPLL * opll)
 {
   if (opll->slot_on_flag[SLOT_SD])
-    slotOff (CAR(opll,7));
+    slotOff (opll, CAR(opll,7));
 }
 INLINE static void
 keyOff_TOM (OPLL * opll)
 {
   if (opll->slot_on_flag[SLOT_TOM])
-    slotOff (MOD(opll,8));
+    slotOff (opll, MOD(opll,8));
 }
 INLINE static void
 keyOff_HH (OPLL * opll)
 {
   if (opll->slot_on_flag[SLOT_HH])
-    slotOff (MOD(opll,7));
+    slotOff (opll, MOD(opll,7));
 }
 INLINE static void
 keyOff_CYM (OPLL * opll)
 {
   if (opll->slot_on_flag[SLOT_CYM]) {
     CAR(opll,8)->sustine = 1;
-    slotOff (CAR(opll,8));
+    slotOff (opll, CAR(opll,8));
   }
 }
 
@@ -945,22 +935,43 @@ OPLL_SLOT_reset (OPLL_SLOT * slot, int type)
   slot->patch = &null_patch;
 }
 
+/* Rate dependent tables of the OPLL */
 static void
-internal_refresh (void)
+make_rate_tables (OPLL * opll, e_uint32 r)
 {
-  makeDphaseTable ();
-  makeDphaseARTable ();
-  makeDphaseDRTable ();
-  pm_dphase = (e_uint32) RATE_ADJUST (PM_SPEED * PM_DP_WIDTH / (clk / 72));
-  am_dphase = (e_uint32) RATE_ADJUST (AM_SPEED * AM_DP_WIDTH / (clk / 72));
+  opll->table_rate = r;
+  makeDphaseARTable (opll);
+  makeDphaseDRTable (opll);
+  opll->pm_dphase = (e_uint32) RATE_ADJUST (r, PM_SPEED * PM_DP_WIDTH / (clk / 72));
+  opll->am_dphase = (e_uint32) RATE_ADJUST (r, AM_SPEED * AM_DP_WIDTH / (clk / 72));
+}
+
+/* Rebuilds the rate dependent tables and the increments of the slots
+   calculated from them. */
+static void
+set_table_rate (OPLL * opll, e_uint32 r)
+{
+  e_int32 i;
+
+  TRACE_BEGIN ("OPLL rate tables", r);
+  make_rate_tables (opll, r);
+
+  for (i = 0; i < 18; i++)
+  {
+    UPDATE_PG (opll, &opll->slot[i]);
+    UPDATE_EG (opll, &opll->slot[i]);
+  }
+  TRACE_END ("OPLL rate tables");
 }
 
 static void
-maketables (e_uint32 c, e_uint32 r)
+maketables (e_uint32 c)
 {
   if (c != clk)
   {
+    TRACE_BEGIN ("emu2413 tables", c);
     clk = c;
+    table_serial++;
     makePmTable ();
     makeAmTable ();
     makeDB2LinTable ();
@@ -969,34 +980,101 @@ maketables (e_uint32 c, e_uint32 r)
     makeRksTable ();
     makeSinTable ();
     makeDefaultPatch ();
+    TRACE_END ("emu2413 tables");
   }
+}
+
+/* Resets the whole of OPLL except patch datas through the registers. */
+static void
+reset_by_registers (OPLL * opll)
+{
+  e_int32 i;
+
+  opll->adr = 0;
+  opll->out = 0;
+
+  opll->pm_phase = 0;
+  opll->am_phase = 0;
+
+  opll->noise_seed = 0xffff;
+  opll->mask = 0;
 
-  if (r != rate)
+  for (i = 0; i <18; i++)
+    OPLL_SLOT_reset(&opll->slot[i], i%2);
+
+  for (i = 0; i < 9; i++)
   {
-    rate = r;
-    internal_refresh ();
+    opll->key_status[i] = 0;
+    setPatch (opll, i, 0);
   }
+
+  for (i = 0; i < 0x40; i++)
+    OPLL_writeReg (opll, i, 0);
+
+#ifndef EMU2413_COMPACTION
+  opll->realstep = (e_uint32) ((1 << 31) / opll->rate);
+  opll->opllstep = (e_uint32) ((1 << 31) / (clk / 72));
+  opll->oplltime = 0;
+  for (i = 0; i < 14; i++)
+    opll->pan[i] = 3;
+  opll->sprev[0] = opll->sprev[1] = 0;
+  opll->snext[0] = opll->snext[1] = 0;
+#endif
+}
+
+/* Builds the power-on state image with the current tables, at 49716 Hz.
+   It's only read afterwards; OPLL_new sets the rate on the new object. */
+static void
+make_reset_image (void)
+{
+  e_int32 i;
+
+  if (reset_image_serial == table_serial)
+    return;
+
+  memset (&reset_image, 0, sizeof (OPLL));
+  for (i = 0; i < 19 * 2; i++)
+    memcpy(&reset_image.patch[i],&null_patch,sizeof(OPLL_PATCH));
+
+  reset_image.rate = 49716;
+  make_rate_tables (&reset_image, reset_image.rate);
+  reset_by_registers (&reset_image);
+  reset_image_serial = table_serial;
+}
+
+/* Copies the image and fixes up the slot pointers into the patches. The
+   rate dependent part is copied only when size covers it. */
+static void
+copy_reset_image (OPLL * opll, size_t size)
+{
+  e_int32 i;
+
+  memcpy (opll, &reset_image, size);
+
+  for (i = 0; i < 18; i++)
+    if (reset_image.slot[i].patch != &null_patch)
+      opll->slot[i].patch = opll->patch + (reset_image.slot[i].patch - reset_image.patch);
 }
 
 OPLL *
 OPLL_new (e_uint32 clk, e_uint32 rate)
 {
   OPLL *opll;
-  e_int32 i;
 
-  maketables (clk, rate);
+  maketables (clk);
 
-  opll = (OPLL *) calloc (sizeof (OPLL), 1);
+  opll = (OPLL *) malloc (sizeof (OPLL));
   if (opll == NULL)
     return NULL;
 
-  for (i = 0; i < 19 * 2; i++)
-    memcpy(&opll->patch[i],&null_patch,sizeof(OPLL_PATCH));
-
-  opll->mask = 0;
-
-  OPLL_reset (opll);
-  OPLL_reset_patch (opll, 0);
+  /* Same as OPLL_reset and OPLL_reset_patch(opll, 0) on a new object. The
+     image stays at its own rate (it's shared), the object is set to rate. */
+  make_reset_image ();
+  copy_reset_image (opll, sizeof (OPLL));
+  if (opll->rate != rate)
+    OPLL_set_rate (opll, rate);
+  memcpy (opll->patch, default_patch[0], sizeof (opll->patch));
+  opll->write_count = 0;
 
   return opll;
 }
@@ -1023,38 +1101,80 @@ OPLL_reset_patch (OPLL * opll, e_int32 type)
 void
 OPLL_reset (OPLL * opll)
 {
-  e_int32 i;
+  OPLL_PATCH patch[19 * 2];
+  e_uint32 quality;
+  e_int32 lfo_pm, lfo_am;
+#ifndef EMU2413_COMPACTION
+  e_int32 prev, next;
+#endif
 
   if (!opll)
     return;
 
-  opll->adr = 0;
-  opll->out = 0;
+  TRACE_INSTANT ("OPLL_reset", 0);
 
-  opll->pm_phase = 0;
-  opll->am_phase = 0;
+  /* Keep the fields which the register path leaves untouched. The user
+     patch (0 and 1) is cleared by the registers. */
+  memcpy (patch, opll->patch, sizeof (patch));
+  quality = opll->quality;
+  lfo_pm = opll->lfo_pm;
+  lfo_am = opll->lfo_am;
+#ifndef EMU2413_COMPACTION
+  prev = opll->prev;
+  next = opll->next;
+#endif
 
-  opll->noise_seed = 0xffff;
-  opll->mask = 0;
+  /* The rate of the OPLL is kept. The slots of the image are all finished
+     with F-Number 0, so their increments do not depend on the rate. */
+  make_reset_image ();
+  copy_reset_image (opll, offsetof (OPLL, rate));
+#ifndef EMU2413_COMPACTION
+  opll->realstep = (e_uint32) ((1 << 31) / opll->rate);
+#endif
 
-  for (i = 0; i <18; i++)
-    OPLL_SLOT_reset(&opll->slot[i], i%2);
+  memcpy (opll->patch + 2, patch + 2, sizeof (OPLL_PATCH) * (19 * 2 - 2));
+  opll->quality = quality;
+  opll->lfo_pm = lfo_pm;
+  opll->lfo_am = lfo_am;
+#ifndef EMU2413_COMPACTION
+  opll->prev = prev;
+  opll->next = next;
+#endif
+}
+
+/* Silence all the slots at once without the key off process. The patches
+   and the registers other than the key bits are kept. */
+void
+OPLL_panic (OPLL * opll)
+{
+  e_int32 i;
+
+  if (!opll)
+    return;
 
   for (i = 0; i < 9; i++)
   {
+    opll->reg[0x20 + i] &= ~0x10;
     opll->key_status[i] = 0;
-    setPatch (opll, i, 0);
   }
+  opll->reg[0x0e] &= ~0x1f;
 
-  for (i = 0; i < 0x40; i++)
-    OPLL_writeReg (opll, i, 0);
+  for (i = 0; i < 18; i++)
+  {
+    OPLL_SLOT *slot = &opll->slot[i];
+    slot->output[0] = 0;
+    slot->output[1] = 0;
+    slot->feedback = 0;
+    slot->eg_mode = FINISH;
+    slot->eg_phase = EG_DP_WIDTH;
+    slot->eg_dphase = 0;
+    slot->egout = 0;
+    opll->slot_on_flag[i] = 0;
+  }
 
+  opll->out = 0;
 #ifndef EMU2413_COMPACTION
-  opll->realstep = (e_uint32) ((1 << 31) / rate);
-  opll->opllstep = (e_uint32) ((1 << 31) / (clk / 72));
-  opll->oplltime = 0;
-  for (i = 0; i < 14; i++)
-    opll->pan[i] = 3;
+  opll->prev = opll->next = 0;
   opll->sprev[0] = opll->sprev[1] = 0;
   opll->snext[0] = opll->snext[1] = 0;
 #endif
@@ -1074,30 +1194,39 @@ OPLL_forceRefresh (OPLL * opll)
 
   for (i = 0; i < 18; i++)
   {
-    UPDATE_PG (&opll->slot[i]);
+    UPDATE_PG (opll, &opll->slot[i]);
     UPDATE_RKS (&opll->slot[i]);
     UPDATE_TLL (&opll->slot[i]);
     UPDATE_WF (&opll->slot[i]);
-    UPDATE_EG (&opll->slot[i]);
+    UPDATE_EG (opll, &opll->slot[i]);
   }
 }
 
+/* The tables are per OPLL, so each one can run at its own rate. The
+   quality mode runs the tables at the native rate (clk/72). */
 void
 OPLL_set_rate (OPLL * opll, e_uint32 r)
 {
-  if (opll->quality)
-    rate = 49716;
-  else
-    rate = r;
-  internal_refresh ();
-  rate = r;
+  opll->rate = r;
+#ifndef EMU2413_COMPACTION
+  opll->realstep = (e_uint32) ((1 << 31) / r);
+#endif
+  set_table_rate (opll, opll->quality ? 49716 : r);
 }
 
 void
 OPLL_set_quality (OPLL * opll, e_uint32 q)
 {
   opll->quality = q;
-  OPLL_set_rate (opll, rate);
+  OPLL_set_rate (opll, opll->rate);
+}
+
+/* Releasing slots are finished once the total attenuation (envelope plus
+   TL/volume) reaches db. 0 disables it. */
+void
+OPLL_set_cull_level (OPLL * opll, e_uint32 db)
+{
+  opll->cull_level = (e_uint32) (db / EG_STEP);
 }
 
 /*********************************************************
@@ -1134,8 +1263,8 @@ OPLL_set_quality (OPLL * opll, e_uint32 q)
 static void
 update_ampm (OPLL * opll)
 {
-  opll->pm_phase = (opll->pm_phase + pm_dphase) & (PM_DP_WIDTH - 1);
-  opll->am_phase = (opll->am_phase + am_dphase) & (AM_DP_WIDTH - 1);
+  opll->pm_phase = (opll->pm_phase + opll->pm_dphase) & (PM_DP_WIDTH - 1);
+  opll->am_phase = (opll->am_phase + opll->am_dphase) & (AM_DP_WIDTH - 1);
   opll->lfo_am = amtable[HIGHBITS (opll->am_phase, AM_DP_BITS - AM_PG_BITS)];
   opll->lfo_pm = pmtable[HIGHBITS (opll->pm_phase, PM_DP_BITS - PM_PG_BITS)];
 }
@@ -1164,7 +1293,7 @@ update_noise (OPLL * opll)
 
 /* EG */
 static void
-calc_envelope (OPLL_SLOT * slot, e_int32 lfo)
+calc_envelope (OPLL * opll, OPLL_SLOT * slot, e_int32 lfo)
 {
 #define S2E(x) (SL2EG((e_int32)(x/SL_STEP))<<(EG_DP_BITS-EG_BITS))
 
@@ -1185,7 +1314,7 @@ calc_envelope (OPLL_SLOT * slot, e_int32 lfo)
       egout = 0;
       slot->eg_phase = 0;
       slot->eg_mode = DECAY;
-      UPDATE_EG (slot);
+      UPDATE_EG (opll, slot);
     }
     break;
 
@@ -1198,13 +1327,13 @@ calc_envelope (OPLL_SLOT * slot, e_int32 lfo)
       {
         slot->eg_phase = SL[slot->patch->SL];
         slot->eg_mode = SUSHOLD;
-        UPDATE_EG (slot);
+        UPDATE_EG (opll, slot);
       }
       else
       {
         slot->eg_phase = SL[slot->patch->SL];
         slot->eg_mode = SUSTINE;
-        UPDATE_EG (slot);
+        UPDATE_EG (opll, slot);
       }
     }
     break;
@@ -1214,7 +1343,7 @@ calc_envelope (OPLL_SLOT * slot, e_int32 lfo)
     if (slot->patch->EG == 0)
     {
       slot->eg_mode = SUSTINE;
-      UPDATE_EG (slot);
+      UPDATE_EG (opll, slot);
     }
     break;
 
@@ -1227,6 +1356,14 @@ calc_envelope (OPLL_SLOT * slot, e_int32 lfo)
       slot->eg_mode = FINISH;
       egout = (1 << EG_BITS) - 1;
     }
+    else if (opll->cull_level && egout + slot->tll >= opll->cull_level && slot->type)
+    {
+      /* Inaudible tail of a carrier (or a HH/TOM slot in the rhythm mode):
+         finish it as if the envelope had run out. */
+      slot->eg_mode = FINISH;
+      slot->eg_phase = EG_DP_WIDTH;
+      egout = (1 << EG_BITS) - 1;
+    }
     break;
 
   case SETTLE:
@@ -1236,7 +1373,7 @@ calc_envelope (OPLL_SLOT * slot, e_int32 lfo)
     {
       slot->eg_mode = ATTACK;
       egout = (1 << EG_BITS) - 1;
-      UPDATE_EG(slot);
+      UPDATE_EG (opll, slot);
     }
     break;
 
@@ -1385,10 +1522,23 @@ calc_slot_hat (OPLL_SLOT *slot, e_int32 pgout_cym, e_uint32 noise)
   return DB2LIN_TABLE[dbout + slot->egout];
 }
 
-static e_int16
-calc (OPLL * opll)
+/* Channels 6-8 played as the rhythm, one bit each. */
+#define RHYTHM_BITS(o) (((o)->patch_number[6] > 15) | (((o)->patch_number[7] > 15) << 1) | (((o)->patch_number[8] > 15) << 2))
+
+#ifdef EMU2413_COMPACTION
+#define PAN(o,x) 3
+#else
+#define PAN(o,x) (stereo ? (o)->pan[x] : 3)
+#endif
+
+#define AUDIBLE(m,s) (!(masked && (opll->mask & (m))) && ((s)->eg_mode != FINISH))
+
+/* Mixes one sample into b (melodic) and r (rhythm) by the pan (Ignore, Right,
+   Left, Center); the mono output goes to the center. rhythm, masked and
+   stereo are constants in the kernels, so their branches are compiled out. */
+INLINE static void
+mix (OPLL * opll, e_int32 b[4], e_int32 r[4], e_int32 rhythm, e_int32 masked, e_int32 stereo)
 {
-  e_int32 inst = 0, perc = 0, out = 0;
   e_int32 i;
 
   update_ampm (opll);
@@ -1397,83 +1547,286 @@ calc (OPLL * opll)
   for (i = 0; i < 18; i++)
   {
     calc_phase(&opll->slot[i],opll->lfo_pm);
-    calc_envelope(&opll->slot[i],opll->lfo_am);
+    calc_envelope(opll,&opll->slot[i],opll->lfo_am);
   }
 
   for (i = 0; i < 6; i++)
-    if (!(opll->mask & OPLL_MASK_CH (i)) && (CAR(opll,i)->eg_mode != FINISH))
-      inst += calc_slot_car (CAR(opll,i), calc_slot_mod(MOD(opll,i)));
+    if (AUDIBLE (OPLL_MASK_CH (i), CAR(opll,i)))
+      b[PAN(opll,i)] += calc_slot_car (CAR(opll,i), calc_slot_mod(MOD(opll,i)));
 
   /* CH6 */
-  if (opll->patch_number[6] <= 15)
+  if (!(rhythm & 1))
   {
-    if (!(opll->mask & OPLL_MASK_CH (6)) && (CAR(opll,6)->eg_mode != FINISH))
-      inst += calc_slot_car (CAR(opll,6), calc_slot_mod(MOD(opll,6)));
+    if (AUDIBLE (OPLL_MASK_CH (6), CAR(opll,6)))
+      b[PAN(opll,6)] += calc_slot_car (CAR(opll,6), calc_slot_mod(MOD(opll,6)));
   }
   else
   {
-    if (!(opll->mask & OPLL_MASK_BD) && (CAR(opll,6)->eg_mode != FINISH))
-      perc += calc_slot_car (CAR(opll,6), calc_slot_mod(MOD(opll,6)));
+    if (AUDIBLE (OPLL_MASK_BD, CAR(opll,6)))
+      r[PAN(opll,9)] += calc_slot_car (CAR(opll,6), calc_slot_mod(MOD(opll,6)));
   }
 
   /* CH7 */
-  if (opll->patch_number[7] <= 15)
+  if (!(rhythm & 2))
   {
-    if (!(opll->mask & OPLL_MASK_CH (7)) && (CAR(opll,7)->eg_mode != FINISH))
-      inst += calc_slot_car (CAR(opll,7), calc_slot_mod(MOD(opll,7)));
+    if (AUDIBLE (OPLL_MASK_CH (7), CAR(opll,7)))
+      b[PAN(opll,7)] += calc_slot_car (CAR(opll,7), calc_slot_mod(MOD(opll,7)));
   }
   else
   {
-    if (!(opll->mask & OPLL_MASK_HH) && (MOD(opll,7)->eg_mode != FINISH))
-      perc += calc_slot_hat (MOD(opll,7), CAR(opll,8)->pgout, opll->noise_seed&1);
-    if (!(opll->mask & OPLL_MASK_SD) && (CAR(opll,7)->eg_mode != FINISH))
-      perc -= calc_slot_snare (CAR(opll,7), opll->noise_seed&1);
+    if (AUDIBLE (OPLL_MASK_HH, MOD(opll,7)))
+      r[PAN(opll,10)] += calc_slot_hat (MOD(opll,7), CAR(opll,8)->pgout, opll->noise_seed&1);
+    if (AUDIBLE (OPLL_MASK_SD, CAR(opll,7)))
+      r[PAN(opll,11)] -= calc_slot_snare (CAR(opll,7), opll->noise_seed&1);
   }
 
   /* CH8 */
-  if (opll->patch_number[8] <= 15)
+  if (!(rhythm & 4))
   {
-    if (!(opll->mask & OPLL_MASK_CH(8)) && (CAR(opll,8)->eg_mode != FINISH))
-      inst += calc_slot_car (CAR(opll,8), calc_slot_mod (MOD(opll,8)));
+    if (AUDIBLE (OPLL_MASK_CH (8), CAR(opll,8)))
+      b[PAN(opll,8)] += calc_slot_car (CAR(opll,8), calc_slot_mod (MOD(opll,8)));
   }
   else
   {
-    if (!(opll->mask & OPLL_MASK_TOM) && (MOD(opll,8)->eg_mode != FINISH))
-      perc += calc_slot_tom (MOD(opll,8));
-    if (!(opll->mask & OPLL_MASK_CYM) && (CAR(opll,8)->eg_mode != FINISH))
-      perc -= calc_slot_cym (CAR(opll,8), MOD(opll,7)->pgout);
+    if (AUDIBLE (OPLL_MASK_TOM, MOD(opll,8)))
+      r[PAN(opll,12)] += calc_slot_tom (MOD(opll,8));
+    if (AUDIBLE (OPLL_MASK_CYM, CAR(opll,8)))
+      r[PAN(opll,13)] -= calc_slot_cym (CAR(opll,8), MOD(opll,7)->pgout);
   }
+}
+
+/* Interpolation between the chip samples around the output sample. */
+#define RESAMPLE(o,prev,next) (((double) (next) * ((o)->opllstep - (o)->oplltime)\
+                                + (double) (prev) * (o)->oplltime) / (o)->opllstep)
+
+/* Instruction set variants of the kernels (GCC and Clang on x86). The
+   multiply-adds are not fused, so the resampler rounds the same way in
+   all of them. */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define EMU2413_ISA_VARIANTS
+#ifdef __clang__
+#pragma clang fp contract(off)
+#define TARGET_AVX2 __attribute__ ((target ("avx2")))
+#define TARGET_AVX512 __attribute__ ((target ("avx512f,avx512bw,avx512vl")))
+#else
+#define TARGET_AVX2 __attribute__ ((target ("avx2"), optimize ("fp-contract=off")))
+#define TARGET_AVX512 __attribute__ ((target ("avx512f,avx512bw,avx512vl"), optimize ("fp-contract=off")))
+#endif
+#endif
+#define TARGET_GENERIC
+
+/* Sample and block kernels for a combination of the flags. */
+#define DEFINE_MONO_KERNELS(NAME,RHYTHM,MASKED,ATTR)\
+ATTR static e_int16 calc_##NAME (OPLL * opll)\
+{\
+  e_int32 b[4] = { 0, 0, 0, 0 }, r[4] = { 0, 0, 0, 0 };\
+  mix (opll, b, r, RHYTHM, MASKED, 0);\
+  return (e_int16) (b[3] + (r[3] << 1)) << 3;\
+}\
+ATTR static void calc_block_##NAME (OPLL * opll, e_int32 * buf, e_uint32 n)\
+{\
+  e_uint32 i;\
+  for (i = 0; i < n; i++)\
+    buf[i] = calc_##NAME (opll);\
+}
+
+#ifdef EMU2413_COMPACTION
+#define DEFINE_KERNELS(NAME,RHYTHM,MASKED,ATTR) DEFINE_MONO_KERNELS(NAME,RHYTHM,MASKED,ATTR)
+#else
+#define DEFINE_KERNELS(NAME,RHYTHM,MASKED,ATTR)\
+DEFINE_MONO_KERNELS(NAME,RHYTHM,MASKED,ATTR)\
+ATTR static void calc_resampled_block_##NAME (OPLL * opll, e_int32 * buf, e_uint32 n)\
+{\
+  e_uint32 i;\
+  for (i = 0; i < n; i++)\
+  {\
+    while (opll->realstep > opll->oplltime)\
+    {\
+      opll->oplltime += opll->opllstep;\
+      opll->prev = opll->next;\
+      opll->next = calc_##NAME (opll);\
+    }\
+    opll->oplltime -= opll->realstep;\
+    opll->out = (e_int16) RESAMPLE (opll, opll->prev, opll->next);\
+    buf[i] = (e_int16) opll->out;\
+  }\
+}\
+ATTR static void calc_stereo_##NAME (OPLL * opll, e_int32 out[2])\
+{\
+  e_int32 b[4] = { 0, 0, 0, 0 }, r[4] = { 0, 0, 0, 0 };\
+  mix (opll, b, r, RHYTHM, MASKED, 1);\
+  out[1] = (b[1] + b[3] + ((r[1] + r[3]) << 1)) <<3;\
+  out[0] = (b[2] + b[3] + ((r[2] + r[3]) << 1)) <<3;\
+}\
+ATTR static void calc_stereo_block_##NAME (OPLL * opll, e_int32 * buf, e_uint32 n)\
+{\
+  e_uint32 i;\
+  for (i = 0; i < n; i++)\
+    calc_stereo_##NAME (opll, buf + i * 2);\
+}\
+ATTR static void calc_resampled_stereo_block_##NAME (OPLL * opll, e_int32 * buf, e_uint32 n)\
+{\
+  e_uint32 i;\
+  for (i = 0; i < n; i++)\
+  {\
+    while (opll->realstep > opll->oplltime)\
+    {\
+      opll->oplltime += opll->opllstep;\
+      opll->sprev[0] = opll->snext[0];\
+      opll->sprev[1] = opll->snext[1];\
+      calc_stereo_##NAME (opll, opll->snext);\
+    }\
+    opll->oplltime -= opll->realstep;\
+    buf[i * 2] = (e_int16) RESAMPLE (opll, opll->sprev[0], opll->snext[0]);\
+    buf[i * 2 + 1] = (e_int16) RESAMPLE (opll, opll->sprev[1], opll->snext[1]);\
+  }\
+}
+#endif
+
+/* The generic kernel checks everything on each sample. */
+#define DEFINE_KERNEL_SET(ISA,ATTR)\
+DEFINE_KERNELS (generic##ISA, RHYTHM_BITS (opll), 1, ATTR)\
+DEFINE_KERNELS (melodic##ISA, 0, 0, ATTR)\
+DEFINE_KERNELS (melodic_masked##ISA, 0, 1, ATTR)\
+DEFINE_KERNELS (rhythm##ISA, 7, 0, ATTR)\
+DEFINE_KERNELS (rhythm_masked##ISA, 7, 1, ATTR)
+
+DEFINE_KERNEL_SET (, TARGET_GENERIC)
+#ifdef EMU2413_ISA_VARIANTS
+DEFINE_KERNEL_SET (_avx2, TARGET_AVX2)
+DEFINE_KERNEL_SET (_avx512, TARGET_AVX512)
+#endif
+
+typedef void (*calc_block_func) (OPLL *, e_int32 *, e_uint32);
+
+#ifdef EMU2413_ISA_VARIANTS
+#define KERNEL_ISAS 3
+#else
+#define KERNEL_ISAS 1
+#endif
+
+/* Variant used by all the OPLLs. It can be set while other threads render,
+   so the accesses are atomic (relaxed; nothing else depends on it). */
+static volatile e_uint32 kernel_isa = OPLL_ISA_GENERIC;
+#ifdef __GNUC__
+#define LOAD_KERNEL_ISA() __atomic_load_n (&kernel_isa, __ATOMIC_RELAXED)
+#define STORE_KERNEL_ISA(isa) __atomic_store_n (&kernel_isa, (isa), __ATOMIC_RELAXED)
+#else
+/* Aligned 32-bit accesses are atomic on the other supported targets. */
+#define LOAD_KERNEL_ISA() (kernel_isa)
+#define STORE_KERNEL_ISA(isa) (kernel_isa = (isa))
+#endif
+
+enum { KERNEL_MELODIC, KERNEL_MELODIC_MASKED, KERNEL_RHYTHM, KERNEL_RHYTHM_MASKED, KERNEL_GENERIC };
+
+/* Chooses the kernel for the next block from the rhythm mode and the mask. */
+static e_int32
+select_kernel (OPLL * opll)
+{
+  e_int32 rhythm = RHYTHM_BITS (opll);
 
-  out = inst + (perc << 1);
-  return (e_int16) out << 3;
+  if (rhythm == 0)
+    return opll->mask ? KERNEL_MELODIC_MASKED : KERNEL_MELODIC;
+  if (rhythm == 7)
+    return opll->mask ? KERNEL_RHYTHM_MASKED : KERNEL_RHYTHM;
+  return KERNEL_GENERIC;
 }
 
+/* Selects the instruction set variant of the block kernels. Variants the
+   CPU (or the build) does not support fall back to the generic one. */
+void
+OPLL_set_isa (e_uint32 isa)
+{
+#ifdef EMU2413_ISA_VARIANTS
+  __builtin_cpu_init ();
+  if (isa >= OPLL_ISA_AVX512 && !(__builtin_cpu_supports ("avx512f") && __builtin_cpu_supports ("avx512bw")
+                                  && __builtin_cpu_supports ("avx512vl")))
+    isa = OPLL_ISA_AVX2;
+  if (isa >= OPLL_ISA_AVX2 && !__builtin_cpu_supports ("avx2"))
+    isa = OPLL_ISA_GENERIC;
+  STORE_KERNEL_ISA (isa);
+#else
+  (void) isa;
+  STORE_KERNEL_ISA (OPLL_ISA_GENERIC);
+#endif
+}
+
+e_uint32
+OPLL_get_isa (void)
+{
+  return LOAD_KERNEL_ISA ();
+}
+
+#define calc calc_generic
+
 #ifdef EMU2413_COMPACTION
 e_int16
 OPLL_calc (OPLL * opll)
 {
-  return calc (opll);
+  return calc_generic (opll);
+}
+
+void
+OPLL_calc_block (OPLL * opll, e_int32 * buf, e_uint32 n)
+{
+#define KERNEL_ROW(ISA) {\
+    calc_block_melodic##ISA, calc_block_melodic_masked##ISA,\
+    calc_block_rhythm##ISA, calc_block_rhythm_masked##ISA,\
+    calc_block_generic##ISA }
+  static const calc_block_func kernels[KERNEL_ISAS][5] = {
+    KERNEL_ROW ()
+#ifdef EMU2413_ISA_VARIANTS
+    , KERNEL_ROW (_avx2), KERNEL_ROW (_avx512)
+#endif
+  };
+#undef KERNEL_ROW
+
+  TRACE_BEGIN ("OPLL_calc_block", n);
+  kernels[LOAD_KERNEL_ISA ()][select_kernel (opll)] (opll, buf, n);
+  TRACE_END ("OPLL_calc_block");
 }
 #else
 e_int16
 OPLL_calc (OPLL * opll)
 {
   if (!opll->quality)
-    return calc (opll);
+    return calc_generic (opll);
 
   while (opll->realstep > opll->oplltime)
   {
     opll->oplltime += opll->opllstep;
     opll->prev = opll->next;
-    opll->next = calc (opll);
+    opll->next = calc_generic (opll);
   }
 
   opll->oplltime -= opll->realstep;
-  opll->out = (e_int16) (((double) opll->next * (opll->opllstep - opll->oplltime)
-                          + (double) opll->prev * opll->oplltime) / opll->opllstep);
+  opll->out = (e_int16) RESAMPLE (opll, opll->prev, opll->next);
 
   return (e_int16) opll->out;
 }
+
+void
+OPLL_calc_block (OPLL * opll, e_int32 * buf, e_uint32 n)
+{
+#define KERNEL_ROW(ISA) {\
+    { calc_block_melodic##ISA, calc_resampled_block_melodic##ISA },\
+    { calc_block_melodic_masked##ISA, calc_resampled_block_melodic_masked##ISA },\
+    { calc_block_rhythm##ISA, calc_resampled_block_rhythm##ISA },\
+    { calc_block_rhythm_masked##ISA, calc_resampled_block_rhythm_masked##ISA },\
+    { calc_block_generic##ISA, calc_resampled_block_generic##ISA } }
+  static const calc_block_func kernels[KERNEL_ISAS][5][2] = {
+    KERNEL_ROW ()
+#ifdef EMU2413_ISA_VARIANTS
+    , KERNEL_ROW (_avx2), KERNEL_ROW (_avx512)
+#endif
+  };
+#undef KERNEL_ROW
+
+  /* The quality mode resamples from the chip rate in the kernel. */
+  TRACE_BEGIN (opll->quality ? "OPLL_calc_block resampled" : "OPLL_calc_block", n);
+  kernels[LOAD_KERNEL_ISA ()][select_kernel (opll)][opll->quality ? 1 : 0] (opll, buf, n);
+  TRACE_END (opll->quality ? "OPLL_calc_block resampled" : "OPLL_calc_block");
+}
 #endif
 
 e_uint32
@@ -1506,6 +1859,46 @@ OPLL_toggleMask (OPLL * opll, e_uint32 mask)
     return 0;
 }
 
+/* Channels and rhythm voices which are not finished, in the mask bits. */
+e_uint32
+OPLL_getSoundingMask (OPLL * opll)
+{
+  e_uint32 mask = 0;
+  e_int32 i;
+
+  if (!opll)
+    return 0;
+
+  for (i = 0; i < 9; i++)
+    if (opll->patch_number[i] <= 15 && CAR(opll,i)->eg_mode != FINISH)
+      mask |= OPLL_MASK_CH (i);
+
+  if (opll->patch_number[6] > 15 && CAR(opll,6)->eg_mode != FINISH)
+    mask |= OPLL_MASK_BD;
+  if (opll->patch_number[7] > 15)
+  {
+    if (MOD(opll,7)->eg_mode != FINISH)
+      mask |= OPLL_MASK_HH;
+    if (CAR(opll,7)->eg_mode != FINISH)
+      mask |= OPLL_MASK_SD;
+  }
+  if (opll->patch_number[8] > 15)
+  {
+    if (MOD(opll,8)->eg_mode != FINISH)
+      mask |= OPLL_MASK_TOM;
+    if (CAR(opll,8)->eg_mode != FINISH)
+      mask |= OPLL_MASK_CYM;
+  }
+
+  return mask;
+}
+
+e_uint32
+OPLL_getWriteCount (OPLL * opll)
+{
+  return opll ? opll->write_count : 0;
+}
+
 /****************************************************
 
                        I/O Ctrl
@@ -1521,6 +1914,7 @@ OPLL_writeReg (OPLL * opll, e_uint32 reg, e_uint32 data)
   data = data & 0xff;
   reg = reg & 0x3f;
   opll->reg[reg] = (e_uint8) data;
+  opll->write_count++;
 
   switch (reg)
   {
@@ -1534,9 +1928,9 @@ OPLL_writeReg (OPLL * opll, e_uint32 reg, e_uint32 data)
     {
       if (opll->patch_number[i] == 0)
       {
-        UPDATE_PG (MOD(opll,i));
+        UPDATE_PG (opll, MOD(opll,i));
         UPDATE_RKS (MOD(opll,i));
-        UPDATE_EG (MOD(opll,i));
+        UPDATE_EG (opll, MOD(opll,i));
       }
     }
     break;
@@ -1551,9 +1945,9 @@ OPLL_writeReg (OPLL * opll, e_uint32 reg, e_uint32 data)
     {
       if (opll->patch_number[i] == 0)
       {
-        UPDATE_PG (CAR(opll,i));
+        UPDATE_PG (opll, CAR(opll,i));
         UPDATE_RKS (CAR(opll,i));
-        UPDATE_EG (CAR(opll,i));
+        UPDATE_EG (opll, CAR(opll,i));
       }
     }
     break;
@@ -1592,7 +1986,7 @@ OPLL_writeReg (OPLL * opll, e_uint32 reg, e_uint32 data)
     {
       if (opll->patch_number[i] == 0)
       {
-        UPDATE_EG (MOD(opll,i));
+        UPDATE_EG (opll, MOD(opll,i));
       }
     }
     break;
@@ -1604,7 +1998,7 @@ OPLL_writeReg (OPLL * opll, e_uint32 reg, e_uint32 data)
     {
       if (opll->patch_number[i] == 0)
       {
-        UPDATE_EG(CAR(opll,i));
+        UPDATE_EG (opll, CAR(opll,i));
       }
     }
     break;
@@ -1616,7 +2010,7 @@ OPLL_writeReg (OPLL * opll, e_uint32 reg, e_uint32 data)
     {
       if (opll->patch_number[i] == 0)
       {
-        UPDATE_EG (MOD(opll,i));
+        UPDATE_EG (opll, MOD(opll,i));
       }
     }
     break;
@@ -1628,7 +2022,7 @@ OPLL_writeReg (OPLL * opll, e_uint32 reg, e_uint32 data)
     {
       if (opll->patch_number[i] == 0)
       {
-        UPDATE_EG (CAR(opll,i));
+        UPDATE_EG (opll, CAR(opll,i));
       }
     }
     break;
@@ -1660,12 +2054,12 @@ OPLL_writeReg (OPLL * opll, e_uint32 reg, e_uint32 data)
     }
     update_key_status (opll);
 
-    UPDATE_ALL (MOD(opll,6));
-    UPDATE_ALL (CAR(opll,6));
-    UPDATE_ALL (MOD(opll,7));
-    UPDATE_ALL (CAR(opll,7));
-    UPDATE_ALL (MOD(opll,8));
-    UPDATE_ALL (CAR(opll,8));
+    UPDATE_ALL (opll, MOD(opll,6));
+    UPDATE_ALL (opll, CAR(opll,6));
+    UPDATE_ALL (opll, MOD(opll,7));
+    UPDATE_ALL (opll, CAR(opll,7));
+    UPDATE_ALL (opll, MOD(opll,8));
+    UPDATE_ALL (opll, CAR(opll,8));
 
     break;
 
@@ -1683,8 +2077,8 @@ OPLL_writeReg (OPLL * opll, e_uint32 reg, e_uint32 data)
   case 0x18:
     ch = reg - 0x10;
     setFnumber (opll, ch, data + ((opll->reg[0x20 + ch] & 1) << 8));
-    UPDATE_ALL (MOD(opll,ch));
-    UPDATE_ALL (CAR(opll,ch));
+    UPDATE_ALL (opll, MOD(opll,ch));
+    UPDATE_ALL (opll, CAR(opll,ch));
     break;
 
   case 0x20:
@@ -1704,8 +2098,8 @@ OPLL_writeReg (OPLL * opll, e_uint32 reg, e_uint32 data)
       keyOn (opll, ch);
     else
       keyOff (opll, ch);
-    UPDATE_ALL (MOD(opll,ch));
-    UPDATE_ALL (CAR(opll,ch));
+    UPDATE_ALL (opll, MOD(opll,ch));
+    UPDATE_ALL (opll, CAR(opll,ch));
     update_key_status (opll);
     update_rhythm_mode (opll);
     break;
@@ -1740,8 +2134,8 @@ OPLL_writeReg (OPLL * opll, e_uint32 reg, e_uint32 data)
       setPatch (opll, reg - 0x30, i);
     }
     setVolume (opll, reg - 0x30, v << 2);
-    UPDATE_ALL (MOD(opll,reg - 0x30));
-    UPDATE_ALL (CAR(opll,reg - 0x30));
+    UPDATE_ALL (opll, MOD(opll,reg - 0x30));
+    UPDATE_ALL (opll, CAR(opll,reg - 0x30));
     break;
 
   default:
@@ -1767,74 +2161,12 @@ OPLL_set_pan (OPLL * opll, e_uint32 ch, e_uint32 pan)
   opll->pan[ch & 15] = pan & 3;
 }
 
-static void
-calc_stereo (OPLL * opll, e_int32 out[2])
-{
-  e_int32 b[4] = { 0, 0, 0, 0 };        /* Ignore, Right, Left, Center */
-  e_int32 r[4] = { 0, 0, 0, 0 };        /* Ignore, Right, Left, Center */
-  e_int32 i;
-
-  update_ampm (opll);
-  update_noise (opll);
-
-  for(i=0;i<18;i++)
-  {
-    calc_phase(&opll->slot[i],opll->lfo_pm);
-    calc_envelope(&opll->slot[i],opll->lfo_am);
-  }
-
-  for (i = 0; i < 6; i++)
-    if (!(opll->mask & OPLL_MASK_CH (i)) && (CAR(opll,i)->eg_mode != FINISH))
-      b[opll->pan[i]] += calc_slot_car (CAR(opll,i), calc_slot_mod (MOD(opll,i)));
-
-
-  if (opll->patch_number[6] <= 15)
-  {
-    if (!(opll->mask & OPLL_MASK_CH (6)) && (CAR(opll,6)->eg_mode != FINISH))
-      b[opll->pan[6]] += calc_slot_car (CAR(opll,6), calc_slot_mod (MOD(opll,6)));
-  }
-  else
-  {
-    if (!(opll->mask & OPLL_MASK_BD) && (CAR(opll,6)->eg_mode != FINISH))
-      r[opll->pan[9]] += calc_slot_car (CAR(opll,6), calc_slot_mod (MOD(opll,6)));
-  }
-
-  if (opll->patch_number[7] <= 15)
-  {
-    if (!(opll->mask & OPLL_MASK_CH (7)) && (CAR (opll,7)->eg_mode != FINISH))
-      b[opll->pan[7]] += calc_slot_car (CAR (opll,7), calc_slot_mod (MOD (opll,7)));
-  }
-  else
-  {
-    if (!(opll->mask & OPLL_MASK_HH) && (MOD (opll,7)->eg_mode != FINISH))
-      r[opll->pan[10]] += calc_slot_hat (MOD (opll,7), CAR(opll,8)->pgout, opll->noise_seed&1);
-    if (!(opll->mask & OPLL_MASK_SD) && (CAR (opll,7)->eg_mode != FINISH))
-      r[opll->pan[11]] -= calc_slot_snare (CAR (opll,7), opll->noise_seed&1);
-  }
-
-  if (opll->patch_number[8] <= 15)
-  {
-    if (!(opll->mask & OPLL_MASK_CH (8)) && (CAR (opll,8)->eg_mode != FINISH))
-      b[opll->pan[8]] += calc_slot_car (CAR (opll,8), calc_slot_mod (MOD (opll,8)));
-  }
-  else
-  {
-    if (!(opll->mask & OPLL_MASK_TOM) && (MOD (opll,8)->eg_mode != FINISH))
-      r[opll->pan[12]] += calc_slot_tom (MOD (opll,8));
-    if (!(opll->mask & OPLL_MASK_CYM) && (CAR (opll,8)->eg_mode != FINISH))
-      r[opll->pan[13]] -= calc_slot_cym (CAR (opll,8), MOD(opll,7)->pgout);
-  }
-
-  out[1] = (b[1] + b[3] + ((r[1] + r[3]) << 1)) <<3;
-  out[0] = (b[2] + b[3] + ((r[2] + r[3]) << 1)) <<3;
-}
-
 void
 OPLL_calc_stereo (OPLL * opll, e_int32 out[2])
 {
   if (!opll->quality)
   {
-    calc_stereo (opll, out);
+    calc_stereo_generic (opll, out);
     return;
   }
 
@@ -1843,13 +2175,33 @@ OPLL_calc_stereo (OPLL * opll, e_int32 out[2])
     opll->oplltime += opll->opllstep;
     opll->sprev[0] = opll->snext[0];
     opll->sprev[1] = opll->snext[1];
-    calc_stereo (opll, opll->snext);
+    calc_stereo_generic (opll, opll->snext);
   }
 
   opll->oplltime -= opll->realstep;
-  out[0] = (e_int16) (((double) opll->snext[0] * (opll->opllstep - opll->oplltime)
-                       + (double) opll->sprev[0] * opll->oplltime) / opll->opllstep);
-  out[1] = (e_int16) (((double) opll->snext[1] * (opll->opllstep - opll->oplltime)
-                       + (double) opll->sprev[1] * opll->oplltime) / opll->opllstep);
+  out[0] = (e_int16) RESAMPLE (opll, opll->sprev[0], opll->snext[0]);
+  out[1] = (e_int16) RESAMPLE (opll, opll->sprev[1], opll->snext[1]);
+}
+
+void
+OPLL_calc_stereo_block (OPLL * opll, e_int32 * buf, e_uint32 n)
+{
+#define KERNEL_ROW(ISA) {\
+    { calc_stereo_block_melodic##ISA, calc_resampled_stereo_block_melodic##ISA },\
+    { calc_stereo_block_melodic_masked##ISA, calc_resampled_stereo_block_melodic_masked##ISA },\
+    { calc_stereo_block_rhythm##ISA, calc_resampled_stereo_block_rhythm##ISA },\
+    { calc_stereo_block_rhythm_masked##ISA, calc_resampled_stereo_block_rhythm_masked##ISA },\
+    { calc_stereo_block_generic##ISA, calc_resampled_stereo_block_generic##ISA } }
+  static const calc_block_func kernels[KERNEL_ISAS][5][2] = {
+    KERNEL_ROW ()
+#ifdef EMU2413_ISA_VARIANTS
+    , KERNEL_ROW (_avx2), KERNEL_ROW (_avx512)
+#endif
+  };
+#undef KERNEL_ROW
+
+  TRACE_BEGIN (opll->quality ? "OPLL_calc_stereo_block resampled" : "OPLL_calc_stereo_block", n);
+  kernels[LOAD_KERNEL_ISA ()][select_kernel (opll)][opll->quality ? 1 : 0] (opll, buf, n);
+  TRACE_END (opll->quality ? "OPLL_calc_stereo_block resampled" : "OPLL_calc_stereo_block");
 }
 #endif /* EMU2413_COMPACTION */
@@ -18,6 +18,7 @@ extern "C" {
 #define PI 3.14159265358979323846
 
 enum OPLL_TONE_ENUM {OPLL_2413_TONE=0, OPLL_VRC7_TONE=1, OPLL_281B_TONE=2} ;
+enum OPLL_ISA_ENUM {OPLL_ISA_GENERIC=0, OPLL_ISA_AVX2=1, OPLL_ISA_AVX512=2} ;
 
 /* voice data */
 typedef struct __OPLL_PATCH {
@@ -109,6 +110,17 @@ typedef struct __OPLL {
 
   e_uint32 mask ;
 
+  /* Rate dependent tables (kept by OPLL_reset) */
+  e_uint32 rate ;               /* Output rate */
+  e_uint32 table_rate ;         /* Rate of the tables (clk/72 in the quality mode) */
+  e_uint32 pm_dphase ;
+  e_uint32 am_dphase ;
+  e_uint32 dphaseARTable[16][16] ;
+  e_uint32 dphaseDRTable[16][16] ;
+
+  e_uint32 cull_level ;         /* Release culling level in EG steps, 0 = off (kept by OPLL_reset) */
+  e_uint32 write_count ;        /* Register writes since OPLL_new (kept by OPLL_reset) */
+
 } OPLL ;
 
 /* Create Object */
@@ -117,10 +129,12 @@ EMU2413_API void OPLL_delete(OPLL *) ;
 
 /* Setup */
 EMU2413_API void OPLL_reset(OPLL *) ;
+EMU2413_API void OPLL_panic(OPLL *) ;
 EMU2413_API void OPLL_reset_patch(OPLL *, e_int32) ;
 EMU2413_API void OPLL_set_rate(OPLL *opll, e_uint32 r) ;
 EMU2413_API void OPLL_set_quality(OPLL *opll, e_uint32 q) ;
 EMU2413_API void OPLL_set_pan(OPLL *, e_uint32 ch, e_uint32 pan);
+EMU2413_API void OPLL_set_cull_level(OPLL *, e_uint32 db);
 
 /* Port/Register access */
 EMU2413_API void OPLL_writeIO(OPLL *, e_uint32 reg, e_uint32 val) ;
@@ -129,6 +143,13 @@ EMU2413_API void OPLL_writeReg(OPLL *, e_uint32 reg, e_uint32 val) ;
 /* Synthsize */
 EMU2413_API e_int16 OPLL_calc(OPLL *) ;
 EMU2413_API void OPLL_calc_stereo(OPLL *, e_int32 out[2]) ;
+/* Block of n samples (n L/R pairs for stereo). The kernel specialized for
+   the rhythm mode, the mask and the quality is chosen once per call. */
+EMU2413_API void OPLL_calc_block(OPLL *, e_int32 *buf, e_uint32 n) ;
+EMU2413_API void OPLL_calc_stereo_block(OPLL *, e_int32 *buf, e_uint32 n) ;
+/* Instruction set variant of the block kernels (global) */
+EMU2413_API void OPLL_set_isa(e_uint32 isa) ;
+EMU2413_API e_uint32 OPLL_get_isa(void) ;
 
 /* Misc */
 EMU2413_API void OPLL_setPatch(OPLL *, const e_uint8 *dump) ;
@@ -142,6 +163,10 @@ EMU2413_API void OPLL_getDefaultPatch(e_int32 type, e_int32 num, OPLL_PATCH *) ;
 /* Channel Mask */
 EMU2413_API e_uint32 OPLL_setMask(OPLL *, e_uint32 mask) ;
 EMU2413_API e_uint32 OPLL_toggleMask(OPLL *, e_uint32 mask) ;
+EMU2413_API e_uint32 OPLL_getSoundingMask(OPLL *) ;
+
+/* Statistics */
+EMU2413_API e_uint32 OPLL_getWriteCount(OPLL *) ;
 
 #define dump2patch OPLL_dump2patch
 
@@ -0,0 +1,111 @@
+#include "FakeHost.h"
+#include <cstring>
+
+FakeHost* FakeHost::current_ = 0;
+
+#pragma mark
+#pragma mark Creation and destruction
+
+FakeHost::FakeHost(float sampleRate, int blockSize)
+:   effect_(0),
+    sampleRate_(sampleRate),
+    blockSize_(blockSize),
+    processLevel_(kVstProcessLevelRealtime),
+    ioChanges_(0),
+    floatScratch_(blockSize),
+    doubleScratch_(blockSize)
+{
+    std::memset(midi_, 0, sizeof midi_);
+    std::memset(&events_, 0, sizeof events_);
+    current_ = this;
+    effect_ = static_cast<AudioEffectX*>(createEffectInstance(Callback));
+    effect_->setSampleRate(sampleRate);
+    effect_->setBlockSize(blockSize);
+    effect_->resume();
+}
+
+FakeHost::~FakeHost() {
+    effect_->suspend();
+    delete effect_;
+    if (current_ == this) current_ = 0;
+}
+
+#pragma mark
+#pragma mark Plug-in access
+
+int FakeHost::GetParameterCount() {
+    return effect_->getAeffect()->numParams;
+}
+
+int FakeHost::GetInitialDelay() {
+    return effect_->getAeffect()->initialDelay;
+}
+
+int FakeHost::FindParameter(const char* name) {
+    for (int i = 0; i < GetParameterCount(); i++) {
+        char text[kVstMaxParamStrLen + 1] = { 0 };
+        effect_->getParameterName(i, text);
+        if (std::strcmp(text, name) == 0) return i;
+    }
+    return -1;
+}
+
+void FakeHost::Restart() {
+    effect_->suspend();
+    effect_->resume();
+    ioChanges_ = 0;
+}
+
+#pragma mark
+#pragma mark Processing
+
+void FakeHost::QueueMidi(int frame, int status, int data1, int data2) {
+    if (events_.numEvents == kMaxEvents) return;
+    VstMidiEvent& midi = midi_[events_.numEvents];
+    midi.type = kVstMidiType;
+    midi.byteSize = sizeof midi;
+    midi.deltaFrames = frame;
+    midi.midiData[0] = static_cast<char>(status);
+    midi.midiData[1] = static_cast<char>(data1);
+    midi.midiData[2] = static_cast<char>(data2);
+    events_.events[events_.numEvents++] = reinterpret_cast<VstEvent*>(&midi);
+}
+
+void FakeHost::SendEvents() {
+    if (events_.numEvents == 0) return;
+    effect_->processEvents(reinterpret_cast<VstEvents*>(&events_));
+    events_.numEvents = 0;
+}
+
+void FakeHost::Process(float* output, int length) {
+    float* outputs[2] = { output, &floatScratch_[0] };
+    effect_->processReplacing(0, outputs, length);
+}
+
+void FakeHost::Process(double* output, int length) {
+    double* outputs[2] = { output, &doubleScratch_[0] };
+    effect_->processDoubleReplacing(0, outputs, length);
+}
+
+#pragma mark
+#pragma mark Host callback
+
+VstIntPtr FakeHost::Callback(AEffect* effect, VstInt32 opcode, VstInt32 index, VstIntPtr value, void* ptr, float opt) {
+    FakeHost* host = current_;
+    switch (opcode) {
+        case audioMasterVersion:
+            return 2400;
+        case audioMasterIOChanged:
+            if (host) host->ioChanges_++;
+            return 1;
+        case audioMasterGetSampleRate:
+            return host ? static_cast<VstIntPtr>(host->sampleRate_) : 0;
+        case audioMasterGetBlockSize:
+            return host ? host->blockSize_ : 0;
+        case audioMasterGetCurrentProcessLevel:
+            return host ? host->processLevel_ : kVstProcessLevelUnknown;
+        default:
+            // No time info, automation or anything else.
+            return 0;
+    }
+}
@@ -0,0 +1,68 @@
+#ifndef __FakeHost__
+#define __FakeHost__
+
+#include "audioeffectx.h"
+#include <vector>
+
+// Minimal VST 2.4 host for the plug-in tests.
+//
+// It creates the plug-in the test is linked with (createEffectInstance),
+// answers its host callbacks and calls it the way a host does, through
+// the C++ interface of the SDK instead of the dispatcher. One host at a
+// time; the callbacks go to the latest one.
+class FakeHost {
+public:
+    static const int kMaxEvents = 256;
+    
+    // Creates, sets up and resumes the plug-in.
+    FakeHost(float sampleRate, int blockSize);
+    ~FakeHost();
+    
+    AudioEffectX& GetEffect() { return *effect_; }
+    int GetParameterCount();
+    // Delay of the output reported with setInitialDelay.
+    int GetInitialDelay();
+    // Index of the parameter with the name, or -1.
+    int FindParameter(const char* name);
+    
+    // Answer to audioMasterGetCurrentProcessLevel (realtime by default).
+    void SetProcessLevel(VstInt32 level) { processLevel_ = level; }
+    
+    // Suspends and resumes the plug-in, as hosts do on ioChanged.
+    void Restart();
+    // Number of the ioChanged requests not followed by Restart yet.
+    int GetIoChanges() { return ioChanges_; }
+    
+    // Queues a MIDI event at the frame of the next block.
+    void QueueMidi(int frame, int status, int data1, int data2);
+    // Sends the queued events (processEvents); does nothing without them.
+    void SendEvents();
+    // Processes a block of up to the block size.
+    void Process(float* output, int length);
+    void Process(double* output, int length);
+
+private:
+    // VstEvents with room for all the events.
+    struct Events {
+        VstInt32 numEvents;
+        VstIntPtr reserved;
+        VstEvent* events[kMaxEvents];
+    };
+    
+    static FakeHost* current_;
+    
+    AudioEffectX* effect_;
+    float sampleRate_;
+    int blockSize_;
+    VstInt32 processLevel_;
+    int ioChanges_;
+    
+    VstMidiEvent midi_[kMaxEvents];
+    Events events_;
+    std::vector<float> floatScratch_;
+    std::vector<double> doubleScratch_;
+    
+    static VstIntPtr Callback(AEffect* effect, VstInt32 opcode, VstInt32 index, VstIntPtr value, void* ptr, float opt);
+};
+
+#endif
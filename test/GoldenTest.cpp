@@ -0,0 +1,756 @@
+// Golden-output regression test of the emulator and the drivers.
+//
+// usage: vst2413-golden [--golden file] [--record] [--filter text]
+//                       [--dump dir] [--reference dir] [--tolerance n]
+//                       [--trace file]
+//
+// Each scenario drives the emulator or a driver through a scripted
+// register/MIDI sequence and hashes the raw output; the format scenarios
+// hash the bits of the SampleFormat kernel outputs. The hashes are checked
+// against the golden file (test/golden.txt), which --record rewrites. The
+// scenarios are run with every kernel variant the CPU supports, and the
+// emulator scenarios both per sample and in blocks.
+//
+// The file also has a hash of every 4096-sample segment, so a mismatch
+// tells where the output starts to differ. --dump writes the raw output
+// (32-bit native-endian integers) of each scenario to a directory; a
+// later build run with --reference compares against it sample by sample
+// and passes while the difference stays within --tolerance (0 by default).
+//
+// --trace writes the timeline of the scenarios as a Chrome trace (with
+// VST2413_TRACE; see Trace.h).
+//
+// Built as vst2413-golden by CMakeLists.txt.
+
+#include "CpuDispatch.h"
+#include "RhythmDriver.h"
+#include "SampleFormat.h"
+#include "SynthDriver.h"
+#include "Trace.h"
+#include "emu2413/emu2413.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace {
+    typedef std::vector<int> Output;
+    
+    const unsigned int kMasterClock = 3579545;
+    const unsigned int kSampleRate = 44100;
+    const int kSegmentLength = 4096;
+    // Maximum number of the differences listed per scenario.
+    const int kMaxListedDiffs = 8;
+
+#pragma mark Hashing
+
+    // FNV-1a over the little-endian bytes of the samples.
+    template <typename T> T Hash(const int* samples, int length, T basis, T prime) {
+        T hash = basis;
+        for (int i = 0; i < length; i++) {
+            unsigned int value = static_cast<unsigned int>(samples[i]);
+            for (int b = 0; b < 4; b++) {
+                hash ^= (value >> (b * 8)) & 0xff;
+                hash *= prime;
+            }
+        }
+        return hash;
+    }
+    
+    unsigned long long Hash64(const int* samples, int length) {
+        return Hash<unsigned long long>(samples, length, 14695981039346656037ULL, 1099511628211ULL);
+    }
+    
+    unsigned int Hash32(const int* samples, int length) {
+        return Hash<unsigned int>(samples, length, 2166136261U, 16777619U);
+    }
+    
+    struct Signature {
+        int length_;
+        std::string hash_;
+        std::vector<std::string> segments_;
+    };
+    
+    Signature Sign(const Output& output) {
+        Signature signature;
+        const int* samples = output.empty() ? 0 : &output[0];
+        int length = static_cast<int>(output.size());
+        char text[32];
+        signature.length_ = length;
+        std::snprintf(text, sizeof text, "%016llx", Hash64(samples, length));
+        signature.hash_ = text;
+        for (int i = 0; i < length; i += kSegmentLength) {
+            int count = length - i < kSegmentLength ? length - i : kSegmentLength;
+            std::snprintf(text, sizeof text, "%08x", Hash32(samples + i, count));
+            signature.segments_.push_back(text);
+        }
+        return signature;
+    }
+
+#pragma mark
+#pragma mark Emulator scenarios
+
+    // A chip with the output appended to a buffer, per sample or in blocks
+    // of varying length.
+    class Emu {
+    public:
+        Emu(Output& output, int quality, bool blocks, unsigned int sampleRate = kSampleRate)
+        :   opll_(OPLL_new(kMasterClock, sampleRate)), output_(output), blocks_(blocks), stereo_(false), blockIndex_(0)
+        {
+            OPLL_set_quality(opll_, quality);
+        }
+        ~Emu() { OPLL_delete(opll_); }
+        
+        OPLL* Get() { return opll_; }
+        void SetStereo(bool stereo) { stereo_ = stereo; }
+        void Write(int reg, int value) { OPLL_writeReg(opll_, reg, value); }
+        
+        void Render(int length) {
+            static const int kBlockLengths[] = { 1, 7, 64, 333, 256, 2 };
+            int channels = stereo_ ? 2 : 1;
+            size_t offset = output_.size();
+            output_.resize(offset + length * channels);
+            e_int32* buffer = reinterpret_cast<e_int32*>(&output_[offset]);
+            if (!blocks_) {
+                for (int i = 0; i < length; i++) {
+                    if (stereo_) {
+                        OPLL_calc_stereo(opll_, buffer + i * 2);
+                    } else {
+                        buffer[i] = OPLL_calc(opll_);
+                    }
+                }
+                return;
+            }
+            for (int i = 0; i < length;) {
+                int count = kBlockLengths[blockIndex_++ % 6];
+                if (count > length - i) count = length - i;
+                if (stereo_) {
+                    OPLL_calc_stereo_block(opll_, buffer + i * 2, count);
+                } else {
+                    OPLL_calc_block(opll_, buffer + i, count);
+                }
+                i += count;
+            }
+        }
+    
+    private:
+        OPLL* opll_;
+        Output& output_;
+        bool blocks_;
+        bool stereo_;
+        int blockIndex_;
+    };
+    
+    // Plays notes across the octaves, so that the key scaling is covered,
+    // at two volumes and with and without the sustain flag.
+    void PlayScale(Emu& emu, int channel) {
+        static const int kFNumbers[] = { 0x0ab, 0x120, 0x181, 0x1c8 };
+        for (int i = 0; i < 4; i++) {
+            int block = i * 2 + 1;
+            int fnum = kFNumbers[i];
+            emu.Write(0x30 + channel, (emu.Get()->reg[0x30 + channel] & 0xf0) | (i & 1 ? 8 : 0));
+            emu.Write(0x10 + channel, fnum & 0xff);
+            emu.Write(0x20 + channel, 0x10 | (i & 2 ? 0x20 : 0) | (block << 1) | (fnum >> 8));
+            emu.Render(4000);
+            emu.Write(0x20 + channel, (i & 2 ? 0x20 : 0) | (block << 1) | (fnum >> 8));
+            emu.Render(2000);
+        }
+    }
+    
+    // Patch 0 is the user patch.
+    void RenderPatch(Output& output, int quality, bool blocks, int patch) {
+        static const unsigned char kUser[8] = { 0x33, 0x01, 0x09, 0x0e, 0x94, 0x90, 0x40, 0x01 };
+        Emu emu(output, quality, blocks);
+        for (int i = 0; i < 8; i++) emu.Write(i, kUser[i]);
+        emu.Write(0x30, patch << 4);
+        PlayScale(emu, 0);
+    }
+    
+    // User patches covering the register fields: AM, PM, EG type, KSR and
+    // MUL; KSL and TL; the waveforms and the feedback; the envelope rates.
+    void RenderUserPatch(Output& output, int quality, bool blocks, int index) {
+        static const unsigned char kUser[8][8] = {
+            { 0x81, 0x41, 0x00, 0x00, 0xf0, 0xf0, 0x00, 0x00 },
+            { 0x41, 0x81, 0x40, 0x41, 0xa3, 0xc4, 0x25, 0x36 },
+            { 0x31, 0x12, 0x80, 0x82, 0x75, 0x86, 0x44, 0x55 },
+            { 0x2f, 0x3a, 0xd0, 0xc7, 0xff, 0xff, 0x0f, 0x0f },
+            { 0xc4, 0xe8, 0x3f, 0x1c, 0x12, 0x34, 0xf8, 0x7a },
+            { 0x01, 0x01, 0x00, 0x0b, 0x88, 0x88, 0x88, 0x88 },
+            { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff },
+            { 0x63, 0x71, 0x1a, 0x05, 0x5d, 0xb2, 0x93, 0xe4 }
+        };
+        Emu emu(output, quality, blocks);
+        for (int i = 0; i < 8; i++) emu.Write(i, kUser[index][i]);
+        // Two channels, so that the LFOs run against each other.
+        emu.Write(0x31, 0x04);
+        emu.Write(0x11, 0x5a);
+        emu.Write(0x21, 0x19);
+        PlayScale(emu, 0);
+        // The patch changed while the notes sound.
+        for (int i = 0; i < 8; i++) emu.Write(i, kUser[(index + 3) & 7][i]);
+        emu.Render(3000);
+        emu.Write(0x21, 0x09);
+        emu.Render(3000);
+    }
+    
+    // Each drum alone (bits 0-4), then all of them with the melodic channels.
+    void RenderRhythmAt(Output& output, int quality, bool blocks, int drum, unsigned int sampleRate) {
+        Emu emu(output, quality, blocks, sampleRate);
+        emu.Write(0x16, 0x20);
+        emu.Write(0x17, 0x50);
+        emu.Write(0x18, 0xc0);
+        emu.Write(0x26, 0x05);
+        emu.Write(0x27, 0x05);
+        emu.Write(0x28, 0x01);
+        emu.Write(0x36, 0x02);
+        emu.Write(0x37, 0x13);
+        emu.Write(0x38, 0x31);
+        int bits = drum < 5 ? 1 << drum : 0x1f;
+        if (drum >= 5) {
+            for (int ch = 0; ch < 6; ch++) {
+                emu.Write(0x30 + ch, ((ch * 3 + 1) & 15) << 4 | ch);
+                emu.Write(0x10 + ch, 0x80 + ch * 11);
+                emu.Write(0x20 + ch, 0x14 + ch);
+            }
+        }
+        for (int i = 0; i < 6; i++) {
+            emu.Write(0x0e, 0x20 | bits);
+            emu.Render(3000 + i * 500);
+            emu.Write(0x0e, 0x20);
+            emu.Render(1500);
+            // Change the pitches of the drums between the hits.
+            emu.Write(0x17, 0x50 + i * 16);
+            emu.Write(0x28, 0x01 + (i & 3) * 2);
+        }
+        // Back to the melodic mode while the drums release.
+        emu.Write(0x0e, 0x00);
+        emu.Render(4000);
+    }
+    
+    void RenderRhythm(Output& output, int quality, bool blocks, int drum) {
+        RenderRhythmAt(output, quality, blocks, drum, kSampleRate);
+    }
+    
+    void RenderRhythm96k(Output& output, int quality, bool blocks, int drum) {
+        RenderRhythmAt(output, quality, blocks, drum, 96000);
+    }
+    
+    // The stereo output with panned channels and the channel mask.
+    void RenderStereo(Output& output, int quality, bool blocks, int) {
+        Emu emu(output, quality, blocks);
+        emu.SetStereo(true);
+        for (int ch = 0; ch < 9; ch++) {
+            OPLL_set_pan(emu.Get(), ch, ch % 4);
+            emu.Write(0x30 + ch, ((ch + 1) << 4) | ch);
+            emu.Write(0x10 + ch, 0x60 + ch * 19);
+            emu.Write(0x20 + ch, 0x14 + (ch & 3) * 2);
+        }
+        emu.Render(5000);
+        OPLL_setMask(emu.Get(), OPLL_MASK_CH(1) | OPLL_MASK_CH(4));
+        emu.Render(5000);
+        emu.Write(0x0e, 0x3f);
+        OPLL_set_pan(emu.Get(), 9, 1);
+        OPLL_set_pan(emu.Get(), 12, 2);
+        emu.Render(5000);
+        OPLL_setMask(emu.Get(), OPLL_MASK_SD);
+        emu.Render(5000);
+        OPLL_setMask(emu.Get(), 0);
+        for (int ch = 0; ch < 9; ch++) emu.Write(0x20 + ch, 0x04);
+        emu.Render(5000);
+    }
+
+#pragma mark
+#pragma mark Driver scenarios
+
+    // Renders the raw output of a driver in blocks of varying length.
+    template <typename Driver> void RenderDriver(Driver& driver, Output& output, int length) {
+        static const int kBlockLengths[] = { 128, 1, 300, 64, 5, 512 };
+        size_t offset = output.size();
+        output.resize(offset + length);
+        for (int i = 0; i < length;) {
+            int count = kBlockLengths[(offset + i) % 6];
+            if (count > length - i) count = length - i;
+            driver.RenderRaw(&output[offset + i], count);
+            i += count;
+        }
+    }
+    
+    // The single-patch synth (Vst2413s): the user patch parameters, glide,
+    // vibrato and the pitch wheel.
+    void RenderSynth(Output& output, int tier, bool, int) {
+        SynthDriver driver(kSampleRate);
+        driver.Prepare();
+        driver.SetQualityTier(static_cast<QualityGovernor::Tier>(tier));
+        for (int i = 0; i <= SynthDriver::kParameterVIB1; i++) {
+            driver.SetParameter(static_cast<SynthDriver::ParameterID>(i), ((i * 7) % 11) * 0.1f);
+        }
+        driver.SetParameter(SynthDriver::kParameterGlide, 0.3f);
+        driver.SetParameter(SynthDriver::kParameterVibratoDepth, 0.5f);
+        driver.SetParameter(SynthDriver::kParameterVibratoRate, 0.4f);
+        driver.SetParameter(SynthDriver::kParameterVibratoDelay, 0.2f);
+        static const int kNotes[] = { 48, 55, 60, 64, 67, 72, 62, 53 };
+        for (int i = 0; i < 8; i++) {
+            driver.KeyOn(kNotes[i], 0.3f + i * 0.09f);
+            RenderDriver(driver, output, 3000);
+            driver.SetPitchWheel((i & 3) * 0.5f - 0.75f);
+            RenderDriver(driver, output, 2000);
+            if (i & 1) driver.KeyOff(kNotes[i - 1]);
+            driver.SetParameter(SynthDriver::kParameterAR0, i * 0.125f);
+        }
+        driver.SetPitchWheel(0);
+        driver.KeyOffAll();
+        RenderDriver(driver, output, 8000);
+    }
+    
+    // The preset synth (Vst2413p): a chord with every program.
+    void RenderPrograms(Output& output, int tier, bool, int) {
+        SynthDriver driver(kSampleRate);
+        driver.Prepare();
+        driver.SetQualityTier(static_cast<QualityGovernor::Tier>(tier));
+        for (int i = 0; i < SynthDriver::kPrograms; i++) {
+            driver.SetProgram(static_cast<SynthDriver::ProgramID>(i));
+            driver.KeyOn(48 + i, 0.8f);
+            driver.KeyOn(52 + i, 0.6f);
+            driver.KeyOn(55 + i, 0.4f);
+            RenderDriver(driver, output, 4000);
+            driver.KeyOffAll();
+            RenderDriver(driver, output, 1500);
+        }
+    }
+    
+    // Multitimbral parts over several chips with the drums on the drum part.
+    void RenderMultitimbral(Output& output, int tier, bool, int) {
+        SynthDriver driver(kSampleRate);
+        driver.Prepare();
+        driver.SetQualityTier(static_cast<QualityGovernor::Tier>(tier));
+        driver.SetChipCount(3);
+        driver.SetRhythmMode(true);
+        driver.SetDrumKeyRange(35, 81);
+        for (int part = 0; part < 8; part++) {
+            driver.SetPartProgram(part, static_cast<SynthDriver::ProgramID>(part * 2 + 1));
+        }
+        for (int step = 0; step < 16; step++) {
+            int part = step & 7;
+            driver.KeyOn(part, 40 + step * 3, 0.5f + (step & 3) * 0.1f);
+            driver.KeyOn(part, 47 + step * 3, 0.5f);
+            driver.KeyOn(SynthDriver::kDrumPart, (step & 1) ? 38 : 36, 0.9f);
+            if (step % 4 == 2) driver.KeyOn(SynthDriver::kDrumPart, 42 + (step & 4), 0.7f);
+            driver.SetPitchWheel(part, (step & 1) ? 0.25f : -0.25f);
+            RenderDriver(driver, output, 2500);
+            if (step >= 4) driver.KeyOffPart((step - 4) & 7);
+        }
+        driver.KeyOffAll();
+        RenderDriver(driver, output, 8000);
+    }
+    
+    // The drum machine (Vst2413r): hits on the whole GM drum map.
+    void RenderDrums(Output& output, int tier, bool cached, int) {
+        RhythmDriver driver(kSampleRate);
+        driver.SetCachedMode(cached);
+        driver.Prepare();
+        driver.SetQualityTier(static_cast<QualityGovernor::Tier>(tier));
+        for (int step = 0; step < 32; step++) {
+            driver.KeyOn(35 + (step * 5) % 47, 0.2f + (step % 5) * 0.2f);
+            if (step & 1) driver.KeyOn(42, 0.5f);
+            if (step % 8 == 4) driver.KeyOn(38, 1.0f);
+            RenderDriver(driver, output, 1800 + (step & 3) * 200);
+            if (step % 8 == 7) driver.KeyOffAll();
+        }
+        RenderDriver(driver, output, 10000);
+    }
+
+#pragma mark
+#pragma mark Sample format scenarios
+
+    enum FormatKernel {
+        kFormatInt16ToFloat,
+        kFormatInt16ToDouble,
+        kFormatInt32ToFloat,
+        kFormatInt32ToDouble,
+        kFormatAccumulate,
+        kFormatFanOut,
+        kFormatFanOutDouble,
+        kFormatInterleave,
+        kFormatDeinterleave,
+        kFormatKernels
+    };
+    
+    // Appends the bits of the samples to the output.
+    template <typename T> void AppendBits(Output& output, const T* samples, int length) {
+        size_t offset = output.size();
+        output.resize(offset + length * sizeof(T) / sizeof(int));
+        if (length > 0) std::memcpy(&output[offset], samples, length * sizeof(T));
+    }
+    
+    // A SampleFormat kernel on a noise signal, at lengths and offsets that
+    // cover the vector loops, their tails and the unaligned buffers.
+    void RenderFormat(Output& output, int kernel, bool, int) {
+        static const int kLengths[] = { 0, 1, 3, 4, 7, 8, 15, 16, 17, 31, 33, 64, 255 };
+        const int kMaxChannels = 3;
+        const int kSize = 256 + 4;
+        
+        unsigned int seed = 12345;
+        std::vector<short> shorts(kSize * kMaxChannels);
+        std::vector<int> ints(kSize * kMaxChannels);
+        std::vector<float> floats(kSize * kMaxChannels);
+        for (int i = 0; i < kSize * kMaxChannels; i++) {
+            seed = seed * 1664525 + 1013904223;
+            shorts[i] = static_cast<short>(seed >> 16);
+            ints[i] = static_cast<int>(seed) >> 13;
+            floats[i] = ints[i] * (1.0f / 65536);
+        }
+        
+        std::vector<float> floatOut(kSize * kMaxChannels);
+        std::vector<double> doubleOut(kSize * kMaxChannels);
+        std::vector<int> intOut(kSize);
+        for (size_t n = 0; n < sizeof kLengths / sizeof kLengths[0]; n++) {
+            int length = kLengths[n];
+            for (int offset = 0; offset < 4; offset++) {
+                int channels = 1 + (offset % kMaxChannels);
+                float* floatChannels[kMaxChannels];
+                double* doubleChannels[kMaxChannels];
+                const float* inputChannels[kMaxChannels];
+                for (int ch = 0; ch < kMaxChannels; ch++) {
+                    floatChannels[ch] = &floatOut[ch * kSize + offset];
+                    doubleChannels[ch] = &doubleOut[ch * kSize + offset];
+                    inputChannels[ch] = &floats[ch * kSize + offset];
+                }
+                switch (kernel) {
+                    case kFormatInt16ToFloat:
+                        SampleFormat::Int16ToFloat(&shorts[offset], &floatOut[offset], length, 1.0f / 32768);
+                        AppendBits(output, &floatOut[offset], length);
+                        break;
+                    case kFormatInt16ToDouble:
+                        SampleFormat::Int16ToDouble(&shorts[offset], &doubleOut[offset], length, 1.0 / 32768);
+                        AppendBits(output, &doubleOut[offset], length);
+                        break;
+                    case kFormatInt32ToFloat:
+                        SampleFormat::Int32ToFloat(&ints[offset], &floatOut[offset], length, 4.0f / 32767);
+                        AppendBits(output, &floatOut[offset], length);
+                        break;
+                    case kFormatInt32ToDouble:
+                        SampleFormat::Int32ToDouble(&ints[offset], &doubleOut[offset], length, 4.0 / 32767);
+                        AppendBits(output, &doubleOut[offset], length);
+                        break;
+                    case kFormatAccumulate:
+                        for (int i = 0; i < length; i++) intOut[i] = ints[kSize + i];
+                        SampleFormat::Accumulate(&ints[offset], &intOut[0], length);
+                        AppendBits(output, &intOut[0], length);
+                        break;
+                    case kFormatFanOut:
+                        // The first channel is the input itself, as in the plug-ins.
+                        for (int i = 0; i < length; i++) floatChannels[0][i] = floats[offset + i];
+                        SampleFormat::FanOut(floatChannels[0], floatChannels, channels, length);
+                        for (int ch = 0; ch < channels; ch++) AppendBits(output, floatChannels[ch], length);
+                        break;
+                    case kFormatFanOutDouble:
+                        for (int i = 0; i < length; i++) doubleChannels[0][i] = ints[offset + i];
+                        SampleFormat::FanOut(doubleChannels[0], doubleChannels, channels, length);
+                        for (int ch = 0; ch < channels; ch++) AppendBits(output, doubleChannels[ch], length);
+                        break;
+                    case kFormatInterleave:
+                        SampleFormat::Interleave(inputChannels, &floatOut[offset], channels, length);
+                        AppendBits(output, &floatOut[offset], length * channels);
+                        break;
+                    case kFormatDeinterleave:
+                        SampleFormat::Deinterleave(&floats[offset], floatChannels, channels, length);
+                        for (int ch = 0; ch < channels; ch++) AppendBits(output, floatChannels[ch], length);
+                        break;
+                }
+            }
+        }
+    }
+
+#pragma mark
+#pragma mark Scenario list
+
+    typedef void (*RenderFunction)(Output& output, int mode, bool option, int arg);
+    
+    struct Scenario {
+        std::string name_;
+        RenderFunction render_;
+        int mode_;          // quality of the emulator, tier of the driver or format kernel
+        bool option_;       // cached mode of the rhythm driver
+        int arg_;
+        bool emulator_;     // rendered both per sample and in blocks
+    };
+    
+    void Add(std::vector<Scenario>& list, const std::string& name, RenderFunction render, int mode, bool option, int arg, bool emulator) {
+        Scenario scenario = { name, render, mode, option, arg, emulator };
+        list.push_back(scenario);
+    }
+    
+    std::vector<Scenario> ListScenarios() {
+        static const char* kDrums[] = { "hihat", "cymbal", "tom", "snare", "kick", "all" };
+        static const char* kFormatKernelNames[] = {
+            "int16_float", "int16_double", "int32_float", "int32_double", "accumulate",
+            "fanout", "fanout_double", "interleave", "deinterleave"
+        };
+        std::vector<Scenario> list;
+        char name[64];
+        for (int q = 0; q < 2; q++) {
+            for (int i = 0; i < 16; i++) {
+                std::snprintf(name, sizeof name, "emu/patch%02d/q%d", i, q);
+                Add(list, name, RenderPatch, q, false, i, true);
+            }
+            for (int i = 0; i < 8; i++) {
+                std::snprintf(name, sizeof name, "emu/user%d/q%d", i, q);
+                Add(list, name, RenderUserPatch, q, false, i, true);
+            }
+            for (int i = 0; i < 6; i++) {
+                std::snprintf(name, sizeof name, "emu/rhythm_%s/q%d", kDrums[i], q);
+                Add(list, name, RenderRhythm, q, false, i, true);
+            }
+            std::snprintf(name, sizeof name, "emu/rhythm_all_96k/q%d", q);
+            Add(list, name, RenderRhythm96k, q, false, 5, true);
+            std::snprintf(name, sizeof name, "emu/stereo/q%d", q);
+            Add(list, name, RenderStereo, q, false, 0, true);
+        }
+        for (int tier = 0; tier < QualityGovernor::kTiers; tier++) {
+            std::snprintf(name, sizeof name, "synth/tier%d", tier);
+            Add(list, name, RenderSynth, tier, false, 0, false);
+            std::snprintf(name, sizeof name, "poly/programs/tier%d", tier);
+            Add(list, name, RenderPrograms, tier, false, 0, false);
+            std::snprintf(name, sizeof name, "poly/multitimbral/tier%d", tier);
+            Add(list, name, RenderMultitimbral, tier, false, 0, false);
+            std::snprintf(name, sizeof name, "rhythm/chip/tier%d", tier);
+            Add(list, name, RenderDrums, tier, false, 0, false);
+            std::snprintf(name, sizeof name, "rhythm/cached/tier%d", tier);
+            Add(list, name, RenderDrums, tier, true, 0, false);
+        }
+        for (int i = 0; i < kFormatKernels; i++) {
+            std::snprintf(name, sizeof name, "format/%s", kFormatKernelNames[i]);
+            Add(list, name, RenderFormat, i, false, 0, false);
+        }
+        return list;
+    }
+
+#pragma mark
+#pragma mark Golden file
+
+    typedef std::map<std::string, Signature> GoldenMap;
+    
+    // One line per scenario: name, length, hash and the segment hashes.
+    bool ReadGolden(const char* path, GoldenMap& golden) {
+        FILE* file = std::fopen(path, "r");
+        if (!file) return false;
+        static char line[1 << 16];
+        while (std::fgets(line, sizeof line, file)) {
+            if (line[0] == '#' || line[0] == '\n') continue;
+            char* token = std::strtok(line, " \n");
+            if (!token) continue;
+            std::string name = token;
+            Signature signature;
+            token = std::strtok(0, " \n");
+            signature.length_ = token ? std::atoi(token) : 0;
+            token = std::strtok(0, " \n");
+            if (token) signature.hash_ = token;
+            while ((token = std::strtok(0, " \n")) != 0) signature.segments_.push_back(token);
+            golden[name] = signature;
+        }
+        std::fclose(file);
+        return true;
+    }
+    
+    bool WriteGolden(const char* path, const std::vector<Scenario>& scenarios, const std::vector<Signature>& signatures) {
+        FILE* file = std::fopen(path, "w");
+        if (!file) return false;
+        std::fprintf(file, "# Written by vst2413-golden --record.\n");
+        std::fprintf(file, "# name, samples, FNV-1a 64 hash, hashes of the %d-sample segments\n", kSegmentLength);
+        for (size_t i = 0; i < scenarios.size(); i++) {
+            const Signature& s = signatures[i];
+            std::fprintf(file, "%s %d %s", scenarios[i].name_.c_str(), s.length_, s.hash_.c_str());
+            for (size_t j = 0; j < s.segments_.size(); j++) std::fprintf(file, " %s", s.segments_[j].c_str());
+            std::fprintf(file, "\n");
+        }
+        std::fclose(file);
+        return true;
+    }
+    
+    std::string FileName(const char* directory, const std::string& name) {
+        std::string path = std::string(directory) + "/";
+        for (size_t i = 0; i < name.size(); i++) path += name[i] == '/' ? '_' : name[i];
+        return path + ".pcm";
+    }
+    
+    bool WritePcm(const std::string& path, const Output& output) {
+        FILE* file = std::fopen(path.c_str(), "wb");
+        if (!file) return false;
+        size_t written = output.empty() ? 0 : std::fwrite(&output[0], sizeof(int), output.size(), file);
+        std::fclose(file);
+        return written == output.size();
+    }
+    
+    bool ReadPcm(const std::string& path, Output& output) {
+        FILE* file = std::fopen(path.c_str(), "rb");
+        if (!file) return false;
+        int buffer[4096];
+        size_t count;
+        while ((count = std::fread(buffer, sizeof(int), 4096, file)) > 0) output.insert(output.end(), buffer, buffer + count);
+        std::fclose(file);
+        return true;
+    }
+
+#pragma mark
+#pragma mark Checking
+
+    // Reports the sample differences; returns true within the tolerance.
+    bool DiffSamples(const Output& reference, const Output& output, int tolerance) {
+        if (reference.size() != output.size()) {
+            std::printf("    length %d, reference %d\n", static_cast<int>(output.size()), static_cast<int>(reference.size()));
+            return false;
+        }
+        int differences = 0;
+        int maxDifference = 0;
+        for (size_t i = 0; i < output.size(); i++) {
+            int difference = std::abs(output[i] - reference[i]);
+            if (difference == 0) continue;
+            if (differences++ < kMaxListedDiffs) {
+                std::printf("    sample %d: %d, reference %d\n", static_cast<int>(i), output[i], reference[i]);
+            }
+            if (difference > maxDifference) maxDifference = difference;
+        }
+        if (differences > 0) std::printf("    %d samples differ, max difference %d (tolerance %d)\n", differences, maxDifference, tolerance);
+        return maxDifference <= tolerance;
+    }
+    
+    bool MatchSignature(const Signature& golden, const Signature& signature) {
+        return golden.hash_ == signature.hash_ && golden.length_ == signature.length_;
+    }
+    
+    // Reports where the output departs from the golden hashes.
+    void ReportSignature(const Signature& golden, const Signature& signature) {
+        if (golden.length_ != signature.length_) {
+            std::printf("    length %d, golden %d\n", signature.length_, golden.length_);
+        }
+        for (size_t i = 0; i < signature.segments_.size() && i < golden.segments_.size(); i++) {
+            if (signature.segments_[i] != golden.segments_[i]) {
+                std::printf("    first difference in samples %d-%d\n", static_cast<int>(i) * kSegmentLength, static_cast<int>(i + 1) * kSegmentLength - 1);
+                break;
+            }
+        }
+    }
+}
+
+int main(int argc, char** argv) {
+    const char* goldenPath = "test/golden.txt";
+    const char* filter = 0;
+    const char* dumpDirectory = 0;
+    const char* referenceDirectory = 0;
+    const char* tracePath = 0;
+    bool record = false;
+    int tolerance = 0;
+    for (int i = 1; i < argc; i++) {
+        if (std::strcmp(argv[i], "--record") == 0) {
+            record = true;
+        } else if (std::strcmp(argv[i], "--golden") == 0 && i + 1 < argc) {
+            goldenPath = argv[++i];
+        } else if (std::strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+            filter = argv[++i];
+        } else if (std::strcmp(argv[i], "--dump") == 0 && i + 1 < argc) {
+            dumpDirectory = argv[++i];
+        } else if (std::strcmp(argv[i], "--reference") == 0 && i + 1 < argc) {
+            referenceDirectory = argv[++i];
+        } else if (std::strcmp(argv[i], "--tolerance") == 0 && i + 1 < argc) {
+            tolerance = std::atoi(argv[++i]);
+        } else if (std::strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+#ifndef VST2413_TRACE
+            std::fprintf(stderr, "--trace needs a build with VST2413_TRACE\n");
+            return 2;
+#endif
+            tracePath = argv[++i];
+        } else {
+            std::fprintf(stderr, "usage: %s [--golden file] [--record] [--filter text] [--dump dir] [--reference dir] [--tolerance n] [--trace file]\n", argv[0]);
+            return 2;
+        }
+    }
+    
+    GoldenMap golden;
+    if (!record && !referenceDirectory && !ReadGolden(goldenPath, golden)) {
+        std::fprintf(stderr, "cannot read %s\n", goldenPath);
+        return 2;
+    }
+    
+    std::vector<Scenario> scenarios = ListScenarios();
+    if (record) filter = 0;
+    std::vector<Signature> signatures;
+    int failures = 0;
+    int passes = 0;
+    CpuDispatch::Isa bestIsa = CpuDispatch::GetIsa();
+    for (size_t i = 0; i < scenarios.size(); i++) {
+        const Scenario& scenario = scenarios[i];
+        if (filter && scenario.name_.find(filter) == std::string::npos) continue;
+        TRACE_BEGIN(scenario.name_.c_str(), 0);
+        
+        // The first run (the best variant, per sample) is the one checked.
+        CpuDispatch::SetIsa(bestIsa);
+        Output output;
+        scenario.render_(output, scenario.mode_, scenario.option_, scenario.arg_);
+        Signature signature = Sign(output);
+        signatures.push_back(signature);
+        bool ok = true;
+        
+        // The other variants have to match it exactly.
+        for (int isa = CpuDispatch::kIsaGeneric; isa <= bestIsa; isa++) {
+            CpuDispatch::SetIsa(static_cast<CpuDispatch::Isa>(isa));
+            for (int blocks = 0; blocks < 2; blocks++) {
+                if (isa == bestIsa && !blocks) continue;
+                if (blocks && !scenario.emulator_) continue;
+                Output other;
+                scenario.render_(other, scenario.mode_, scenario.emulator_ ? blocks != 0 : scenario.option_, scenario.arg_);
+                if (other != output) {
+                    std::printf("%s: %s%s differs from %s\n", scenario.name_.c_str(), CpuDispatch::GetIsaName(static_cast<CpuDispatch::Isa>(isa)),
+                                blocks ? " (blocks)" : "", CpuDispatch::GetIsaName(bestIsa));
+                    DiffSamples(output, other, 0);
+                    ok = false;
+                }
+            }
+        }
+        
+        if (dumpDirectory && !WritePcm(FileName(dumpDirectory, scenario.name_), output)) {
+            std::fprintf(stderr, "cannot write %s\n", FileName(dumpDirectory, scenario.name_).c_str());
+            return 2;
+        }
+        
+        if (referenceDirectory) {
+            Output reference;
+            if (!ReadPcm(FileName(referenceDirectory, scenario.name_), reference)) {
+                std::printf("%s: no reference\n", scenario.name_.c_str());
+                ok = false;
+            } else if (reference != output) {
+                std::printf("%s: differs from the reference\n", scenario.name_.c_str());
+                if (!DiffSamples(reference, output, tolerance)) ok = false;
+            }
+        } else if (!record) {
+            GoldenMap::const_iterator entry = golden.find(scenario.name_);
+            if (entry == golden.end()) {
+                std::printf("%s: not in the golden file\n", scenario.name_.c_str());
+                ok = false;
+            } else if (!MatchSignature(entry->second, signature)) {
+                std::printf("%s: differs from the golden hash\n", scenario.name_.c_str());
+                ReportSignature(entry->second, signature);
+                ok = false;
+            }
+        }
+        
+        TRACE_END(scenario.name_.c_str());
+        if (ok) {
+            passes++;
+        } else {
+            failures++;
+        }
+    }
+    
+    if (record && !WriteGolden(goldenPath, scenarios, signatures)) {
+        std::fprintf(stderr, "cannot write %s\n", goldenPath);
+        return 2;
+    }
+    if (tracePath && !Trace_write(tracePath)) {
+        std::fprintf(stderr, "cannot write %s\n", tracePath);
+        return 2;
+    }
+    std::printf("%d passed, %d failed (%s)\n", passes, failures, CpuDispatch::GetIsaName(bestIsa));
+    return failures > 0 ? 1 : 0;
+}
@@ -0,0 +1,305 @@
+// MIDI-in to audio-out latency and jitter of the notes.
+//
+// usage: vst2413-latency [--notes n] [--max-jitter samples]
+//
+// Sends note ons at random frames of the host blocks, finds the onset of
+// each note in the output (the first sample above -60 dBFS) and reports
+// the distribution of the delay from the event to the onset, for each
+// sample rate, block size and quality tier. The delay covers the attack
+// of the chip (with the fastest attack rate) and the resampling; the
+// spread of it (the jitter) shows whether the events are applied at
+// their exact frames. --max-jitter fails the run when the spread of any
+// row exceeds the given number of samples.
+//
+// Built with a plug-in (VST2413_TEST_PLUGIN, see CMakeLists.txt) it sends
+// the events through FakeHost instead, as vst2413{p,r,s}-latency, in
+// the realtime and offline process levels and in the render-ahead mode
+// (at the offline level, as the worker doesn't run in real time here).
+// The delay reported by the plug-in (setInitialDelay) is subtracted, as
+// a host compensates it; the "reported" column gives it.
+
+#include "QualityGovernor.h"
+#include "RhythmDriver.h"
+#include "SynthDriver.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#ifdef VST2413_TEST_PLUGIN
+#include "FakeHost.h"
+#endif
+
+namespace {
+    // Onset threshold (-60 dBFS).
+    const float kThreshold = 0.001f;
+    // Samples below the threshold before the next note.
+    const int kQuietLength = 1024;
+    // A note that doesn't sound in this time (sec) is counted as missed.
+    const float kTimeout = 0.5f;
+    
+    const int kNote = 60;
+    // Snare drum, for the rhythm driver.
+    const int kDrumNote = 38;
+    
+    int noteCount = 200;
+    
+    // Fixed-seed generator, so that every run plays the same events.
+    class Random {
+    public:
+        Random(unsigned int seed) : state_(seed) {}
+        int Next(int range) {
+            state_ = state_ * 1664525u + 1013904223u;
+            return static_cast<int>((state_ >> 8) % static_cast<unsigned int>(range));
+        }
+    private:
+        unsigned int state_;
+    };
+
+#pragma mark Targets
+
+    // Something that takes events at frames of the next block.
+    class Target {
+    public:
+        virtual ~Target() {}
+        virtual void NoteOn(int frame) = 0;
+        // Cuts the sound (all sound off).
+        virtual void Silence(int frame) = 0;
+        virtual void Process(float* output, int length) = 0;
+        // Delay the host compensates.
+        virtual int GetReportedDelay() { return 0; }
+    };
+
+#ifndef VST2413_TEST_PLUGIN
+    // A driver with the events applied at their frames, as the plug-ins do.
+    template <typename Driver> class DriverTarget : public Target {
+    public:
+        DriverTarget(Driver& driver) : driver_(driver), frame_(-1), silenceFrame_(-1) {}
+        virtual void NoteOn(int frame) { frame_ = frame; }
+        virtual void Silence(int frame) { silenceFrame_ = frame; }
+        virtual void Process(float* output, int length) {
+            int position = 0;
+            if (silenceFrame_ >= 0) {
+                driver_.Render(output, silenceFrame_);
+                Cut();
+                position = silenceFrame_;
+                silenceFrame_ = -1;
+            }
+            if (frame_ >= 0) {
+                driver_.Render(output + position, frame_ - position);
+                Play();
+                position = frame_;
+                frame_ = -1;
+            }
+            driver_.Render(output + position, length - position);
+        }
+    private:
+        Driver& driver_;
+        int frame_;
+        int silenceFrame_;
+        void Play();
+        void Cut();
+    };
+    
+    template <> void DriverTarget<SynthDriver>::Play() { driver_.KeyOn(kNote, 0.8f); }
+    template <> void DriverTarget<SynthDriver>::Cut() { driver_.Panic(); }
+    template <> void DriverTarget<RhythmDriver>::Play() { driver_.KeyOn(kDrumNote, 0.8f); }
+    template <> void DriverTarget<RhythmDriver>::Cut() { driver_.KeyOffAll(); }
+#else
+    class PluginTarget : public Target {
+    public:
+        PluginTarget(FakeHost& host) : host_(host) {}
+        virtual void NoteOn(int frame) {
+            // The drum channel plays the drums of every plug-in.
+            host_.QueueMidi(frame, 0x99, kDrumNote, 100);
+            host_.QueueMidi(frame, 0x90, kNote, 100);
+        }
+        virtual void Silence(int frame) {
+            host_.QueueMidi(frame, 0xb9, 0x7b, 0);
+            host_.QueueMidi(frame, 0xb0, 0x78, 0);
+            host_.QueueMidi(frame, 0xb0, 0x7b, 0);
+        }
+        virtual void Process(float* output, int length) {
+            host_.SendEvents();
+            host_.Process(output, length);
+        }
+        virtual int GetReportedDelay() { return host_.GetInitialDelay(); }
+    private:
+        FakeHost& host_;
+    };
+#endif
+
+#pragma mark Measurement
+
+    struct Result {
+        std::vector<int> latencies_;
+        int missed_;
+        Result() : missed_(0) {}
+    };
+    
+    // Plays the notes one at a time, each after the output got quiet.
+    Result Measure(Target& target, unsigned int sampleRate, int blockSize, unsigned int seed) {
+        enum State { kWaiting, kOnset, kRelease };
+        Random random(seed);
+        Result result;
+        std::vector<float> block(blockSize);
+        long position = 0;
+        long noteTime = 0;
+        long next = blockSize + random.Next(blockSize * 2);
+        long timeout = static_cast<long>(kTimeout * sampleRate);
+        int quiet = 0;
+        bool silenced = false;
+        State state = kWaiting;
+        int delay = target.GetReportedDelay();
+        
+        while (static_cast<int>(result.latencies_.size()) + result.missed_ < noteCount) {
+            if (state == kWaiting && next < position + blockSize) {
+                target.NoteOn(static_cast<int>(next - position));
+                noteTime = next + delay;
+                state = kOnset;
+            } else if (state == kRelease && !silenced) {
+                target.Silence(0);
+                silenced = true;
+                quiet = 0;
+            }
+            target.Process(&block[0], blockSize);
+            
+            for (int i = 0; i < blockSize; i++) {
+                long time = position + i;
+                bool loud = std::fabs(block[i]) > kThreshold;
+                if (state == kOnset && time >= noteTime && loud) {
+                    result.latencies_.push_back(static_cast<int>(time - noteTime));
+                    state = kRelease;
+                    silenced = false;
+                }
+                quiet = loud ? 0 : quiet + 1;
+            }
+            position += blockSize;
+            
+            if (state == kOnset && position - noteTime > timeout) {
+                result.missed_++;
+                state = kRelease;
+                silenced = false;
+            }
+            if (state == kRelease && silenced && quiet >= kQuietLength) {
+                state = kWaiting;
+                next = position + random.Next(blockSize * 2);
+            }
+        }
+        return result;
+    }
+    
+    // Prints a row; returns the spread of the latencies.
+    int Print(const char* target, unsigned int sampleRate, int blockSize, const char* mode, int reported, Result& result) {
+        std::vector<int>& values = result.latencies_;
+        std::printf("%-10s %6u %5d %-9s %8d", target, sampleRate, blockSize, mode, reported);
+        if (values.empty()) {
+            std::printf("   (no onsets, %d missed)\n", result.missed_);
+            return 0;
+        }
+        std::sort(values.begin(), values.end());
+        int count = static_cast<int>(values.size());
+        double sum = 0, squares = 0;
+        for (int i = 0; i < count; i++) {
+            sum += values[i];
+            squares += static_cast<double>(values[i]) * values[i];
+        }
+        double mean = sum / count;
+        double deviation = std::sqrt(std::max(0.0, squares / count - mean * mean));
+        int median = values[count / 2];
+        int p95 = values[std::min(count - 1, count * 95 / 100)];
+        int spread = values[count - 1] - values[0];
+        std::printf(" %6d %6d %6d %6d %7.2f %6d %7.2f",
+                    values[0], median, p95, values[count - 1], deviation, spread, 1000.0 * median / sampleRate);
+        if (result.missed_ > 0) std::printf("  (%d missed)", result.missed_);
+        std::printf("\n");
+        return spread;
+    }
+    
+    const unsigned int kSampleRates[] = { 44100, 48000, 96000 };
+    const int kBlockSizes[] = { 64, 256, 1024 };
+}
+
+int main(int argc, char** argv) {
+    int maxJitter = -1;
+    for (int i = 1; i < argc; i++) {
+        if (std::strcmp(argv[i], "--notes") == 0 && i + 1 < argc) {
+            noteCount = std::atoi(argv[++i]);
+        } else if (std::strcmp(argv[i], "--max-jitter") == 0 && i + 1 < argc) {
+            maxJitter = std::atoi(argv[++i]);
+        } else {
+            std::fprintf(stderr, "usage: %s [--notes n] [--max-jitter samples]\n", argv[0]);
+            return 2;
+        }
+    }
+    
+    std::printf("latency in samples from the event to the onset (median also in msec)\n");
+    std::printf("%-10s %6s %5s %-9s %8s %6s %6s %6s %6s %7s %6s %7s\n",
+                "target", "rate", "block", "mode", "reported", "min", "median", "p95", "max", "stddev", "spread", "msec");
+    int worst = 0;
+    for (int r = 0; r < 3; r++) {
+        for (int b = 0; b < 3; b++) {
+            unsigned int sampleRate = kSampleRates[r];
+            int blockSize = kBlockSizes[b];
+#ifndef VST2413_TEST_PLUGIN
+            static const char* kTierNames[] = { "reduced", "direct", "high" };
+            for (int tier = 0; tier < QualityGovernor::kTiers; tier++) {
+                {
+                    SynthDriver driver(sampleRate);
+                    driver.Prepare();
+                    driver.SetQualityTier(static_cast<QualityGovernor::Tier>(tier));
+                    // The shortest attack time (0), so the onset is the delay
+                    // of the chip itself.
+                    driver.SetParameter(SynthDriver::kParameterAR0, 0.0f);
+                    driver.SetParameter(SynthDriver::kParameterAR1, 0.0f);
+                    DriverTarget<SynthDriver> target(driver);
+                    Result result = Measure(target, sampleRate, blockSize, 1);
+                    worst = std::max(worst, Print("synth", sampleRate, blockSize, kTierNames[tier], 0, result));
+                }
+                {
+                    RhythmDriver driver(sampleRate);
+                    driver.Prepare();
+                    driver.SetQualityTier(static_cast<QualityGovernor::Tier>(tier));
+                    DriverTarget<RhythmDriver> target(driver);
+                    Result result = Measure(target, sampleRate, blockSize, 2);
+                    worst = std::max(worst, Print("rhythm", sampleRate, blockSize, kTierNames[tier], 0, result));
+                }
+            }
+#else
+            static const char* kModeNames[] = { "realtime", "offline", "ahead" };
+            for (int mode = 0; mode < 3; mode++) {
+                FakeHost host(static_cast<float>(sampleRate), blockSize);
+                AudioEffectX& effect = host.GetEffect();
+                // The worker can't keep up with the loop in the render-ahead
+                // mode; the offline level has the audio thread catch up.
+                host.SetProcessLevel(mode == 0 ? kVstProcessLevelRealtime : kVstProcessLevelOffline);
+                // The drums on channel 10 (Vst2413p has only slow presets).
+                int index = host.FindParameter("Drums");
+                if (index >= 0) effect.setParameter(index, 1.0f);
+                static const char* kAttacks[] = { "AR 0", "AR 1" };
+                for (int i = 0; i < 2; i++) {
+                    index = host.FindParameter(kAttacks[i]);
+                    if (index >= 0) effect.setParameter(index, 0.0f);
+                }
+                if (mode == 2) {
+                    index = host.FindParameter("Ahead");
+                    if (index < 0) continue;
+                    effect.setParameter(index, 1.0f);
+                    host.Restart();
+                }
+                PluginTarget target(host);
+                Result result = Measure(target, sampleRate, blockSize, 3);
+                worst = std::max(worst, Print("plug-in", sampleRate, blockSize, kModeNames[mode], host.GetInitialDelay(), result));
+            }
+#endif
+        }
+    }
+    
+    if (maxJitter >= 0 && worst > maxJitter) {
+        std::printf("FAILED: spread of %d samples over %d\n", worst, maxJitter);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,346 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#undef _FORTIFY_SOURCE
+
+#include "RealtimeAudit.h"
+#include <stdlib.h>
+
+#if defined(__linux__) && defined(__GLIBC__)
+
+#include <dlfcn.h>
+#include <execinfo.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Reports with a backtrace; the later violations are only counted. */
+#define MAX_REPORTS 16
+#define MAX_FRAMES 32
+
+/* The heap functions are forwarded to the glibc internals, which need no
+   lookup (dlsym itself allocates). */
+extern void *__libc_malloc (size_t size);
+extern void *__libc_calloc (size_t count, size_t size);
+extern void *__libc_realloc (void *pointer, size_t size);
+extern void *__libc_memalign (size_t alignment, size_t size);
+extern void __libc_free (void *pointer);
+
+static __thread int depth;
+static __thread int reporting;
+static __thread const char *scope_name;
+static volatile int violations;
+
+/* The other functions are looked up on the first call. */
+static void *
+next_function (void **slot, const char *name)
+{
+    if (!*slot)
+        *slot = dlsym (RTLD_NEXT, name);
+    return *slot;
+}
+
+#define NEXT(name) ((name##_function) next_function ((void **) &real_##name, #name))
+
+typedef int (*pthread_mutex_lock_function) (pthread_mutex_t *);
+typedef int (*pthread_mutex_trylock_function) (pthread_mutex_t *);
+typedef int (*pthread_mutex_unlock_function) (pthread_mutex_t *);
+typedef int (*open_function) (const char *, int, ...);
+typedef int (*openat_function) (int, const char *, int, ...);
+typedef ssize_t (*read_function) (int, void *, size_t);
+typedef ssize_t (*write_function) (int, const void *, size_t);
+typedef int (*close_function) (int);
+typedef void *(*mmap_function) (void *, size_t, int, int, int, off_t);
+typedef int (*munmap_function) (void *, size_t);
+typedef int (*nanosleep_function) (const struct timespec *, struct timespec *);
+typedef int (*clock_nanosleep_function) (clockid_t, int, const struct timespec *, struct timespec *);
+typedef int (*usleep_function) (useconds_t);
+typedef int (*sched_yield_function) (void);
+
+static pthread_mutex_lock_function real_pthread_mutex_lock;
+static pthread_mutex_trylock_function real_pthread_mutex_trylock;
+static pthread_mutex_unlock_function real_pthread_mutex_unlock;
+static open_function real_open;
+static openat_function real_openat;
+static read_function real_read;
+static write_function real_write;
+static close_function real_close;
+static mmap_function real_mmap;
+static munmap_function real_munmap;
+static nanosleep_function real_nanosleep;
+static clock_nanosleep_function real_clock_nanosleep;
+static usleep_function real_usleep;
+static sched_yield_function real_sched_yield;
+
+static void
+report (const char *call)
+{
+    char text[256];
+    void *frames[MAX_FRAMES];
+    int count, length;
+
+    count = __atomic_add_fetch (&violations, 1, __ATOMIC_RELAXED);
+    if (count > MAX_REPORTS)
+        return;
+    length = snprintf (text, sizeof text, "real-time violation: %s in %s\n", call, scope_name);
+    NEXT (write) (2, text, length);
+    /* Without the frame of this function. */
+    count = backtrace (frames, MAX_FRAMES);
+    backtrace_symbols_fd (frames + 1, count - 1, 2);
+    if (violations == MAX_REPORTS) {
+        length = snprintf (text, sizeof text, "(the further violations are only counted)\n");
+        NEXT (write) (2, text, length);
+    }
+}
+
+/* The report itself allocates and writes, so it is not audited. */
+#define CHECK(call) \
+  do { \
+    if (depth > 0 && !reporting) { \
+      reporting = 1; \
+      report (call); \
+      reporting = 0; \
+    } \
+  } while (0)
+
+int
+RealtimeAudit_is_supported (void)
+{
+    return 1;
+}
+
+void
+RealtimeAudit_begin (const char *name)
+{
+    static int ready;
+
+    if (depth++ > 0)
+        return;
+    scope_name = name;
+    /* The first backtrace loads the unwinder; do that unaudited. */
+    if (!ready) {
+        void *frame;
+        reporting = 1;
+        backtrace (&frame, 1);
+        reporting = 0;
+        ready = 1;
+    }
+}
+
+void
+RealtimeAudit_end (void)
+{
+    depth--;
+}
+
+int
+RealtimeAudit_violations (void)
+{
+    return __atomic_load_n (&violations, __ATOMIC_RELAXED);
+}
+
+/* Heap */
+
+void *
+malloc (size_t size)
+{
+    CHECK ("malloc");
+    return __libc_malloc (size);
+}
+
+void *
+calloc (size_t count, size_t size)
+{
+    CHECK ("calloc");
+    return __libc_calloc (count, size);
+}
+
+void *
+realloc (void *pointer, size_t size)
+{
+    CHECK ("realloc");
+    return __libc_realloc (pointer, size);
+}
+
+void
+free (void *pointer)
+{
+    if (pointer)
+        CHECK ("free");
+    __libc_free (pointer);
+}
+
+void *
+memalign (size_t alignment, size_t size)
+{
+    CHECK ("memalign");
+    return __libc_memalign (alignment, size);
+}
+
+void *
+aligned_alloc (size_t alignment, size_t size)
+{
+    CHECK ("aligned_alloc");
+    return __libc_memalign (alignment, size);
+}
+
+int
+posix_memalign (void **pointer, size_t alignment, size_t size)
+{
+    CHECK ("posix_memalign");
+    *pointer = __libc_memalign (alignment, size);
+    return *pointer ? 0 : 12;   /* ENOMEM */
+}
+
+/* Locks */
+
+int
+pthread_mutex_lock (pthread_mutex_t *mutex)
+{
+    CHECK ("pthread_mutex_lock");
+    return NEXT (pthread_mutex_lock) (mutex);
+}
+
+int
+pthread_mutex_trylock (pthread_mutex_t *mutex)
+{
+    CHECK ("pthread_mutex_trylock");
+    return NEXT (pthread_mutex_trylock) (mutex);
+}
+
+int
+pthread_mutex_unlock (pthread_mutex_t *mutex)
+{
+    CHECK ("pthread_mutex_unlock");
+    return NEXT (pthread_mutex_unlock) (mutex);
+}
+
+/* Syscalls */
+
+int
+open (const char *path, int flags, ...)
+{
+    va_list args;
+    mode_t mode = 0;
+
+    /* The mode is only passed with O_CREAT or O_TMPFILE. */
+    if (flags & (O_CREAT | O_TMPFILE)) {
+        va_start (args, flags);
+        mode = va_arg (args, mode_t);
+        va_end (args);
+    }
+    CHECK ("open");
+    return NEXT (open) (path, flags, mode);
+}
+
+int
+openat (int directory, const char *path, int flags, ...)
+{
+    va_list args;
+    mode_t mode = 0;
+
+    /* The mode is only passed with O_CREAT or O_TMPFILE. */
+    if (flags & (O_CREAT | O_TMPFILE)) {
+        va_start (args, flags);
+        mode = va_arg (args, mode_t);
+        va_end (args);
+    }
+    CHECK ("openat");
+    return NEXT (openat) (directory, path, flags, mode);
+}
+
+ssize_t
+read (int fd, void *buffer, size_t size)
+{
+    CHECK ("read");
+    return NEXT (read) (fd, buffer, size);
+}
+
+ssize_t
+write (int fd, const void *buffer, size_t size)
+{
+    CHECK ("write");
+    return NEXT (write) (fd, buffer, size);
+}
+
+int
+close (int fd)
+{
+    CHECK ("close");
+    return NEXT (close) (fd);
+}
+
+void *
+mmap (void *address, size_t length, int protection, int flags, int fd, off_t offset)
+{
+    CHECK ("mmap");
+    return NEXT (mmap) (address, length, protection, flags, fd, offset);
+}
+
+int
+munmap (void *address, size_t length)
+{
+    CHECK ("munmap");
+    return NEXT (munmap) (address, length);
+}
+
+int
+nanosleep (const struct timespec *request, struct timespec *remain)
+{
+    CHECK ("nanosleep");
+    return NEXT (nanosleep) (request, remain);
+}
+
+int
+clock_nanosleep (clockid_t clock, int flags, const struct timespec *request, struct timespec *remain)
+{
+    CHECK ("clock_nanosleep");
+    return NEXT (clock_nanosleep) (clock, flags, request, remain);
+}
+
+int
+usleep (useconds_t time)
+{
+    CHECK ("usleep");
+    return NEXT (usleep) (time);
+}
+
+int
+sched_yield (void)
+{
+    CHECK ("sched_yield");
+    return NEXT (sched_yield) ();
+}
+
+#else
+
+int
+RealtimeAudit_is_supported (void)
+{
+    return 0;
+}
+
+void
+RealtimeAudit_begin (const char *name)
+{
+    (void) name;
+}
+
+void
+RealtimeAudit_end (void)
+{
+}
+
+int
+RealtimeAudit_violations (void)
+{
+    return 0;
+}
+
+#endif
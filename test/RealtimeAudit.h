@@ -0,0 +1,41 @@
+#ifndef __RealtimeAudit__
+#define __RealtimeAudit__
+
+// Real-time safety audit of the audio thread.
+//
+// Linked into a test program, it interposes the heap functions (and so
+// operator new and delete), the pthread mutex calls and the common
+// blocking syscalls. Between RealtimeAudit_begin and RealtimeAudit_end
+// on a thread, every call to them is a violation: it is counted and
+// reported on stderr with the name given to begin and a backtrace. The
+// calls are forwarded as usual, and the other threads are not audited.
+//
+// Only glibc-based Linux is supported; elsewhere the audit is inactive
+// and RealtimeAudit_is_supported returns 0. The program has to export
+// its symbols (-rdynamic) to catch the calls from the shared libraries.
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int RealtimeAudit_is_supported (void);
+
+/* Audits the calling thread until the matching end. May be nested. */
+void RealtimeAudit_begin (const char *name);
+void RealtimeAudit_end (void);
+
+/* Number of violations so far (on all the threads). */
+int RealtimeAudit_violations (void);
+
+#ifdef __cplusplus
+}
+
+// Audit of the enclosing scope.
+class RealtimeAuditScope {
+public:
+    explicit RealtimeAuditScope(const char* name) { RealtimeAudit_begin(name); }
+    ~RealtimeAuditScope() { RealtimeAudit_end(); }
+};
+#endif
+
+#endif
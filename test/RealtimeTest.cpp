@@ -0,0 +1,348 @@
+// Real-time safety test of the audio thread.
+//
+// usage: vst2413-rtaudit [--blocks n]
+//
+// Drives the drivers the way the plug-ins do on the audio thread (MIDI
+// events, parameter automation, parameter texts, rendering in random
+// block lengths, the statistics, the render-ahead rings) in each quality
+// tier and mode, with every call audited by RealtimeAudit: an allocation,
+// a mutex or a blocking syscall in any of them fails the test with a
+// backtrace. The set-up calls (Prepare, SetSampleRate, resume and the
+// like) are not audited, as hosts make them off the audio thread.
+//
+// Built with a plug-in (VST2413_TEST_PLUGIN, see CMakeLists.txt) it
+// drives the plug-in through FakeHost instead, as vst2413{p,r,s}-rtaudit.
+
+#include "RealtimeAudit.h"
+#include "RenderAhead.h"
+#include "RhythmDriver.h"
+#include "SynthDriver.h"
+#include "Trace.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#ifdef VST2413_TEST_PLUGIN
+#include "FakeHost.h"
+#endif
+
+namespace {
+    const int kMaxBlockSize = 1024;
+    const int kTextSize = 32;
+    
+    // Blocks per configuration.
+    int blockCount = 400;
+    
+    // Fixed-seed generator, so that every run plays the same events.
+    class Random {
+    public:
+        Random(unsigned int seed) : state_(seed) {}
+        int Next(int range) {
+            state_ = state_ * 1664525u + 1013904223u;
+            return static_cast<int>((state_ >> 8) % static_cast<unsigned int>(range));
+        }
+        float NextFloat() { return Next(1001) * 0.001f; }
+    private:
+        unsigned int state_;
+    };
+    
+    float floatBuffer[kMaxBlockSize];
+    double doubleBuffer[kMaxBlockSize];
+    
+    // Prints the violations of a run since the last call.
+    bool Report(const char* target, const char* config) {
+        static int last = 0;
+        int count = RealtimeAudit_violations() - last;
+        last += count;
+        if (count == 0) {
+            std::printf("%-12s %-28s ok\n", target, config);
+        } else {
+            std::printf("%-12s %-28s %d violations\n", target, config, count);
+        }
+        return count == 0;
+    }
+    
+    int BlockLength(Random& random) {
+        // Mostly the common sizes, sometimes odd ones.
+        static const int kLengths[] = { 64, 128, 256, 512, 1024 };
+        return random.Next(4) == 0 ? 1 + random.Next(kMaxBlockSize) : kLengths[random.Next(5)];
+    }
+
+#ifndef VST2413_TEST_PLUGIN
+#pragma mark Drivers
+
+    struct Config {
+        const char* name_;
+        unsigned int sampleRate_;
+        QualityGovernor::Tier tier_;
+        int chips_;
+        bool rhythm_;       // rhythm mode (SynthDriver) or cached mode (RhythmDriver)
+        bool governor_;
+    };
+    
+    const Config kConfigs[] = {
+        { "reduced", 44100, QualityGovernor::kTierReduced, 1, false, false },
+        { "direct", 48000, QualityGovernor::kTierDirect, 1, false, false },
+        { "high", 48000, QualityGovernor::kTierHigh, 1, false, false },
+        { "direct, 4 chips, rhythm", 44100, QualityGovernor::kTierDirect, 4, true, false },
+        { "governed, 2 chips, rhythm", 96000, QualityGovernor::kTierDirect, 2, true, true }
+    };
+    const int kConfigCount = sizeof kConfigs / sizeof kConfigs[0];
+    
+    // Events a MIDI block may carry to a SynthDriver.
+    void SendSynthEvents(SynthDriver& driver, Random& random) {
+        RealtimeAuditScope audit("SynthDriver events");
+        for (int e = random.Next(6); e > 0; e--) {
+            int part = random.Next(SynthDriver::kParts);
+            switch (random.Next(8)) {
+                case 0: driver.KeyOff(part, 36 + random.Next(48)); break;
+                case 1: driver.SetPitchWheel(part, random.NextFloat() * 2 - 1); break;
+                case 2: driver.SetPartProgram(part, static_cast<SynthDriver::ProgramID>(random.Next(SynthDriver::kPrograms))); break;
+                case 3: if (random.Next(16) == 0) driver.KeyOffPart(part); break;
+                case 4: if (random.Next(64) == 0) driver.Panic(); break;
+                default: driver.KeyOn(part, 36 + random.Next(48), random.NextFloat()); break;
+            }
+        }
+    }
+    
+    // Automation, including the options the plug-ins expose as parameters.
+    void ChangeSynthParameter(SynthDriver& driver, Random& random) {
+        RealtimeAuditScope audit("SynthDriver parameters");
+        switch (random.Next(8)) {
+            case 0: driver.SetChipCount(1 + random.Next(SynthDriver::kMaxChips)); break;
+            case 1: driver.SetRhythmMode(!driver.GetRhythmMode()); break;
+            case 2: driver.SetProgram(static_cast<SynthDriver::ProgramID>(random.Next(SynthDriver::kPrograms))); break;
+            default: driver.SetParameter(static_cast<SynthDriver::ParameterID>(random.Next(SynthDriver::kParameters)), random.NextFloat()); break;
+        }
+    }
+    
+    void ReadSynthTexts(SynthDriver& driver, Random& random) {
+        RealtimeAuditScope audit("SynthDriver texts");
+        char text[kTextSize];
+        SynthDriver::ParameterID id = static_cast<SynthDriver::ParameterID>(random.Next(SynthDriver::kParameters));
+        driver.GetParameterName(id, text, sizeof text);
+        driver.GetParameterLabel(id, text, sizeof text);
+        driver.GetParameterText(id, text, sizeof text);
+        driver.GetProgramName(static_cast<SynthDriver::ProgramID>(random.Next(SynthDriver::kPrograms)), text, sizeof text);
+    }
+    
+    void RenderSynth(SynthDriver& driver, int length, bool doublePrecision) {
+        RealtimeAuditScope audit("SynthDriver::Render");
+        if (doublePrecision) {
+            driver.Render(doubleBuffer, length);
+        } else {
+            driver.Render(floatBuffer, length);
+        }
+        RenderStats::Snapshot snapshot;
+        driver.GetStats().Read(snapshot);
+    }
+    
+    bool AuditSynth(const Config& config) {
+        Random random(1);
+        SynthDriver driver(config.sampleRate_);
+        driver.Prepare();
+        driver.SetChipCount(config.chips_);
+        driver.SetRhythmMode(config.rhythm_);
+        driver.SetDrumKeyRange(35, 81);
+        driver.SetQualityTier(config.tier_);
+        driver.GetGovernor().SetEnabled(config.governor_);
+        for (int b = 0; b < blockCount; b++) {
+            SendSynthEvents(driver, random);
+            if (random.Next(4) == 0) ChangeSynthParameter(driver, random);
+            ReadSynthTexts(driver, random);
+            RenderSynth(driver, BlockLength(random), b % 2 != 0);
+        }
+        return Report("SynthDriver", config.name_);
+    }
+    
+    bool AuditRhythm(const Config& config) {
+        Random random(2);
+        RhythmDriver driver(config.sampleRate_);
+        // The cache is rendered on the set-up, so that the later switches
+        // are cheap (as in Vst2413r).
+        driver.SetCachedMode(config.rhythm_);
+        driver.Prepare();
+        driver.SetQualityTier(config.tier_);
+        driver.GetGovernor().SetEnabled(config.governor_);
+        for (int b = 0; b < blockCount; b++) {
+            {
+                RealtimeAuditScope audit("RhythmDriver events");
+                for (int e = random.Next(4); e > 0; e--) {
+                    int note = 35 + random.Next(47);
+                    if (random.Next(3) == 0) {
+                        driver.KeyOff(note);
+                    } else {
+                        driver.KeyOn(note, random.NextFloat());
+                    }
+                }
+                if (random.Next(32) == 0) driver.KeyOffAll();
+                if (config.rhythm_ && random.Next(16) == 0) driver.SetCachedMode(!driver.GetCachedMode());
+            }
+            {
+                RealtimeAuditScope audit("RhythmDriver::Render");
+                if (b % 2 != 0) {
+                    driver.Render(doubleBuffer, BlockLength(random));
+                } else {
+                    driver.Render(floatBuffer, BlockLength(random));
+                }
+                RenderStats::Snapshot snapshot;
+                driver.GetStats().Read(snapshot);
+            }
+        }
+        return Report("RhythmDriver", config.name_);
+    }
+    
+    // Render-ahead worker of a SynthDriver; only the audio thread is audited.
+    class AheadSource : public RenderAhead::Source {
+    public:
+        explicit AheadSource(SynthDriver& driver) : driver_(driver) {}
+        virtual void ProcessMidi(const char* data) {
+            int note = data[1] & 0x7f;
+            if ((data[0] & 0xf0) == 0x90) {
+                driver_.KeyOn(data[0] & 0x0f, note, (data[2] & 0x7f) * (1.0f / 128));
+            } else {
+                driver_.KeyOff(data[0] & 0x0f, note);
+            }
+        }
+        virtual void BeginBlock() { driver_.BeginBlock(); }
+        virtual void RenderAudio(float* buffer, int length) { driver_.RenderSegment(buffer, length); }
+        virtual void EndBlock() { driver_.EndBlock(); }
+        virtual void ApplyParameter(int index, float value) {
+            driver_.SetParameter(static_cast<SynthDriver::ParameterID>(index), value);
+        }
+    private:
+        SynthDriver& driver_;
+    };
+    
+    bool AuditRenderAhead(const Config& config) {
+        Random random(3);
+        SynthDriver driver(config.sampleRate_);
+        driver.Prepare();
+        driver.SetChipCount(config.chips_);
+        driver.SetQualityTier(config.tier_);
+        AheadSource source(driver);
+        RenderAhead ahead(source);
+        ahead.Start(config.sampleRate_, kMaxBlockSize);
+        for (int b = 0; b < blockCount; b++) {
+            int length = BlockLength(random);
+            {
+                RealtimeAuditScope audit("RenderAhead::QueueMidi");
+                for (int e = random.Next(4); e > 0; e--) {
+                    char data[3] = { static_cast<char>(random.Next(2) ? 0x90 : 0x80), static_cast<char>(36 + random.Next(48)), 100 };
+                    ahead.QueueMidi(random.Next(length), data);
+                }
+            }
+            if (random.Next(4) == 0) {
+                RealtimeAuditScope audit("RenderAhead::SetParameter");
+                ahead.SetParameter(random.Next(SynthDriver::kParameters), random.NextFloat());
+            }
+            {
+                RealtimeAuditScope audit("RenderAhead::Process");
+                if (b % 2 != 0) {
+                    ahead.Process(doubleBuffer, length);
+                } else {
+                    ahead.Process(floatBuffer, length);
+                }
+            }
+        }
+        ahead.Stop();
+        return Report("RenderAhead", config.name_);
+    }
+
+#else
+#pragma mark Plug-in
+
+    const float kSampleRates[] = { 44100, 48000, 96000 };
+    const int kSampleRateCount = sizeof kSampleRates / sizeof kSampleRates[0];
+    
+    bool AuditPlugin(float sampleRate, bool renderAhead) {
+        Random random(4);
+        FakeHost host(sampleRate, kMaxBlockSize);
+        AudioEffectX& effect = host.GetEffect();
+        int parameters = host.GetParameterCount();
+        int aheadIndex = host.FindParameter("Ahead");
+        if (renderAhead) {
+            if (aheadIndex < 0) return true;
+            effect.setParameter(aheadIndex, 1.0f);
+            host.Restart();
+        }
+        for (int b = 0; b < blockCount; b++) {
+            int length = BlockLength(random);
+            for (int e = random.Next(6); e > 0; e--) {
+                int channel = random.Next(16);
+                switch (random.Next(8)) {
+                    case 0: host.QueueMidi(random.Next(length), 0x80 | channel, 36 + random.Next(48), 0); break;
+                    case 1: host.QueueMidi(random.Next(length), 0xe0 | channel, random.Next(128), random.Next(128)); break;
+                    case 2: host.QueueMidi(random.Next(length), 0xc0 | channel, random.Next(128), 0); break;
+                    case 3: host.QueueMidi(random.Next(length), 0xb0 | channel, random.Next(2) ? 0x7b : 0x78, 0); break;
+                    default: host.QueueMidi(random.Next(length), 0x90 | channel, 36 + random.Next(48), 1 + random.Next(127)); break;
+                }
+            }
+            {
+                RealtimeAuditScope audit("processEvents");
+                host.SendEvents();
+            }
+            if (random.Next(4) == 0) {
+                int index = random.Next(parameters);
+                if (index != aheadIndex) {
+                    RealtimeAuditScope audit("setParameter");
+                    effect.setParameter(index, random.NextFloat());
+                }
+            }
+            {
+                RealtimeAuditScope audit("getParameterDisplay");
+                char text[kTextSize];
+                int index = random.Next(parameters);
+                effect.getParameterName(index, text);
+                effect.getParameterLabel(index, text);
+                effect.getParameterDisplay(index, text);
+            }
+            if (b % 2 != 0) {
+                RealtimeAuditScope audit("processDoubleReplacing");
+                host.Process(doubleBuffer, length);
+            } else {
+                RealtimeAuditScope audit("processReplacing");
+                host.Process(floatBuffer, length);
+            }
+            // A host restarts the plug-in off the audio thread when asked.
+            if (host.GetIoChanges() > 0) host.Restart();
+        }
+        char name[32];
+        std::snprintf(name, sizeof name, "%g Hz%s", sampleRate, renderAhead ? ", render ahead" : "");
+        return Report("plug-in", name);
+    }
+#endif
+}
+
+int main(int argc, char** argv) {
+    for (int i = 1; i < argc; i++) {
+        if (std::strcmp(argv[i], "--blocks") == 0 && i + 1 < argc) {
+            blockCount = std::atoi(argv[++i]);
+        } else {
+            std::fprintf(stderr, "usage: %s [--blocks n]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (!RealtimeAudit_is_supported()) {
+        std::printf("the real-time audit is not supported on this platform\n");
+        return 0;
+    }
+    // The trace buffer of the thread is allocated on the first event.
+    TRACE_INSTANT("vst2413-rtaudit", 0);
+    
+    bool passed = true;
+#ifdef VST2413_TEST_PLUGIN
+    for (int i = 0; i < kSampleRateCount; i++) {
+        passed &= AuditPlugin(kSampleRates[i], false);
+        passed &= AuditPlugin(kSampleRates[i], true);
+    }
+#else
+    for (int i = 0; i < kConfigCount; i++) {
+        passed &= AuditSynth(kConfigs[i]);
+        passed &= AuditRhythm(kConfigs[i]);
+        passed &= AuditRenderAhead(kConfigs[i]);
+    }
+#endif
+    std::printf("%s\n", passed ? "passed" : "FAILED");
+    return passed ? 0 : 1;
+}